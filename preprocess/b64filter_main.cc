@@ -1,11 +1,13 @@
+#include <cerrno>
+#include <cstdlib>
+#include <functional>
 #include <thread>
 #include <unistd.h>
 #include "preprocess/base64.hh"
-#include "preprocess/captive_child.hh"
+#include "preprocess/child_pool.hh"
 #include "util/exception.hh"
 #include "util/file_stream.hh"
 #include "util/file_piece.hh"
-#include "util/pcqueue.hh"
 
 
 namespace {
@@ -15,113 +17,122 @@ struct Document {
 	bool has_trailing_newline;
 };
 
-} // namespace
+// A base64 encoded document is sent decoded as lines and re-encoded when read
+// back, which happens in the reader thread of each child.
+struct DocumentFormat {
+	typedef Document Expect;
+	typedef util::FilePiece Source;
 
-int main(int argc, char **argv) {
-	if (argc < 2) {
-		std::cerr << "usage: " << argv[0] << " command [command-args...]\n";
-		return 1;
+	void Read(util::FilePiece &child_out, Document &document, std::string &out) const {
+		std::string doc;
+		doc.reserve(document.line_cnt * 4096); // 4096 is not a typical line length
+
+		while (document.line_cnt-- > 0) {
+			util::StringPiece line(child_out.ReadLine());
+			doc.append(line.data(), line.length());
+
+			// ReadLine eats line endings. Between lines we definitely
+			// need to add them back. Whether we add the last one depends
+			// on whether the original document had a trailing newline.
+			if (document.line_cnt > 0 || document.has_trailing_newline)
+				doc.push_back('\n');
+		}
+
+		std::string encoded_doc;
+		preprocess::base64_encode(doc, encoded_doc);
+		out += encoded_doc;
 	}
 
-	util::UnboundedSingleQueue<Document> line_cnt_queue;
+	bool AtEnd(util::FilePiece &child_out) const {
+		return preprocess::LineFormat().AtEnd(child_out);
+	}
+};
 
-	util::scoped_fd child_in_fd, child_out_fd;
+typedef preprocess::ChildPool<DocumentFormat> Children;
 
-	pid_t child = preprocess::Launch(argv + 1, child_in_fd, child_out_fd);
+void Feed(Children &children) {
+	util::FilePiece in(STDIN_FILENO);
 
-	std::thread feeder([&child_in_fd, &line_cnt_queue]() {
-		util::FilePiece in(STDIN_FILENO);
-		util::FileStream child_in(child_in_fd.release());
+	// Decoded document buffer
+	std::string doc;
 
-		// Decoded document buffer
-		std::string doc;
+	for (util::StringPiece line : in) {
+		preprocess::base64_decode(line, doc);
 
-		for (util::StringPiece line : in) {
-			preprocess::base64_decode(line, doc);
+		// Description of the document
+		Document doc_desc{
+			.line_cnt = 0,
+			.has_trailing_newline = !doc.empty() && doc.back() == '\n',
+		};
 
-			// Description of the document
-			Document doc_desc{
-				.line_cnt = 0,
-				.has_trailing_newline = doc.back() == '\n',
-			};
+		// Make the the document end with a new line. This to make sure
+		// the next doc we send to the child will be on its own line and the
+		// line_cnt is correct.
+		if (!doc_desc.has_trailing_newline)
+			doc.push_back('\n');
 
-			// Make the the document end with a new line. This to make sure
-			// the next doc we send to the child will be on its own line and the
-			// line_cnt is correct.
-			if (!doc_desc.has_trailing_newline)
-				doc.push_back('\n');
+		doc_desc.line_cnt = count(doc.cbegin(), doc.cend(), '\n');
 
-			doc_desc.line_cnt = count(doc.cbegin(), doc.cend(), '\n');
-			
-			// Send line count first to the reader, so it can start reading as
-			// soon as we start feeding the document to the child.
-			line_cnt_queue.Produce(std::move(doc_desc));
+		// Might block until earlier documents have been written out.
+		children.Send(std::move(doc_desc), doc);
+	}
 
-			// Feed the document to the child.
-			// Might block because it can cause a flush.
-			child_in << doc;
-		}
+	// Closes the children's input once everything was sent.
+	children.Finish();
+}
 
-		// Tell the reader to stop
-		line_cnt_queue.Produce(Document{
-			.line_cnt = 0,
-			.has_trailing_newline = false
-		});
+const unsigned long kMaxJobs = 1024;
 
-		// Flush (blocks).  The FileStream destructor closes.
-		child_in.flush();
-	});
+// Number of children to run, or 0 if arg is not a number from 1 to kMaxJobs.
+size_t parse_jobs(const char *arg) {
+	char *end;
+	errno = 0;
+	unsigned long jobs = std::strtoul(arg, &end, 10);
+	if (*arg == '-' || end == arg || *end || errno || jobs > kMaxJobs)
+		return 0;
+	return jobs;
+}
 
-	std::thread reader([&child_out_fd, &line_cnt_queue]() {
-		util::FileStream out(STDOUT_FILENO);
-		util::FilePiece child_out(child_out_fd.release());
+int usage(char **argv) {
+	std::cerr << "usage: " << argv[0] << " [-j jobs] command [command-args...]\n"
+		    "\n"
+		    "Options:\n"
+		    "  -j <num>  Run <num> copies of the command, each given whole documents.\n"
+		    "            Output order is unchanged.\n";
+	return 1;
+}
 
-		size_t doc_cnt = 0;
-		Document document;
-		std::string doc;
+} // namespace
 
-		while (line_cnt_queue.Consume(document).line_cnt > 0) {
-			++doc_cnt;
-
-			doc.clear();
-			doc.reserve(document.line_cnt * 4096); // 4096 is not a typical line length
-
-			try {
-				while (document.line_cnt-- > 0) {
-        util::StringPiece line(child_out.ReadLine());
-					doc.append(line.data(), line.length());
-
-					// ReadLine eats line endings. Between lines we definitely
-					// need to add them back. Whether we add the last one depends
-					// on whether the original document had a trailing newline.
-					if (document.line_cnt > 0 || document.has_trailing_newline)
-						doc.push_back('\n');
-				}
-			} catch (util::EndOfFileException &e) {
-				UTIL_THROW(util::Exception, "Sub-process stopped producing while expecting more lines while processing document " << doc_cnt);
-			}
-
-			std::string encoded_doc;
-			preprocess::base64_encode(doc, encoded_doc);
-			out << encoded_doc << '\n';
-		}
+int main(int argc, char **argv) {
+	size_t jobs = 1;
+
+	while (true) {
+		int opt = getopt(argc, argv, "+j:h");
+		if (opt == -1)
+			break;
+		if (opt != 'j')
+			return usage(argv);
+		jobs = parse_jobs(optarg);
+		if (jobs < 1)
+			return usage(argv);
+	}
 
-		// Assert that we have consumed all the output of the child program.
-		try {
-			// peek() should now fail on an end of file, the loop above should
-			// already have consumed all output that's there.
-			child_out.peek();
+	if (optind == argc)
+		return usage(argv);
 
-			UTIL_THROW(util::Exception, "sub-process is producing more output than it was given input");
-		} catch (util::EndOfFileException &e) {
-			// Good!
-		}
-	});
+	Children children(argv + optind, jobs);
+
+	std::thread feeder(Feed, std::ref(children));
 
-	int retval = preprocess::Wait(child);
+	{
+		util::FileStream out(STDOUT_FILENO);
+		util::StringPiece encoded_doc;
+		while (children.Receive(encoded_doc))
+			out << encoded_doc << '\n';
+	}
 
 	feeder.join();
-	reader.join();
-	
-	return retval;
+
+	return children.Wait();
 }
@@ -1,11 +1,40 @@
 #pragma once
+#include <cstddef>
 #include <string>
+#include <vector>
 #include "util/string_piece.hh"
 
 namespace preprocess {
 
+// Characters base64_encode writes for size bytes, including padding.
+inline std::size_t base64_encoded_size(std::size_t size) {
+	return 4 * ((size + 2) / 3);
+}
+
+// Most bytes base64_decode can write for size characters.
+inline std::size_t base64_decoded_max(std::size_t size) {
+	return size / 4 * 3 + size % 4 * 3 / 4;
+}
+
 void base64_encode(const util::StringPiece &in, std::string &out);
 
 void base64_decode(const util::StringPiece &in, std::string &out);
 
+// Encode into to, which must have room for base64_encoded_size(in.size())
+// characters.  Returns how many were written.
+std::size_t base64_encode(const util::StringPiece &in, char *to);
+
+// Decode into to, which must have room for base64_decoded_max(in.size())
+// bytes.  Returns how many were written.  Decoding stops at '='.
+std::size_t base64_decode(const util::StringPiece &in, char *to);
+
+// The implementations base64_encode and base64_decode into a buffer can choose
+// from on this CPU, for tests and benchmarks.  The first is scalar.
+struct Base64Codec {
+	const char *name;
+	std::size_t (*encode)(const util::StringPiece &in, char *to);
+	std::size_t (*decode)(const util::StringPiece &in, char *to);
+};
+std::vector<Base64Codec> base64_codecs();
+
 } // namespace preprocess
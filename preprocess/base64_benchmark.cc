@@ -0,0 +1,90 @@
+/* Encode and decode a stream of documents with base64, as b64filter and docenc
+ * do, first into reused std::strings and then into a caller's buffer.
+ */
+#include "base64.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace {
+
+template <class Function> void Measure(const char *name, uint64_t bytes, Function run) {
+  double best = 1e100;
+  uint64_t checksum = 0;
+  for (unsigned i = 0; i < 5; ++i) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    checksum = run();
+    best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  }
+  std::cout << name << ": " << (static_cast<double>(bytes) / best / 1048576.0) << " MB/s of documents (checksum " << checksum << ")" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc > 3) {
+    std::cerr << "Usage: " << argv[0] << " [megabytes] [average document size]\n";
+    return 1;
+  }
+  uint64_t bytes = (argc > 1 ? std::strtoull(argv[1], NULL, 10) : 64) << 20;
+  unsigned long average = argc > 2 ? std::strtoul(argv[2], NULL, 10) : 32768;
+  if (!average) {
+    std::cerr << "The average document size must be positive.\n";
+    return 1;
+  }
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<unsigned long> length(0, 2 * average);
+  std::uniform_int_distribution<int> letter(' ', '~');
+  std::vector<std::string> documents;
+  for (uint64_t total = 0; total < bytes; ) {
+    std::string doc(length(gen), 0);
+    for (char &c : doc) c = static_cast<char>(letter(gen));
+    total += doc.size();
+    documents.push_back(std::move(doc));
+  }
+  std::vector<std::string> encoded(documents.size());
+  for (std::size_t i = 0; i < documents.size(); ++i) {
+    preprocess::base64_encode(documents[i], encoded[i]);
+  }
+  std::cout << documents.size() << " documents of " << average << " bytes on average" << std::endl;
+
+  std::string out;
+  Measure("base64_encode to std::string", bytes, [&] {
+    uint64_t sum = 0;
+    for (const std::string &doc : documents) {
+      preprocess::base64_encode(doc, out);
+      sum += static_cast<unsigned char>(out[out.size() / 2]);
+    }
+    return sum;
+  });
+  Measure("base64_decode to std::string", bytes, [&] {
+    uint64_t sum = 0;
+    for (const std::string &enc : encoded) {
+      preprocess::base64_decode(enc, out);
+      sum += out.size();
+    }
+    return sum;
+  });
+  std::vector<char> buffer(preprocess::base64_encoded_size(2 * average + 1));
+  Measure("base64_encode to buffer", bytes, [&] {
+    uint64_t sum = 0;
+    for (const std::string &doc : documents) {
+      sum += static_cast<unsigned char>(buffer[preprocess::base64_encode(doc, buffer.data()) / 2]);
+    }
+    return sum;
+  });
+  Measure("base64_decode to buffer", bytes, [&] {
+    uint64_t sum = 0;
+    for (const std::string &enc : encoded) {
+      sum += preprocess::base64_decode(enc, buffer.data());
+    }
+    return sum;
+  });
+}
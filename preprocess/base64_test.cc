@@ -0,0 +1,137 @@
+#include "preprocess/base64.hh"
+#include "util/exception.hh"
+
+#define BOOST_TEST_MODULE Base64Test
+#include <boost/test/unit_test.hpp>
+
+#include <random>
+#include <string>
+#include <vector>
+
+namespace preprocess {
+namespace {
+
+// Written after the exact size a buffer needs, to catch stores past it.
+const std::size_t kGuard = 64;
+const char kGuardByte = '\xA5';
+
+std::string random_bytes(std::mt19937 &gen, std::size_t size) {
+	std::uniform_int_distribution<int> byte(0, 255);
+	std::string ret(size, 0);
+	for (char &c : ret) c = static_cast<char>(byte(gen));
+	return ret;
+}
+
+bool guard_intact(const std::vector<char> &buffer, std::size_t size) {
+	for (std::size_t i = size; i < buffer.size(); ++i) {
+		if (buffer[i] != kGuardByte) return false;
+	}
+	return true;
+}
+
+std::string encode(const Base64Codec &codec, const std::string &in) {
+	std::size_t size = base64_encoded_size(in.size());
+	std::vector<char> buffer(size + kGuard, kGuardByte);
+	std::size_t written = codec.encode(in, buffer.data());
+	BOOST_CHECK_EQUAL(size, written);
+	BOOST_CHECK_MESSAGE(guard_intact(buffer, size), codec.name << " wrote past " << size << " characters encoding " << in.size() << " bytes");
+	return std::string(buffer.data(), written);
+}
+
+std::string decode(const Base64Codec &codec, const std::string &in) {
+	std::size_t size = base64_decoded_max(in.size());
+	std::vector<char> buffer(size + kGuard, kGuardByte);
+	std::size_t written = codec.decode(in, buffer.data());
+	BOOST_CHECK_LE(written, size);
+	BOOST_CHECK_MESSAGE(guard_intact(buffer, size), codec.name << " wrote past " << size << " bytes decoding " << in.size() << " characters");
+	return std::string(buffer.data(), written);
+}
+
+BOOST_AUTO_TEST_CASE(KnownValues) {
+	// RFC 4648 section 10.
+	const char *plain[] = {"", "f", "fo", "foo", "foob", "fooba", "foobar"};
+	const char *encoded[] = {"", "Zg==", "Zm8=", "Zm9v", "Zm9vYg==", "Zm9vYmE=", "Zm9vYmFy"};
+	for (const Base64Codec &codec : base64_codecs()) {
+		for (std::size_t i = 0; i < sizeof(plain) / sizeof(const char*); ++i) {
+			BOOST_CHECK_EQUAL(encoded[i], encode(codec, plain[i]));
+			BOOST_CHECK_EQUAL(plain[i], decode(codec, encoded[i]));
+		}
+	}
+	std::string out;
+	base64_encode("foobar", out);
+	BOOST_CHECK_EQUAL("Zm9vYmFy", out);
+	base64_decode("Zm9vYmE=", out);
+	BOOST_CHECK_EQUAL("fooba", out);
+}
+
+// Every length through a few blocks of each kernel, then some long ones.
+BOOST_AUTO_TEST_CASE(MatchesScalar) {
+	std::vector<Base64Codec> codecs(base64_codecs());
+	BOOST_REQUIRE_EQUAL(std::string("scalar"), codecs.front().name);
+	std::mt19937 gen(42);
+	std::vector<std::size_t> sizes;
+	for (std::size_t size = 0; size <= 200; ++size) sizes.push_back(size);
+	for (std::size_t size : {1000, 1023, 4096, 65537}) sizes.push_back(size);
+	for (std::size_t size : sizes) {
+		std::string plain(random_bytes(gen, size));
+		std::string expected(encode(codecs.front(), plain));
+		// Without padding too, which decodes the same.
+		std::string unpadded(expected.substr(0, expected.find('=')));
+		for (const Base64Codec &codec : codecs) {
+			BOOST_CHECK_MESSAGE(expected == encode(codec, plain), codec.name << " encodes " << size << " bytes differently");
+			BOOST_CHECK_MESSAGE(plain == decode(codec, expected), codec.name << " does not round trip " << size << " bytes");
+			BOOST_CHECK_MESSAGE(plain == decode(codec, unpadded), codec.name << " does not round trip " << size << " bytes without padding");
+		}
+	}
+}
+
+// A bad character anywhere before the padding is an error, including in the
+// middle of a block a kernel would take.
+BOOST_AUTO_TEST_CASE(InvalidCharacter) {
+	const char bad[] = {'\0', '\n', ' ', '-', '.', '_', '\x7F', '\x80', '\xFF'};
+	std::mt19937 gen(7);
+	for (std::size_t size : {1, 2, 3, 20, 33, 48, 100}) {
+		std::string encoded;
+		base64_encode(random_bytes(gen, size), encoded);
+		std::size_t data_end = encoded.find('=');
+		if (data_end == std::string::npos) data_end = encoded.size();
+		for (const Base64Codec &codec : base64_codecs()) {
+			for (std::size_t position = 0; position < data_end; ++position) {
+				for (char c : bad) {
+					std::string corrupt(encoded);
+					corrupt[position] = c;
+					std::vector<char> buffer(base64_decoded_max(corrupt.size()) + kGuard, kGuardByte);
+					BOOST_CHECK_THROW(codec.decode(corrupt, buffer.data()), util::Exception);
+					BOOST_CHECK(guard_intact(buffer, base64_decoded_max(corrupt.size())));
+				}
+			}
+		}
+	}
+}
+
+// The lookup table used to be missing a comma, which gave 0x7F and 0xFF values.
+BOOST_AUTO_TEST_CASE(HighCharacters) {
+	std::string out;
+	BOOST_CHECK_THROW(base64_decode("QUJD\x7F", out), util::Exception);
+	BOOST_CHECK_THROW(base64_decode("\xFFQUJD", out), util::Exception);
+	for (const Base64Codec &codec : base64_codecs()) {
+		char buffer[kGuard];
+		BOOST_CHECK_THROW(codec.decode("QUJD\x7F", buffer), util::Exception);
+		BOOST_CHECK_THROW(codec.decode("\xFFQUJD", buffer), util::Exception);
+	}
+}
+
+// Only padding used to throw std::length_error.
+BOOST_AUTO_TEST_CASE(OnlyPadding) {
+	for (const char *padding : {"=", "==", "===", "====", "========"}) {
+		std::string out("not empty");
+		base64_decode(padding, out);
+		BOOST_CHECK_EQUAL("", out);
+		for (const Base64Codec &codec : base64_codecs()) {
+			BOOST_CHECK_EQUAL("", decode(codec, padding));
+		}
+	}
+}
+
+} // namespace
+} // namespace preprocess
@@ -0,0 +1,112 @@
+/* Compare the memory and speed of the cache's key to value storage against
+ * the std::unordered_map and util::Pool it replaced.  Each variant runs in its
+ * own process so peak RSS can be attributed to it.
+ */
+#include "preprocess/cache_table.hh"
+
+#include "util/murmur_hash.hh"
+#include "util/pool.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+struct Workload {
+  uint64_t lines;
+  uint64_t unique;
+  std::string value;
+};
+
+// Every one of the unique keys appears before any repeats.
+uint64_t Key(uint64_t i, const Workload &work) {
+  uint64_t which = i % work.unique;
+  return util::MurmurHashNative(&which, sizeof(uint64_t), 1);
+}
+
+// The original: one heap node per key with a pointer to a pooled copy.
+uint64_t RunUnorderedMap(const Workload &work) {
+  std::unordered_map<uint64_t, util::StringPiece> cache;
+  util::Pool pool;
+  uint64_t checksum = 0;
+  for (uint64_t i = 0; i < work.lines; ++i) {
+    std::pair<std::unordered_map<uint64_t, util::StringPiece>::iterator, bool> res(cache.insert(std::make_pair(Key(i, work), util::StringPiece())));
+    if (res.second) {
+      char *copy_to = static_cast<char*>(pool.Allocate(work.value.size()));
+      std::memcpy(copy_to, work.value.data(), work.value.size());
+      res.first->second = util::StringPiece(copy_to, work.value.size());
+    }
+    checksum += static_cast<unsigned char>(res.first->second.data()[i % work.value.size()]);
+  }
+  return checksum;
+}
+
+uint64_t RunProbingArena(const Workload &work) {
+  preprocess::ProbingIndex index;
+  preprocess::ArenaStore store;
+  struct NoEvict { void operator()(uint64_t) {} } no_evict;
+  uint64_t checksum = 0;
+  uint64_t slot;
+  util::StringPiece value;
+  for (uint64_t i = 0; i < work.lines; ++i) {
+    uint64_t key = Key(i, work);
+    if (index.Find(key, slot)) {
+      value = store.Get(slot);
+    } else {
+      value = store.Set(index.Insert(key, no_evict), work.value);
+    }
+    checksum += static_cast<unsigned char>(value.data()[i % work.value.size()]);
+  }
+  return checksum;
+}
+
+void Measure(const char *name, uint64_t (*run)(const Workload &), const Workload &work) {
+  pid_t pid = fork();
+  if (pid == -1) {
+    std::cerr << "fork failed" << std::endl;
+    std::exit(1);
+  }
+  if (!pid) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    uint64_t checksum = run(work);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double per_key = static_cast<double>(usage.ru_maxrss) * 1024.0 / static_cast<double>(std::min(work.unique, work.lines));
+    std::cout << name << ": " << seconds << " s, peak RSS " << (usage.ru_maxrss / 1024) << " MB, "
+      << per_key << " bytes per unique key including the value (checksum " << checksum << ")" << std::endl;
+    std::exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc > 4) {
+    std::cerr << "Usage: " << argv[0] << " [lines] [unique] [value_length]\n";
+    return 1;
+  }
+  Workload work;
+  work.lines = argc > 1 ? std::strtoull(argv[1], NULL, 10) : 20000000;
+  work.unique = argc > 2 ? std::strtoull(argv[2], NULL, 10) : work.lines / 2;
+  work.value.assign(argc > 3 ? std::strtoull(argv[3], NULL, 10) : 16, 'x');
+  if (!work.unique || work.value.empty()) {
+    std::cerr << "unique and value_length must be positive.\n";
+    return 1;
+  }
+  std::cout << work.lines << " lines, " << work.unique << " unique keys, " << work.value.size() << " byte values" << std::endl;
+  Measure("unordered_map + Pool", RunUnorderedMap, work);
+  Measure("ProbingIndex + ArenaStore", RunProbingArena, work);
+}
@@ -0,0 +1,196 @@
+#include "preprocess/cache_file.hh"
+
+#include "util/exception.hh"
+#include "util/murmur_hash.hh"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+namespace preprocess {
+
+namespace {
+
+const char kIndexMagic[8] = {'C', 'a', 'c', 'h', 'e', 'I', 'x', '1'};
+// Written in native byte order to detect files from other architectures.
+const uint64_t kByteOrder = 0x0102030405060708ULL;
+const float kMultiplier = 1.5;
+
+struct RecordHeader {
+  uint64_t key;
+  uint32_t length;
+  uint32_t checksum;
+};
+
+struct IndexHeader {
+  char magic[8];
+  uint64_t byte_order;
+  // Bytes of the log covered by the index.
+  uint64_t log_bytes;
+  uint64_t entries;
+  uint64_t table_size;
+};
+
+// The hash tables reserve key 0, which is what an empty key hashes to.
+uint64_t TableKey(uint64_t key) {
+  return key ? key : 0x9E3779B97F4A7C15ULL;
+}
+
+uint32_t Checksum(uint64_t key, const void *value, std::size_t length) {
+  return static_cast<uint32_t>(util::MurmurHashNative(value, length, key));
+}
+
+} // namespace
+
+CacheFile::CacheFile(const char *file)
+  : name_(file), index_name_(name_ + ".index"), loaded_end_(0), have_index_(false), index_log_bytes_(0), index_entries_(0) {
+  int fd;
+  UTIL_THROW_IF(-1 == (fd = open(file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)), util::ErrnoException, "while opening cache file " << file);
+  log_.reset(fd);
+  UTIL_THROW_IF(flock(log_.get(), LOCK_EX | LOCK_NB), util::ErrnoException, "Cache file " << file << " is in use by another process");
+  uint64_t size = util::SizeOrThrow(log_.get());
+  if (size) {
+    util::MapRead(util::LAZY, log_.get(), 0, size, log_mem_);
+  }
+  LoadIndex(size);
+  loaded_end_ = Scan(have_index_ ? index_log_bytes_ : 0, size);
+  if (loaded_end_ != size) {
+    std::cerr << "Truncating " << (size - loaded_end_) << " bytes of incomplete records from cache file " << file << std::endl;
+    util::ResizeOrThrow(log_.get(), loaded_end_);
+  }
+  append_end_ = loaded_end_;
+  util::SeekOrThrow(log_.get(), append_end_);
+  append_.reset(new util::FileStream(util::DupOrThrow(log_.get())));
+}
+
+bool CacheFile::Find(uint64_t key, util::StringPiece &value) const {
+  uint64_t offset;
+  CacheIndexTable::ConstIterator index_it;
+  util::AutoProbing<CacheFileEntry, util::IdentityHash>::ConstIterator tail_it;
+  key = TableKey(key);
+  if (have_index_ && index_.Find(key, index_it)) {
+    offset = index_it->offset;
+  } else if (tail_.Find(key, tail_it)) {
+    offset = tail_it->offset;
+  } else {
+    return false;
+  }
+  // Offsets come from a file, so do not trust them to stay in the log.
+  if (offset > loaded_end_ || loaded_end_ - offset < sizeof(RecordHeader)) return false;
+  RecordHeader header;
+  std::memcpy(&header, log_mem_.begin() + offset, sizeof(RecordHeader));
+  if (TableKey(header.key) != key || loaded_end_ - offset - sizeof(RecordHeader) < header.length) return false;
+  value = util::StringPiece(log_mem_.begin() + offset + sizeof(RecordHeader), header.length);
+  return true;
+}
+
+void CacheFile::Append(uint64_t key, const util::StringPiece &value) {
+  RecordHeader header;
+  header.key = key;
+  header.length = value.size();
+  header.checksum = Checksum(key, value.data(), value.size());
+  append_->write(&header, sizeof(RecordHeader));
+  append_->write(value.data(), value.size());
+  appended_.push_back(std::make_pair(TableKey(key), append_end_));
+  append_end_ += sizeof(RecordHeader) + value.size();
+}
+
+void CacheFile::Finish() {
+  // Records must be durable before an index refers to them.
+  append_->flush();
+  util::FSyncOrThrow(log_.get());
+  WriteIndex();
+}
+
+void CacheFile::LoadIndex(uint64_t log_size) {
+  util::scoped_fd fd(open(index_name_.c_str(), O_RDONLY));
+  if (fd.get() == -1) {
+    UTIL_THROW_IF(errno != ENOENT, util::ErrnoException, "while opening " << index_name_);
+    return;
+  }
+  uint64_t size = util::SizeOrThrow(fd.get());
+  if (size < sizeof(IndexHeader)) {
+    std::cerr << "Ignoring truncated cache index " << index_name_ << std::endl;
+    return;
+  }
+  util::MapRead(util::LAZY, fd.get(), 0, size, index_mem_);
+  IndexHeader header;
+  std::memcpy(&header, index_mem_.get(), sizeof(IndexHeader));
+  if (std::memcmp(header.magic, kIndexMagic, sizeof(kIndexMagic)) || header.byte_order != kByteOrder || header.table_size != size - sizeof(IndexHeader) || header.log_bytes > log_size) {
+    std::cerr << "Ignoring cache index " << index_name_ << " because it does not match " << name_ << std::endl;
+    index_mem_.reset();
+    return;
+  }
+  index_ = CacheIndexTable(index_mem_.begin() + sizeof(IndexHeader), header.table_size);
+  have_index_ = true;
+  index_log_bytes_ = header.log_bytes;
+  index_entries_ = header.entries;
+}
+
+uint64_t CacheFile::Scan(uint64_t from, uint64_t log_size) {
+  CacheFileEntry entry;
+  util::AutoProbing<CacheFileEntry, util::IdentityHash>::MutableIterator it;
+  RecordHeader header;
+  uint64_t offset = from;
+  while (log_size - offset >= sizeof(RecordHeader)) {
+    const char *base = log_mem_.begin() + offset;
+    std::memcpy(&header, base, sizeof(RecordHeader));
+    if (log_size - offset - sizeof(RecordHeader) < header.length) break;
+    if (header.checksum != Checksum(header.key, base + sizeof(RecordHeader), header.length)) break;
+    entry.key = TableKey(header.key);
+    entry.offset = offset;
+    tail_.FindOrInsert(entry, it);
+    offset += sizeof(RecordHeader) + header.length;
+  }
+  return offset;
+}
+
+void CacheFile::WriteIndex() {
+  const std::string temp_name(index_name_ + ".tmp");
+  uint64_t entries = index_entries_ + tail_.Size() + appended_.size();
+  std::size_t table_size = CacheIndexTable::Size(entries, kMultiplier);
+  std::size_t size = sizeof(IndexHeader) + table_size;
+  util::scoped_fd file;
+  util::scoped_memory mem(util::MapZeroedWrite(temp_name.c_str(), size, file), size, util::scoped_memory::MMAP_ALLOCATED);
+  CacheIndexTable table(mem.begin() + sizeof(IndexHeader), table_size);
+  uint64_t inserted = 0;
+  CacheIndexTable::MutableIterator it;
+  CacheFileEntry entry;
+  if (have_index_) {
+    for (CacheIndexTable::ConstIterator i = index_.RawBegin(); i != index_.RawEnd(); ++i) {
+      if (i->key && !table.FindOrInsert(*i, it)) ++inserted;
+    }
+  }
+  for (util::AutoProbing<CacheFileEntry, util::IdentityHash>::ConstIterator i = tail_.RawBegin(); i != tail_.RawEnd(); ++i) {
+    if (i->key && !table.FindOrInsert(*i, it)) ++inserted;
+  }
+  for (const std::pair<uint64_t, uint64_t> &a : appended_) {
+    entry.key = a.first;
+    entry.offset = a.second;
+    if (!table.FindOrInsert(entry, it)) ++inserted;
+  }
+  IndexHeader header;
+  std::memcpy(header.magic, kIndexMagic, sizeof(kIndexMagic));
+  header.byte_order = kByteOrder;
+  header.log_bytes = append_end_;
+  header.entries = inserted;
+  header.table_size = table_size;
+  std::memcpy(mem.get(), &header, sizeof(IndexHeader));
+  util::SyncOrThrow(mem.get(), mem.size());
+  mem.reset();
+  file.reset();
+  UTIL_THROW_IF(std::rename(temp_name.c_str(), index_name_.c_str()), util::ErrnoException, "Could not rename " << temp_name << " to " << index_name_);
+  // Make the rename itself durable.
+  std::string::size_type slash = index_name_.rfind('/');
+  const std::string directory(slash == std::string::npos ? "." : (slash ? index_name_.substr(0, slash) : "/"));
+  util::scoped_fd dir(open(directory.c_str(), O_RDONLY | O_DIRECTORY));
+  UTIL_THROW_IF(dir.get() == -1, util::ErrnoException, "while opening directory " << directory);
+  util::FSyncOrThrow(dir.get());
+}
+
+} // namespace preprocess
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "util/file.hh"
+#include "util/file_stream.hh"
+#include "util/mmap.hh"
+#include "util/probing_hash_table.hh"
+#include "util/string_piece.hh"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+namespace preprocess {
+
+// Key to the offset of its record in the log.
+struct CacheFileEntry {
+  typedef uint64_t Key;
+  uint64_t key;
+  uint64_t GetKey() const { return key; }
+  void SetKey(uint64_t to) { key = to; }
+  uint64_t offset;
+};
+
+typedef util::ProbingHashTable<CacheFileEntry, util::IdentityHash> CacheIndexTable;
+
+/* Results of bin/cache kept across runs.
+ *
+ * The file is an append-only log of records: a uint64_t key, uint32_t value
+ * length, uint32_t checksum, then the value.  Loading stops at the first
+ * incomplete or corrupt record and truncates the log there, so a run that was
+ * killed loses at most the results it had not written yet.
+ *
+ * file.index is a snapshot of a probing hash table from key to record offset
+ * covering a prefix of the log.  It is memory mapped and only records after
+ * that prefix are scanned at startup.  Finish writes a new snapshot.
+ *
+ * Find may be called concurrently with Append, which must be called by one
+ * thread at a time.
+ */
+class CacheFile {
+  public:
+    explicit CacheFile(const char *file);
+
+    // Find a value stored by a previous run.
+    bool Find(uint64_t key, util::StringPiece &value) const;
+
+    void Append(uint64_t key, const util::StringPiece &value);
+
+    // Sync the log and update the index.
+    void Finish();
+
+  private:
+    void LoadIndex(uint64_t log_size);
+
+    // Index valid records in [from, log_size) and return where they end.
+    uint64_t Scan(uint64_t from, uint64_t log_size);
+
+    void WriteIndex();
+
+    std::string name_, index_name_;
+
+    util::scoped_fd log_;
+    // Records that existed at startup.
+    util::scoped_memory log_mem_;
+    uint64_t loaded_end_;
+
+    util::scoped_memory index_mem_;
+    CacheIndexTable index_;
+    bool have_index_;
+    uint64_t index_log_bytes_, index_entries_;
+
+    // Records after those covered by the index.
+    util::AutoProbing<CacheFileEntry, util::IdentityHash> tail_;
+
+    std::unique_ptr<util::FileStream> append_;
+    uint64_t append_end_;
+    // Key and offset of records appended by this run.
+    std::vector<std::pair<uint64_t, uint64_t> > appended_;
+};
+
+} // namespace preprocess
@@ -1,4 +1,7 @@
-#include "preprocess/captive_child.hh"
+#include "preprocess/cache_file.hh"
+#include "preprocess/cache_table.hh"
+#include "preprocess/child_pool.hh"
+#include "preprocess/clock_cache.hh"
 #include "preprocess/fields.hh"
 
 #include "util/file_stream.hh"
@@ -6,13 +9,14 @@
 #include "util/file_piece.hh"
 #include "util/murmur_hash.hh"
 #include "util/pcqueue.hh"
-#include "util/pool.hh"
 #include "util/string_piece.hh"
+#include "util/usage.hh"
 
+#include <cstring>
 #include <string>
 #include <thread>
-#include <unordered_map>
 #include <limits>
+#include <memory>
 
 #include <signal.h>
 #include <sys/types.h>
@@ -28,14 +32,31 @@ using namespace preprocess;
 struct Options {
   std::string key;
   char field_separator;
+  std::size_t jobs;
+  std::string cache_file;
+  // 0 for no limit.
+  uint64_t max_memory;
 };
 
 struct QueueEntry {
-  // NULL pointer is poison.
-  // value->data() == NULL means uninitialized
-  util::StringPiece *value;
+  enum Kind {
+    // The value in slot is cached.
+    HIT,
+    // Read the value for slot from child and cache it.
+    MISS,
+    // The value is in the cache file.
+    FOUND,
+    // Free the value in slot.
+    EVICT,
+    POISON
+  };
+  Kind kind;
+  uint64_t slot;
+  uint64_t key;
 };
 
+typedef ChildPool<LineFormat> Children;
+
 struct HashWithSeed {
   HashWithSeed() { hash = 0; }
   void operator()(util::StringPiece sp) { size_t result = util::MurmurHashNative(sp.data(), sp.size(), hash); hash = result; }
@@ -45,73 +66,135 @@ private:
   size_t hash;
 };
 
-void Input(util::UnboundedSingleQueue<QueueEntry> &queue, util::scoped_fd &process_input, std::unordered_map<uint64_t, util::StringPiece> &cache, std::size_t flush_rate, Options &options) {
-  QueueEntry q_entry;
-  {
-    util::FileStream process(process_input.release());
-    std::pair<uint64_t, util::StringPiece> entry;
-    std::size_t flush_count = flush_rate;
-    // Parse column numbers, if given using --key option, into an integer vector (comma separated integers)
-    std::vector<FieldRange> indices;
-    ParseFields(options.key.c_str(), indices);
-    DefragmentFields(indices);
-    for (util::StringPiece l : util::FilePiece(STDIN_FILENO)) {
-      HashWithSeed callback= HashWithSeed();
-      RangeFields(l, indices, options.field_separator, callback);
-      entry.first = callback.get_hash();
-      std::pair<std::unordered_map<uint64_t, util::StringPiece>::iterator, bool> res(cache.insert(entry));
-      if (res.second) {
-        // New entry.  Send to captive process.
-        process << l << '\n';
-        // Guarantee we flush to process every so often.
-        if (!--flush_count) {
-          process.flush();
-          flush_count = flush_rate;
-        }
-      }
-      // Pointer to hash table entry.
-      q_entry.value = &res.first->second;
-      queue.Produce(q_entry);
+// Tell Output to free evicted values.
+class QueueEvict {
+  public:
+    explicit QueueEvict(util::UnboundedSingleQueue<QueueEntry> &queue) : queue_(queue), entry_() {
+      entry_.kind = QueueEntry::EVICT;
+    }
+
+    void operator()(uint64_t slot) {
+      entry_.slot = slot;
+      queue_.Produce(entry_);
     }
+
+  private:
+    util::UnboundedSingleQueue<QueueEntry> &queue_;
+    QueueEntry entry_;
+};
+
+struct Stats {
+  Stats() : hits(0), misses(0), evictions(0) {}
+  uint64_t hits, misses, evictions;
+};
+
+// Unique lines are sent to the children.  Slots are reused only after an
+// EVICT entry, which Output sees after any earlier use of the slot.
+template <class Index> void Input(util::UnboundedSingleQueue<QueueEntry> &queue, Children &children, Index &index, const CacheFile *cache_file, Options &options, Stats &stats) {
+  QueueEntry q_entry = QueueEntry();
+  QueueEvict evict(queue);
+  util::StringPiece found;
+  std::string line;
+  // Parse column numbers, if given using --key option, into an integer vector (comma separated integers)
+  std::vector<FieldRange> indices;
+  ParseFields(options.key.c_str(), indices);
+  DefragmentFields(indices);
+  for (util::StringPiece l : util::FilePiece(STDIN_FILENO)) {
+    HashWithSeed callback= HashWithSeed();
+    RangeFields(l, indices, options.field_separator, callback);
+    q_entry.key = callback.get_hash();
+    if (index.Find(q_entry.key, q_entry.slot)) {
+      q_entry.kind = QueueEntry::HIT;
+      ++stats.hits;
+    } else if (cache_file && cache_file->Find(q_entry.key, found)) {
+      q_entry.kind = QueueEntry::FOUND;
+      ++stats.hits;
+    } else {
+      // New entry.  Send to captive process.
+      q_entry.kind = QueueEntry::MISS;
+      q_entry.slot = index.Insert(q_entry.key, evict);
+      ++stats.misses;
+      line.assign(l.data(), l.size());
+      line += '\n';
+      children.Send(LineFormat::Expect(), line);
+    }
+    queue.Produce(q_entry);
   }
-  // Poison.
-  q_entry.value = NULL;
+  children.Finish();
+  stats.evictions = index.Evictions();
+  q_entry.kind = QueueEntry::POISON;
   queue.Produce(q_entry);
 }
 
+// Values in individual allocations that are freed on eviction.
+class BudgetStore {
+  public:
+    explicit BudgetStore(ClockBudget &budget) : budget_(budget) {}
+
+    util::StringPiece Set(uint64_t slot, util::StringPiece value) {
+      if (slot >= values_.size()) values_.resize(slot + 1);
+      values_[slot].assign(value.data(), value.size());
+      budget_.Store(slot, value.size());
+      return values_[slot];
+    }
+
+    util::StringPiece Get(uint64_t slot) const { return values_[slot]; }
+
+    void Evict(uint64_t slot) {
+      budget_.Release(slot);
+      std::string().swap(values_[slot]);
+    }
+
+  private:
+    ClockBudget &budget_;
+    std::vector<std::string> values_;
+};
+
 // Read from queue.  If it's not in the cache, read the result from the captive
 // process.
-void Output(util::UnboundedSingleQueue<QueueEntry> &queue, util::scoped_fd &process_output) {
+// If cache_file is provided, new results are appended to it.
+template <class Store> void Output(util::UnboundedSingleQueue<QueueEntry> &queue, Children &children, Store &store, CacheFile *cache_file) {
   util::FileStream out(STDOUT_FILENO);
-  util::FilePiece in(process_output.release());
-  // We'll allocate the cached strings into a pool.
-  util::Pool string_pool;
-  // string_pool will return NULL if the first allocation is for empty string.  But we use NULL to indicate a missing value.
-  // This forces the string_pool to always return non-NULL.
-  string_pool.Allocate(1);
   QueueEntry q;
-  while (queue.Consume(q).value) {
-    util::StringPiece &value = *q.value;
-    if (!value.data()) {
-      // New entry, not cached.
-      util::StringPiece got = in.ReadLine();
-      // Allocate memory to store a copy of the line.
-      char *copy_to = (char*)string_pool.Allocate(got.size());
-      memcpy(copy_to, got.data(), got.size());
-      value = util::StringPiece(copy_to, got.size());
+  util::StringPiece value;
+  while (queue.Consume(q).kind != QueueEntry::POISON) {
+    switch (q.kind) {
+      case QueueEntry::HIT:
+        value = store.Get(q.slot);
+        break;
+      case QueueEntry::MISS:
+        UTIL_THROW_IF(!children.Receive(value), util::EndOfFileException, " in output of the child processes");
+        value = store.Set(q.slot, value);
+        if (cache_file) cache_file->Append(q.key, value);
+        break;
+      case QueueEntry::FOUND:
+        cache_file->Find(q.key, value);
+        break;
+      case QueueEntry::EVICT:
+        store.Evict(q.slot);
+        continue;
+      case QueueEntry::POISON:
+        break;
     }
     out << value << '\n';
   }
 }
 
-int main(int argc, char *argv[]) {
-  const std::size_t kFlushRate = 4096;
+template <class Index, class Store> void Run(Children &children, Index &index, Store &store, CacheFile *cache_file, Options &opt, Stats &stats) {
+  util::UnboundedSingleQueue<QueueEntry> queue;
+  // Run Input and Output concurrently.  Arbitrarily, we'll do Output in the main thread.
+  std::thread input([&queue, &children, &index, cache_file, &opt, &stats]{Input(queue, children, index, cache_file, opt, stats);});
+  Output(queue, children, store, cache_file);
+  input.join();
+}
 
+int main(int argc, char *argv[]) {
   // Take into account the number of arguments given to `cache` to delete them from the argv provided to Launch function
   Options opt;
+  std::string max_memory;
   int skip_args = 1;
   for (int arg = 1; arg < argc; arg += 2) {
-    if (!strcmp(argv[arg], "-k") || !strcmp(argv[arg], "-t") || !strcmp(argv[arg], "--key") || !strcmp(argv[arg], "--field_separator")) {
+    if (!strcmp(argv[arg], "-k") || !strcmp(argv[arg], "-t") || !strcmp(argv[arg], "-j") || !strcmp(argv[arg], "--key") || !strcmp(argv[arg], "--field_separator") || !strcmp(argv[arg], "--jobs") || !strcmp(argv[arg], "--cache-file") || !strcmp(argv[arg], "--max-memory")) {
       skip_args += 2;
     } else {
       break;
@@ -121,24 +204,42 @@ int main(int argc, char *argv[]) {
   po::options_description desc("Acts as a cache around another program processing one line in, one line out from stdin to stdout. Input lines with the same key will get the same output value without passing them to the underlying program.  These options control what the key is");
   desc.add_options()
     ("key,k", po::value(&opt.key)->default_value("-"), "Column(s) key to use as the deduplication string")
-    ("field_separator,t", po::value<char>(&opt.field_separator)->default_value('\t'), "use a field separator instead of tab");
+    ("field_separator,t", po::value<char>(&opt.field_separator)->default_value('\t'), "use a field separator instead of tab")
+    ("jobs,j", po::value(&opt.jobs)->default_value(1), "Run this many copies of the program, sending each a share of the unique lines.  Output order is unchanged.")
+    ("cache-file", po::value(&opt.cache_file), "Keep results in this file across runs.  Results already in the file are not recomputed.")
+    ("max-memory", po::value(&max_memory), "Limit the memory used by cached results, e.g. 4G, evicting with CLOCK.  Evicted lines are sent to the program again, so with -k a later line with an evicted key gets its own output.");
   if (argc == 1) {
-    std::cerr << "Usage: " << argv[0] << " [-k 1] [-t ,] cat\n" << desc;
+    std::cerr << "Usage: " << argv[0] << " [-k 1] [-t ,] [-j 4] cat\n" << desc;
     return 1;
   }
   po::variables_map vm;
   po::store(po::parse_command_line(skip_args, argv, desc), vm);
   po::notify(vm);
+  opt.max_memory = max_memory.empty() ? 0 : util::ParseSize(max_memory);
 
-  util::scoped_fd in, out;
-  pid_t child = Launch(argv + skip_args, in, out);
-  util::UnboundedSingleQueue<QueueEntry> queue;
-  // This cache has to be alive for Input and Output because Input passes pointers through the queue.
-  std::unordered_map<uint64_t, util::StringPiece> cache;
-  // Run Input and Output concurrently.  Arbitrarily, we'll do Output in the main thread.
-  std::thread input([&queue, &in, &cache, kFlushRate, &opt]{Input(queue, in, cache, kFlushRate, opt);});
-  Output(queue, out);
-  input.join();
-  return Wait(child);
-}
+  if (!opt.jobs) {
+    std::cerr << "Need at least one job.\n";
+    return 1;
+  }
 
+  std::unique_ptr<CacheFile> cache_file;
+  if (!opt.cache_file.empty()) {
+    cache_file.reset(new CacheFile(opt.cache_file.c_str()));
+  }
+
+  Children children(argv + skip_args, opt.jobs);
+  Stats stats;
+  if (opt.max_memory) {
+    ClockBudget budget(opt.max_memory);
+    ClockIndex index(budget);
+    BudgetStore store(budget);
+    Run(children, index, store, cache_file.get(), opt, stats);
+    std::cerr << "Cache hits: " << stats.hits << " misses: " << stats.misses << " evictions: " << stats.evictions << std::endl;
+  } else {
+    ProbingIndex index;
+    ArenaStore store;
+    Run(children, index, store, cache_file.get(), opt, stats);
+  }
+  if (cache_file) cache_file->Finish();
+  return children.Wait();
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "util/exception.hh"
+#include "util/mmap.hh"
+#include "util/probing_hash_table.hh"
+#include "util/string_piece.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include <stdint.h>
+
+namespace preprocess {
+
+/* Map from 64-bit hash to slot without a memory limit.  Slots are assigned
+ * consecutively and never reused.  Entries are 12 bytes in a probing table
+ * instead of a heap node per key.  Not thread safe.
+ */
+class ProbingIndex {
+  public:
+    bool Find(uint64_t key, uint64_t &slot) const {
+      Table::ConstIterator it;
+      if (!table_.Find(Valid(key), it)) return false;
+      slot = it->slot;
+      return true;
+    }
+
+    // Insert a key that is not present.  Nothing is evicted.
+    template <class Evict> uint64_t Insert(uint64_t key, Evict &) {
+      Entry entry;
+      entry.key = Valid(key);
+      UTIL_THROW_IF2(table_.Size() >= std::numeric_limits<uint32_t>::max(), "Too many unique keys for the cache");
+      entry.slot = table_.Size();
+      table_.Insert(entry);
+      return entry.slot;
+    }
+
+    uint64_t Evictions() const { return 0; }
+
+  private:
+#pragma pack(push)
+#pragma pack(4)
+    struct Entry {
+      typedef uint64_t Key;
+      uint64_t key;
+      uint64_t GetKey() const { return key; }
+      void SetKey(uint64_t to) { key = to; }
+      uint32_t slot;
+    };
+#pragma pack(pop)
+
+    typedef util::AutoProbing<Entry, util::IdentityHash> Table;
+
+    // 0 marks an empty bucket.
+    static uint64_t Valid(uint64_t key) {
+      return key ? key : 0x9E3779B97F4A7C15ULL;
+    }
+
+    Table table_;
+};
+
+/* Values for consecutive slots from ProbingIndex, stored back to back in one
+ * arena.  Only the end offset of each value is kept, so a value costs 8 bytes
+ * on top of its text.  Both grow with HugeRealloc, which can remap instead of
+ * copying, so the arena may move; that is why values are located by offset.
+ * A StringPiece returned by Set or Get is valid until the next Set.
+ */
+class ArenaStore {
+  public:
+    ArenaStore() : used_(0), slots_(0) {}
+
+    util::StringPiece Set(uint64_t slot, util::StringPiece value) {
+      UTIL_THROW_IF2(slot != slots_, "Slots must be filled in order");
+      Reserve(ends_, (slots_ + 1) * sizeof(uint64_t));
+      Reserve(arena_, used_ + value.size());
+      char *to = arena_.begin() + used_;
+      std::memcpy(to, value.data(), value.size());
+      used_ += value.size();
+      Ends()[slots_++] = used_;
+      return util::StringPiece(to, value.size());
+    }
+
+    util::StringPiece Get(uint64_t slot) const {
+      const uint64_t *ends = Ends();
+      uint64_t begin = slot ? ends[slot - 1] : 0;
+      return util::StringPiece(arena_.begin() + begin, ends[slot] - begin);
+    }
+
+    void Evict(uint64_t) {}
+
+  private:
+    static void Reserve(util::scoped_memory &mem, std::size_t size) {
+      if (size <= mem.size()) return;
+      std::size_t want = std::max<std::size_t>(std::max<std::size_t>(mem.size() * 2, size), 4096);
+      if (mem.get()) {
+        util::HugeRealloc(want, false, mem);
+      } else {
+        util::HugeMalloc(want, false, mem);
+      }
+    }
+
+    uint64_t *Ends() { return reinterpret_cast<uint64_t*>(ends_.get()); }
+    const uint64_t *Ends() const { return reinterpret_cast<const uint64_t*>(ends_.get()); }
+
+    util::scoped_memory arena_;
+    uint64_t used_;
+    util::scoped_memory ends_;
+    uint64_t slots_;
+};
+
+} // namespace preprocess
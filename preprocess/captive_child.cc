@@ -23,12 +23,20 @@ void Pipe(util::scoped_fd &first, util::scoped_fd &second) {
   first.reset(fds[0]);
   second.reset(fds[1]);
 }
+
+// Keep other children from inheriting our ends of their siblings' pipes, which
+// would delay end of file on a sibling's stdin until they exit.
+void CloseOnExec(util::scoped_fd &fd) {
+  UTIL_THROW_IF(fcntl(fd.get(), F_SETFD, fcntl(fd.get(), F_GETFD) | FD_CLOEXEC), util::ErrnoException, "fcntl failed");
+}
 } // namespace
 
 pid_t Launch(char *argv[], util::scoped_fd &in, util::scoped_fd &out) {
   util::scoped_fd process_in, process_out;
   Pipe(process_in, in);
   Pipe(out, process_out);
+  CloseOnExec(in);
+  CloseOnExec(out);
 
   // Using self-pipe trick to check whether execvp did not fail: Set up a pipe
   // with FD_CLOEXEC (close on successful exec). In case of failure, we'll
@@ -38,7 +46,7 @@ pid_t Launch(char *argv[], util::scoped_fd &in, util::scoped_fd &out) {
   // (See https://stackoverflow.com/a/1586277)
   util::scoped_fd status_in, status_out;
   Pipe(status_in, status_out);
-  UTIL_THROW_IF(fcntl(status_out.get(), F_SETFD, fcntl(status_out.get(), F_GETFD) | FD_CLOEXEC), util::ErrnoException, "fcntl failed");
+  CloseOnExec(status_out);
 
   pid_t pid = fork();
   UTIL_THROW_IF(pid == -1, util::ErrnoException, "Fork failed");
@@ -0,0 +1,382 @@
+#pragma once
+
+#include "preprocess/captive_child.hh"
+
+#include "util/exception.hh"
+#include "util/file.hh"
+#include "util/file_piece.hh"
+#include "util/fixed_array.hh"
+#include "util/pcqueue.hh"
+#include "util/string_piece.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+namespace preprocess {
+
+/* Runs copies of a child program, sends each a share of the units of work and
+ * returns their results.
+ *
+ * Units are collected into batches of about batch_bytes of input.  Each child
+ * has a thread that takes the next batch from a shared queue of window
+ * entries, so idle children get work first, and a thread that reads the
+ * batch's results back.
+ *
+ * When Ordered, the child must produce exactly one result per unit and results
+ * are returned in input order: batches are numbered and completed batches wait
+ * in a reorder buffer of window entries until their turn.  A reader whose batch
+ * is too far ahead waits, so its child blocks on output and stops taking input.
+ * The input itself is never held back waiting for Receive: a child that
+ * buffers its output, like tr, may need more input before it returns the
+ * batch Receive is waiting for.  Otherwise results are returned as they are
+ * read, through a queue of window entries, and a child may produce any number
+ * of them.
+ *
+ * Format describes a unit:
+ *   typedef ... Expect;  // What a reader needs to know to read back a unit.
+ *   typedef ... Source;  // Reads child output.  Constructed from the fd.
+ *   // Ordered: append the result for a unit to out.  Throw
+ *   // util::EndOfFileException if the output ends first.
+ *   void Read(Source &from, Expect &expect, std::string &out) const;
+ *   // Ordered: whether the child has no output left.
+ *   bool AtEnd(Source &from) const;
+ *   // Unordered: read the next result, returning false at the end.
+ *   bool ReadAny(Source &from, std::string &out) const;
+ * Read and ReadAny are called by reader threads, so this is also where to put
+ * work that should happen in parallel such as compressing results.
+ *
+ * Send and Finish are called by one thread and Receive by another.
+ */
+template <class Format, bool Ordered = true> class ChildPool {
+  public:
+    typedef typename Format::Expect Expect;
+
+    // Defaults for the constructor.
+    static const std::size_t kBatchBytes = 1 << 16;
+    // Smaller batches balance load across several children.
+    static const std::size_t kParallelBatchBytes = 1 << 13;
+    static const std::size_t kWindowPerChild = 4;
+
+    // batch_bytes and window of 0 pick the defaults above.
+    ChildPool(char *argv[], std::size_t jobs, const Format &format = Format(), std::size_t batch_bytes = 0, std::size_t window = 0)
+      : format_(format),
+        batch_bytes_(batch_bytes ? batch_bytes : (jobs == 1 ? kBatchBytes : kParallelBatchBytes)),
+        window_size_(window ? window : kWindowPerChild * jobs),
+        input_(window_size_),
+        next_send_(0),
+        total_(std::numeric_limits<uint64_t>::max()),
+        done_(Ordered ? window_size_ : 0),
+        next_receive_(0),
+        results_(Ordered ? 1 : window_size_),
+        ended_(0),
+        receive_index_(0),
+        children_(jobs) {
+      UTIL_THROW_IF2(!jobs, "Need at least one child process");
+      for (std::size_t i = 0; i < jobs; ++i) {
+        children_.push_back();
+        Child &child = children_.back();
+        child.pid = Launch(argv, child.in, child.out);
+      }
+      for (Child &child : children_) {
+        Child *c = &child;
+        child.writer = std::thread([this, c]{ WriteChild(*c); });
+        child.reader = std::thread([this, c]{ ReadChild(*c, std::integral_constant<bool, Ordered>()); });
+      }
+    }
+
+    // Queue a unit whose input is data.  Blocks if the children are busy.
+    void Send(Expect &&expect, util::StringPiece data) {
+      if (filling_ && !filling_->references.empty()) Dispatch();
+      if (!filling_) filling_ = Allocate();
+      filling_->expect.push_back(std::move(expect));
+      filling_->data.append(data.data(), data.size());
+      filling_->bytes += data.size();
+      if (filling_->bytes >= batch_bytes_) Dispatch();
+    }
+
+    // Like Send, but data is written to the child from where it is with
+    // writev instead of being copied.  It must stay valid until Wait returns.
+    void SendReference(Expect &&expect, util::StringPiece data) {
+      if (filling_ && !filling_->data.empty()) Dispatch();
+      if (!filling_) filling_ = Allocate();
+      filling_->expect.push_back(std::move(expect));
+      filling_->references.push_back(data);
+      filling_->bytes += data.size();
+      if (filling_->bytes >= batch_bytes_) Dispatch();
+    }
+
+    // Send any partial batch and close the children's input.
+    void Finish() {
+      if (filling_ && !filling_->expect.empty()) Dispatch();
+      filling_.reset();
+      {
+        std::lock_guard<std::mutex> guard(done_mutex_);
+        total_ = next_send_;
+      }
+      done_cond_.notify_one();
+      // An empty batch is poison to one writer.
+      for (std::size_t i = 0; i < children_.size(); ++i) {
+        std::unique_ptr<Batch> poison;
+        input_.ProduceSwap(poison);
+      }
+    }
+
+    // Get the next result, which is valid until the next call.  Returns false
+    // once every result has been returned.
+    bool Receive(util::StringPiece &result) {
+      while (!receiving_ || receive_index_ == receiving_->ends.size()) {
+        if (receiving_) Release(std::move(receiving_));
+        if (!NextDone(receiving_)) return false;
+        receive_index_ = 0;
+      }
+      std::size_t begin = receive_index_ ? receiving_->ends[receive_index_ - 1] : 0;
+      result = util::StringPiece(receiving_->results.data() + begin, receiving_->ends[receive_index_] - begin);
+      ++receive_index_;
+      return true;
+    }
+
+    std::size_t Children() const { return children_.size(); }
+
+    // Wait for the threads and children to finish, returning the first nonzero
+    // exit status.  Call after Receive has returned false.
+    int Wait() {
+      int ret = 0;
+      for (Child &child : children_) {
+        child.writer.join();
+        child.reader.join();
+        int status = preprocess::Wait(child.pid);
+        if (!ret) ret = status;
+      }
+      return ret;
+    }
+
+  private:
+    struct Batch {
+      Batch() : bytes(0) {}
+      uint64_t sequence;
+      std::vector<Expect> expect;
+      // Input is either copied to data or referenced.
+      std::string data;
+      std::vector<util::StringPiece> references;
+      std::size_t bytes;
+      std::string results;
+      // End offset of each result in results.
+      std::vector<std::size_t> ends;
+    };
+
+    struct Child {
+      pid_t pid;
+      util::scoped_fd in, out;
+      std::thread writer, reader;
+      // Batches written to this child, in order.  Empty is poison.
+      util::UnboundedSingleQueue<std::unique_ptr<Batch> > pending;
+    };
+
+    std::unique_ptr<Batch> Allocate() {
+      std::lock_guard<std::mutex> guard(free_mutex_);
+      if (free_.empty()) return std::unique_ptr<Batch>(new Batch());
+      std::unique_ptr<Batch> ret(std::move(free_.back()));
+      free_.pop_back();
+      return ret;
+    }
+
+    void Release(std::unique_ptr<Batch> &&batch) {
+      batch->expect.clear();
+      batch->data.clear();
+      batch->references.clear();
+      batch->bytes = 0;
+      batch->results.clear();
+      batch->ends.clear();
+      {
+        std::lock_guard<std::mutex> guard(free_mutex_);
+        free_.push_back(std::move(batch));
+      }
+    }
+
+    void Dispatch() {
+      filling_->sequence = next_send_++;
+      input_.ProduceSwap(filling_);
+    }
+
+    // Write batches to a child until poisoned, then close its input.
+    void WriteChild(Child &child) {
+      util::scoped_fd fd(child.in.release());
+      std::unique_ptr<Batch> batch;
+      std::string data;
+      std::vector<util::StringPiece> references;
+      while (input_.ConsumeSwap(batch)) {
+        // The reader owns the batch once it is pending, so keep the data.
+        data.swap(batch->data);
+        references.swap(batch->references);
+        if (Ordered) {
+          child.pending.Produce(std::move(batch));
+        } else {
+          Release(std::move(batch));
+        }
+        util::WriteOrThrow(fd.get(), data.data(), data.size());
+        data.clear();
+        WriteReferences(fd.get(), references);
+        references.clear();
+      }
+      if (Ordered) child.pending.Produce(std::unique_ptr<Batch>());
+    }
+
+    static void WriteReferences(int fd, std::vector<util::StringPiece> &pieces) {
+      std::vector<struct iovec> vec;
+      vec.reserve(std::min<std::size_t>(pieces.size(), IOV_MAX));
+      for (std::size_t done = 0; done < pieces.size();) {
+        vec.clear();
+        for (std::size_t i = done; i < pieces.size() && vec.size() < IOV_MAX; ++i) {
+          struct iovec v;
+          v.iov_base = const_cast<char*>(pieces[i].data());
+          v.iov_len = pieces[i].size();
+          vec.push_back(v);
+        }
+        ssize_t ret;
+        do {
+          ret = writev(fd, &vec[0], vec.size());
+        } while (ret == -1 && errno == EINTR);
+        UTIL_THROW_IF(ret == -1, util::ErrnoException, "writev to child process");
+        // Skip what was written, leaving any partial piece at the front.
+        std::size_t wrote = ret;
+        while (done < pieces.size() && wrote >= pieces[done].size()) {
+          wrote -= pieces[done].size();
+          ++done;
+        }
+        if (wrote) pieces[done] = util::StringPiece(pieces[done].data() + wrote, pieces[done].size() - wrote);
+      }
+    }
+
+    void ReadChild(Child &child, std::true_type /*ordered*/) {
+      typename Format::Source from(child.out.release());
+      std::unique_ptr<Batch> batch;
+      while (child.pending.Consume(batch)) {
+        try {
+          for (Expect &expect : batch->expect) {
+            format_.Read(from, expect, batch->results);
+            batch->ends.push_back(batch->results.size());
+          }
+        } catch (const util::EndOfFileException &e) {
+          UTIL_THROW(util::Exception, "Child process " << child.pid << " stopped producing output after " << batch->ends.size() << " of the " << batch->expect.size() << " units in its batch " << batch->sequence << ".");
+        }
+        uint64_t sequence = batch->sequence;
+        bool notify;
+        {
+          std::unique_lock<std::mutex> lock(done_mutex_);
+          space_cond_.wait(lock, [this, sequence]{ return sequence < next_receive_ + window_size_; });
+          done_[sequence % window_size_] = std::move(batch);
+          notify = (sequence == next_receive_);
+        }
+        if (notify) done_cond_.notify_one();
+      }
+      UTIL_THROW_IF(!format_.AtEnd(from), util::Exception, "Child process " << child.pid << " is producing more output than it was given input.");
+    }
+
+    void ReadChild(Child &child, std::false_type /*unordered*/) {
+      typename Format::Source from(child.out.release());
+      std::unique_ptr<Batch> batch(Allocate());
+      while (format_.ReadAny(from, batch->results)) {
+        batch->ends.push_back(batch->results.size());
+        results_.ProduceSwap(batch);
+        batch = Allocate();
+      }
+      Release(std::move(batch));
+      // Tell Receive this child is done.
+      results_.ProduceSwap(batch);
+    }
+
+    bool NextDone(std::unique_ptr<Batch> &to) {
+      if (Ordered) {
+        std::unique_lock<std::mutex> lock(done_mutex_);
+        std::unique_ptr<Batch> &slot = done_[next_receive_ % window_size_];
+        done_cond_.wait(lock, [this, &slot]{ return slot || next_receive_ == total_; });
+        if (!slot) return false;
+        to = std::move(slot);
+        ++next_receive_;
+        lock.unlock();
+        space_cond_.notify_all();
+        return true;
+      } else {
+        while (ended_ < children_.size()) {
+          if (results_.ConsumeSwap(to)) return true;
+          ++ended_;
+        }
+        return false;
+      }
+    }
+
+    const Format format_;
+    const std::size_t batch_bytes_;
+    const std::size_t window_size_;
+
+    // Batches waiting for a writer.
+    util::PCQueue<std::unique_ptr<Batch> > input_;
+    std::unique_ptr<Batch> filling_;
+    uint64_t next_send_;
+
+    // Ordered: completed batches by sequence number modulo the window.
+    std::mutex done_mutex_;
+    std::condition_variable done_cond_;
+    // Readers wait for room in the reorder buffer.
+    std::condition_variable space_cond_;
+    uint64_t total_;
+    std::vector<std::unique_ptr<Batch> > done_;
+    uint64_t next_receive_;
+
+    // Unordered: results as they are read.  Empty means a child ended.
+    util::PCQueue<std::unique_ptr<Batch> > results_;
+    std::size_t ended_;
+
+    std::unique_ptr<Batch> receiving_;
+    std::size_t receive_index_;
+
+    std::mutex free_mutex_;
+    std::vector<std::unique_ptr<Batch> > free_;
+
+    util::FixedArray<Child> children_;
+};
+
+template <class Format, bool Ordered> const std::size_t ChildPool<Format, Ordered>::kBatchBytes;
+template <class Format, bool Ordered> const std::size_t ChildPool<Format, Ordered>::kParallelBatchBytes;
+template <class Format, bool Ordered> const std::size_t ChildPool<Format, Ordered>::kWindowPerChild;
+
+// One line in, one line out.
+struct LineFormat {
+  struct Expect {};
+  typedef util::FilePiece Source;
+
+  void Read(util::FilePiece &from, Expect &, std::string &out) const {
+    util::StringPiece line(from.ReadLine());
+    out.append(line.data(), line.size());
+  }
+
+  bool AtEnd(util::FilePiece &from) const {
+    try {
+      from.peek();
+      return false;
+    } catch (const util::EndOfFileException &e) {
+      return true;
+    }
+  }
+
+  bool ReadAny(util::FilePiece &from, std::string &out) const {
+    util::StringPiece line;
+    if (!from.ReadLineOrEOF(line)) return false;
+    out.append(line.data(), line.size());
+    return true;
+  }
+};
+
+} // namespace preprocess
@@ -0,0 +1,186 @@
+#pragma once
+
+#include "util/exception.hh"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <stdint.h>
+
+namespace preprocess {
+
+/* Memory accounting shared by a ClockIndex, which decides what to evict, and
+ * the thread that stores values for its slots.  The value size of each slot
+ * is subtracted exactly once by whichever thread exchanges it for zero, so
+ * eviction can run ahead of the thread storing values.
+ */
+class ClockBudget {
+  public:
+    // Bytes charged for each resident entry in addition to its value: up to
+    // four index buckets, the slot, and the value's container.
+    static const uint64_t kEntryOverhead = 112;
+
+    explicit ClockBudget(uint64_t max_memory)
+      : max_slots_(max_memory / (kEntryOverhead + sizeof(std::atomic<uint32_t>))),
+        sizes_(new std::atomic<uint32_t>[max_slots_]()),
+        limit_(max_memory - max_slots_ * sizeof(std::atomic<uint32_t>)),
+        charged_(0) {
+      UTIL_THROW_IF2(!max_slots_, "Memory limit " << max_memory << " is too small for a single entry.");
+    }
+
+    uint64_t MaxSlots() const { return max_slots_; }
+
+    // Whether resident entries plus one more fit.
+    bool Fits(uint64_t resident) const {
+      return resident < max_slots_ && charged_.load() + (resident + 1) * kEntryOverhead <= limit_;
+    }
+
+    // Called by the thread storing values.
+    void Store(uint64_t slot, uint32_t size) {
+      charged_ += size;
+      sizes_[slot].store(size);
+    }
+
+    // Called by either thread when a value is evicted.
+    void Release(uint64_t slot) {
+      charged_ -= sizes_[slot].exchange(0);
+    }
+
+  private:
+    const uint64_t max_slots_;
+    std::unique_ptr<std::atomic<uint32_t>[]> sizes_;
+    const uint64_t limit_;
+    std::atomic<uint64_t> charged_;
+};
+
+/* Map from 64-bit hash to slot, bounded by a ClockBudget.  When a new key
+ * does not fit, the CLOCK algorithm evicts slots: a hand sweeps the slots,
+ * clearing the referenced bit of slots that were used since it last passed
+ * and evicting the first slot that was not.  The index is open addressing
+ * with linear probing and backward shift deletion so there are no tombstones.
+ * Not thread safe.
+ */
+class ClockIndex {
+  public:
+    explicit ClockIndex(ClockBudget &budget)
+      : budget_(budget), buckets_(16), mask_(15), resident_(0), hand_(0), evictions_(0) {}
+
+    bool Find(uint64_t key, uint64_t &slot) {
+      std::size_t i = Locate(Valid(key));
+      if (!buckets_[i].key) return false;
+      slot = buckets_[i].slot;
+      slots_[slot].referenced = true;
+      return true;
+    }
+
+    // Insert a key that is not present, calling evict(slot) for each slot
+    // evicted to make room.  Returns the slot of the key.
+    template <class Evict> uint64_t Insert(uint64_t key, Evict &evict) {
+      key = Valid(key);
+      while (resident_ && !budget_.Fits(resident_)) {
+        evict(EvictOne());
+      }
+      uint64_t slot;
+      if (free_.empty()) {
+        slot = slots_.size();
+        slots_.emplace_back();
+      } else {
+        slot = free_.back();
+        free_.pop_back();
+      }
+      slots_[slot].key = key;
+      slots_[slot].referenced = false;
+      slots_[slot].used = true;
+      if (++resident_ * 2 > buckets_.size()) Grow();
+      std::size_t i = Locate(key);
+      buckets_[i].key = key;
+      buckets_[i].slot = slot;
+      return slot;
+    }
+
+    uint64_t Evictions() const { return evictions_; }
+
+  private:
+    struct Bucket {
+      Bucket() : key(0), slot(0) {}
+      uint64_t key;
+      uint64_t slot;
+    };
+
+    struct Slot {
+      uint64_t key;
+      bool referenced;
+      bool used;
+    };
+
+    // 0 marks an empty bucket.
+    static uint64_t Valid(uint64_t key) {
+      return key ? key : 0x9E3779B97F4A7C15ULL;
+    }
+
+    // The bucket with key or the empty bucket where it would go.
+    std::size_t Locate(uint64_t key) const {
+      std::size_t i = key & mask_;
+      while (buckets_[i].key && buckets_[i].key != key) {
+        i = (i + 1) & mask_;
+      }
+      return i;
+    }
+
+    uint64_t EvictOne() {
+      while (true) {
+        uint64_t slot = hand_;
+        hand_ = (hand_ + 1 == slots_.size()) ? 0 : hand_ + 1;
+        Slot &s = slots_[slot];
+        if (!s.used) continue;
+        if (s.referenced) {
+          s.referenced = false;
+          continue;
+        }
+        Erase(s.key);
+        s.used = false;
+        free_.push_back(slot);
+        budget_.Release(slot);
+        --resident_;
+        ++evictions_;
+        return slot;
+      }
+    }
+
+    void Erase(uint64_t key) {
+      std::size_t i = Locate(key);
+      // Shift back entries whose probe sequence passes through the hole.
+      for (std::size_t j = (i + 1) & mask_; buckets_[j].key; j = (j + 1) & mask_) {
+        std::size_t ideal = buckets_[j].key & mask_;
+        if (((j - ideal) & mask_) >= ((j - i) & mask_)) {
+          buckets_[i] = buckets_[j];
+          i = j;
+        }
+      }
+      buckets_[i] = Bucket();
+    }
+
+    void Grow() {
+      std::vector<Bucket> old(buckets_.size() * 2);
+      old.swap(buckets_);
+      mask_ = buckets_.size() - 1;
+      for (const Bucket &b : old) {
+        if (b.key) buckets_[Locate(b.key)] = b;
+      }
+    }
+
+    ClockBudget &budget_;
+
+    std::vector<Bucket> buckets_;
+    std::size_t mask_;
+
+    std::vector<Slot> slots_;
+    std::vector<uint64_t> free_;
+    uint64_t resident_;
+    uint64_t hand_;
+
+    uint64_t evictions_;
+};
+
+} // namespace preprocess
@@ -4,6 +4,7 @@
 // Removes duplicate lines.
 // Removes any line that contains invalid UTF-8.
 //
+#include "hash_set.hh"
 #include "util/file_stream.hh"
 #include "util/file_piece.hh"
 #include "util/murmur_hash.hh"
@@ -11,27 +12,25 @@
 #include "util/scoped.hh"
 #include "util/utf8.hh"
 
+#include <boost/program_options.hpp>
+
 #include <iostream>
+#include <memory>
+#include <string>
 
 #include <stdint.h>
 
 namespace {
 
-// Hash table with 64-bit keys.
-struct Entry {
-  typedef uint64_t Key;
-  uint64_t key;
-  uint64_t GetKey() const { return key; }
-  void SetKey(uint64_t to) { key = to; }
-};
-
+typedef preprocess::HashSetEntry Entry;
 typedef util::AutoProbing<Entry, util::IdentityHash> Table;
 
-// Use 64-bit MurmurHash in the hash table.  
-bool IsNewLine(Table &table, util::StringPiece l) {
+// Use 64-bit MurmurHash in the hash table.  Lines in seen count as old.
+bool IsNewLine(Table &table, const preprocess::FrozenHashSet *seen, util::StringPiece l) {
   Table::MutableIterator it;
   Entry entry;
   entry.key = util::MurmurHashNative(l.data(), l.size(), 1);
+  if (seen && seen->Contains(entry.key)) return false;
   return !table.FindOrInsert(entry, it);
 }
 
@@ -50,36 +49,62 @@ util::StringPiece StripSpaces(util::StringPiece ret) {
 } // namespace
 
 int main(int argc, char *argv[]) {
-  if (argc > 2 || (argc == 2 && (!strcmp("-h", argv[1]) || !strcmp("--help", argv[1])))) {
-    std::cerr << "Usage: " << argv[0] << " file_to_remove\nLines that appear in file_to_remove will be excluded from the output.\n" << std::endl;
+  std::string file_to_remove, load_seen, save_seen;
+  namespace po = boost::program_options;
+  po::options_description desc("Arguments");
+  desc.add_options()
+    ("help,h", po::bool_switch(), "Show this help message")
+    ("file_to_remove", po::value(&file_to_remove), "Lines that appear in this file will be excluded from the output")
+    ("load-seen", po::value(&load_seen), "Exclude lines whose hashes were saved by --save-seen")
+    ("save-seen", po::value(&save_seen), "Save hashes of the lines seen to this file");
+  po::positional_options_description pd;
+  pd.add("file_to_remove", 1);
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(pd).run(), vm);
+  if (vm["help"].as<bool>()) {
+    std::cerr << "Usage: " << argv[0] << " [file_to_remove]\nLines that appear in file_to_remove will be excluded from the output.\n" << desc << std::endl;
     return 1;
   }
+  po::notify(vm);
   try {
     Table table;
     util::StringPiece l;
+    std::unique_ptr<preprocess::FrozenHashSet> seen;
+    if (!load_seen.empty()) {
+      seen.reset(new preprocess::FrozenHashSet(load_seen.c_str()));
+    }
 
     // If there's a file to remove lines from, add it to the hash table of lines.
-    if (argc == 2) {
-      util::FilePiece removing(argv[1]);
+    if (!file_to_remove.empty()) {
+      util::FilePiece removing(file_to_remove.c_str());
       while (removing.ReadLineOrEOF(l)) {
-        IsNewLine(table, StripSpaces(l));
+        IsNewLine(table, NULL, StripSpaces(l));
       }
     }
 
     // This is the beginning of a line that delimits documents in the raw files.
     const util::StringPiece remove_line("df6fa1abb58549287111ba8d776733e9");
-    util::FileStream out(1);
-    util::FilePiece in(0, "stdin", &std::cerr);
-    while (in.ReadLineOrEOF(l)) {
-      l = StripSpaces(l);
-      // A line passes if:
-      // It does not begin with the magic document delimiter.
-      // Its 64-bit hash has not been seen before.
-      // and it is valid UTF-8.
-      if (!starts_with(l, remove_line) && IsNewLine(table, l) && util::IsUTF8(l)) {
-        out << l << '\n';
+    {
+      util::FileStream out(1);
+      util::FilePiece in(0, "stdin", &std::cerr);
+      while (in.ReadLineOrEOF(l)) {
+        l = StripSpaces(l);
+        // A line passes if:
+        // It does not begin with the magic document delimiter.
+        // Its 64-bit hash has not been seen before.
+        // and it is valid UTF-8.
+        if (!starts_with(l, remove_line) && IsNewLine(table, seen.get(), l) && util::IsUTF8(l)) {
+          out << l << '\n';
+        }
       }
     }
+
+    if (!save_seen.empty()) {
+      preprocess::HashSetWriter writer(save_seen.c_str(), table.Size() + (seen ? seen->Size() : 0));
+      if (seen) seen->ForEach(writer);
+      writer.InsertTable(table);
+      writer.Finish();
+    }
   } 
   catch (const std::exception &e) {
     std::cerr << e.what() << std::endl;
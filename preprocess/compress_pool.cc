@@ -0,0 +1,118 @@
+#include "preprocess/compress_pool.hh"
+
+#include "util/exception.hh"
+#include "util/file.hh"
+
+#include <limits>
+
+namespace preprocess {
+
+CompressPool::CompressPool(int fd, util::WriteCompressed::Compression compression, int level, std::size_t threads, bool member_per_write, std::size_t batch_bytes)
+  : compression_(compression),
+    level_(level),
+    member_per_write_(member_per_write),
+    batch_bytes_(batch_bytes),
+    window_size_(2 * threads),
+    file_(fd),
+    window_(window_size_),
+    todo_(window_size_),
+    next_send_(0),
+    done_(window_size_),
+    total_(std::numeric_limits<uint64_t>::max()),
+    compressors_(threads),
+    finished_(false) {
+  UTIL_THROW_IF2(!threads, "Need at least one compression thread");
+  for (std::size_t i = 0; i < threads; ++i) {
+    compressors_.push_back(&CompressPool::CompressThread, this);
+  }
+  writer_ = std::thread(&CompressPool::WriteThread, this);
+}
+
+CompressPool::~CompressPool() {
+  if (!finished_) Finish();
+}
+
+void CompressPool::Write(util::StringPiece data) {
+  if (!filling_) {
+    std::lock_guard<std::mutex> guard(free_mutex_);
+    if (free_.empty()) {
+      filling_.reset(new Batch());
+    } else {
+      filling_ = std::move(free_.back());
+      free_.pop_back();
+    }
+  }
+  filling_->raw.append(data.data(), data.size());
+  if (member_per_write_) filling_->ends.push_back(filling_->raw.size());
+  if (filling_->raw.size() >= batch_bytes_) Dispatch();
+}
+
+void CompressPool::Finish() {
+  finished_ = true;
+  if (filling_ && !filling_->raw.empty()) Dispatch();
+  filling_.reset();
+  {
+    std::lock_guard<std::mutex> guard(done_mutex_);
+    total_ = next_send_;
+  }
+  done_cond_.notify_all();
+  for (std::size_t i = 0; i < compressors_.size(); ++i) {
+    std::unique_ptr<Batch> poison;
+    todo_.ProduceSwap(poison);
+  }
+  for (std::thread &t : compressors_) {
+    t.join();
+  }
+  writer_.join();
+  file_.reset();
+}
+
+void CompressPool::Dispatch() {
+  if (!member_per_write_) filling_->ends.push_back(filling_->raw.size());
+  window_.wait();
+  filling_->sequence = next_send_++;
+  todo_.ProduceSwap(filling_);
+}
+
+void CompressPool::CompressThread() {
+  std::unique_ptr<Batch> batch;
+  std::string member;
+  while (todo_.ConsumeSwap(batch)) {
+    std::size_t begin = 0;
+    for (std::size_t end : batch->ends) {
+      util::Compress(compression_, util::StringPiece(batch->raw.data() + begin, end - begin), member, level_);
+      batch->compressed += member;
+      begin = end;
+    }
+    uint64_t sequence = batch->sequence;
+    {
+      std::lock_guard<std::mutex> guard(done_mutex_);
+      done_[sequence % window_size_] = std::move(batch);
+    }
+    done_cond_.notify_all();
+  }
+}
+
+void CompressPool::WriteThread() {
+  for (uint64_t next = 0; ; ++next) {
+    std::unique_ptr<Batch> batch;
+    {
+      std::unique_lock<std::mutex> lock(done_mutex_);
+      std::unique_ptr<Batch> &slot = done_[next % window_size_];
+      done_cond_.wait(lock, [this, &slot, next]{ return slot || next == total_; });
+      if (!slot) return;
+      batch = std::move(slot);
+    }
+    util::WriteOrThrow(file_.get(), batch->compressed.data(), batch->compressed.size());
+    batch->raw.clear();
+    batch->ends.clear();
+    batch->compressed.clear();
+    {
+      std::lock_guard<std::mutex> guard(free_mutex_);
+      free_.push_back(std::move(batch));
+    }
+    window_.post();
+  }
+}
+
+} // namespace preprocess
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "util/compress.hh"
+#include "util/fixed_array.hh"
+#include "util/pcqueue.hh"
+#include "util/string_piece.hh"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+namespace preprocess {
+
+/* Compresses output on a pool of threads and writes it to a file in order.
+ *
+ * Writes are collected into batches of about batch_bytes.  Compression
+ * threads take batches from a queue and a single writer thread appends the
+ * compressed batches to the file as they come up in order, so nothing holds a
+ * lock while compressing.  At most two batches per thread are in flight.
+ *
+ * With member_per_write, each Write becomes its own gzip member or bzip2
+ * stream, as WARC readers that seek to records expect.  Otherwise each batch
+ * is one member.  Either way the output is an ordinary concatenated file.
+ *
+ * Write and Finish are called by one thread.
+ */
+class CompressPool {
+  public:
+    static const std::size_t kBatchBytes = 1 << 20;
+
+    // Takes ownership of fd.
+    CompressPool(int fd, util::WriteCompressed::Compression compression, int level, std::size_t threads, bool member_per_write, std::size_t batch_bytes = kBatchBytes);
+
+    ~CompressPool();
+
+    void Write(util::StringPiece data);
+
+    // Compress and write everything, then close the file.
+    void Finish();
+
+  private:
+    struct Batch {
+      uint64_t sequence;
+      std::string raw;
+      // End offset of each member in raw.
+      std::vector<std::size_t> ends;
+      std::string compressed;
+    };
+
+    void Dispatch();
+
+    void CompressThread();
+
+    void WriteThread();
+
+    const util::WriteCompressed::Compression compression_;
+    const int level_;
+    const bool member_per_write_;
+    const std::size_t batch_bytes_;
+    const std::size_t window_size_;
+
+    util::scoped_fd file_;
+
+    // Counts batches that may be dispatched.
+    util::Semaphore window_;
+    util::PCQueue<std::unique_ptr<Batch> > todo_;
+    std::unique_ptr<Batch> filling_;
+    uint64_t next_send_;
+
+    // Compressed batches by sequence number modulo the window.
+    std::mutex done_mutex_;
+    std::condition_variable done_cond_;
+    std::vector<std::unique_ptr<Batch> > done_;
+    uint64_t total_;
+
+    std::mutex free_mutex_;
+    std::vector<std::unique_ptr<Batch> > free_;
+
+    util::FixedArray<std::thread> compressors_;
+    std::thread writer_;
+    bool finished_;
+};
+
+} // namespace preprocess
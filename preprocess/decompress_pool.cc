@@ -0,0 +1,132 @@
+#include "preprocess/decompress_pool.hh"
+
+#include "util/compress.hh"
+#include "util/exception.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace preprocess {
+
+const std::size_t DecompressPool::kChunkBytes;
+const uint64_t DecompressPool::kNoStart = std::numeric_limits<uint64_t>::max();
+
+DecompressPool::DecompressPool(util::StringPiece compressed, std::size_t threads, std::size_t chunk_bytes)
+  : compressed_(compressed),
+    chunk_bytes_(chunk_bytes),
+    chunks_((compressed.size() + chunk_bytes - 1) / chunk_bytes),
+    window_size_(2 * threads),
+    next_take_(0),
+    next_read_(0),
+    done_(window_size_),
+    stop_(false),
+    position_(0),
+    workers_(threads) {
+  UTIL_THROW_IF2(!threads, "Need at least one decompression thread");
+  for (std::size_t i = 0; i < threads; ++i) {
+    workers_.push_back(&DecompressPool::DecompressThread, this);
+  }
+}
+
+DecompressPool::~DecompressPool() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+  }
+  space_cond_.notify_all();
+  for (std::thread &t : workers_) {
+    t.join();
+  }
+}
+
+bool DecompressPool::Read(std::string &out) {
+  while (next_read_ < chunks_) {
+    std::unique_ptr<Chunk> chunk;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      std::unique_ptr<Chunk> &slot = done_[next_read_ % window_size_];
+      done_cond_.wait(lock, [&slot]{ return bool(slot); });
+      chunk = std::move(slot);
+      ++next_read_;
+    }
+    space_cond_.notify_all();
+    uint64_t stop = std::min<uint64_t>(next_read_ * chunk_bytes_, compressed_.size());
+    bool useful = position_ < stop;
+    if (useful) {
+      if (chunk->start != position_) {
+        // A false start, or the chunk began inside a member that ended past
+        // where the worker looked.  Do it properly.
+        chunk->data.clear();
+        chunk->end = Inflate(position_, stop, chunk->data);
+      }
+      position_ = chunk->end;
+      out.swap(chunk->data);
+    }
+    // Otherwise the previous chunk's last member ran through this one.
+    chunk->data.clear();
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      free_.push_back(std::move(chunk));
+    }
+    if (useful) return true;
+  }
+  return false;
+}
+
+uint64_t DecompressPool::Inflate(uint64_t offset, uint64_t stop, std::string &out) const {
+  while (offset < stop) {
+    offset += util::GZDecompressMember(util::StringPiece(compressed_.data() + offset, compressed_.size() - offset), out);
+  }
+  return offset;
+}
+
+void DecompressPool::Speculate(uint64_t index, Chunk &chunk) const {
+  uint64_t begin = index * chunk_bytes_;
+  uint64_t stop = std::min<uint64_t>(begin + chunk_bytes_, compressed_.size());
+  const char *base = compressed_.data();
+  for (uint64_t offset = begin; offset < stop; ++offset) {
+    const char *magic = static_cast<const char*>(memchr(base + offset, '\x1f', stop - offset));
+    if (!magic) break;
+    offset = magic - base;
+    // ID2, deflate, and no reserved flags.
+    if (offset + 4 > compressed_.size() || magic[1] != '\x8b' || magic[2] != '\x08' || (magic[3] & 0xe0)) continue;
+    try {
+      chunk.data.clear();
+      chunk.end = Inflate(offset, stop, chunk.data);
+      chunk.start = offset;
+      return;
+    } catch (const util::Exception &e) {
+      // Not really a member.  Read will sort out a chunk with no start.
+    }
+  }
+  chunk.data.clear();
+  chunk.start = kNoStart;
+}
+
+void DecompressPool::DecompressThread() {
+  while (true) {
+    uint64_t index;
+    std::unique_ptr<Chunk> chunk;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      space_cond_.wait(lock, [this]{ return stop_ || next_take_ == chunks_ || next_take_ < next_read_ + window_size_; });
+      if (stop_ || next_take_ == chunks_) return;
+      index = next_take_++;
+      if (free_.empty()) {
+        chunk.reset(new Chunk());
+      } else {
+        chunk = std::move(free_.back());
+        free_.pop_back();
+      }
+    }
+    Speculate(index, *chunk);
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      done_[index % window_size_] = std::move(chunk);
+    }
+    done_cond_.notify_one();
+  }
+}
+
+} // namespace preprocess
@@ -0,0 +1,84 @@
+#pragma once
+
+#include "util/fixed_array.hh"
+#include "util/string_piece.hh"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+namespace preprocess {
+
+/* Decompresses a file of many concatenated gzip members on a pool of threads
+ * and returns the output in order.
+ *
+ * The compressed data is split into chunks of chunk_bytes.  A thread takes the
+ * next chunk, finds the first gzip header in it that decompresses and inflates
+ * members from there until one starts past the end of the chunk.  Member
+ * boundaries can only be found by inflating, so a header inside compressed
+ * data would be a false start; Read checks that each chunk starts where the
+ * previous one ended and otherwise decompresses that chunk itself from the
+ * right place.  At most two chunks per thread are in flight.
+ *
+ * A file that is one big member, as gzip writes, gets no parallelism and is
+ * decompressed into memory as one piece, so check the members are small first.
+ */
+class DecompressPool {
+  public:
+    static const std::size_t kChunkBytes = 1 << 20;
+
+    // compressed must stay valid until the pool is destroyed.
+    DecompressPool(util::StringPiece compressed, std::size_t threads, std::size_t chunk_bytes = kChunkBytes);
+
+    ~DecompressPool();
+
+    // Replace out with the next piece of decompressed output.  Pieces end on
+    // member boundaries.  Returns false at the end.  Called by one thread.
+    bool Read(std::string &out);
+
+  private:
+    struct Chunk {
+      // Offset of the first member inflated, or kNoStart if none was found.
+      uint64_t start;
+      // Offset after the last member inflated.
+      uint64_t end;
+      std::string data;
+    };
+
+    static const uint64_t kNoStart;
+
+    // Inflate members from offset until one starts at or after stop, appending
+    // to out.  Returns the offset after the last member.
+    uint64_t Inflate(uint64_t offset, uint64_t stop, std::string &out) const;
+
+    void Speculate(uint64_t index, Chunk &chunk) const;
+
+    void DecompressThread();
+
+    const util::StringPiece compressed_;
+    const std::size_t chunk_bytes_;
+    const uint64_t chunks_;
+    const std::size_t window_size_;
+
+    std::mutex mutex_;
+    // Workers wait for room in the window and Read for the next chunk.
+    std::condition_variable space_cond_, done_cond_;
+    uint64_t next_take_;
+    uint64_t next_read_;
+    // Decompressed chunks by index modulo the window.
+    std::vector<std::unique_ptr<Chunk> > done_;
+    std::vector<std::unique_ptr<Chunk> > free_;
+    bool stop_;
+
+    // Offset in compressed_ where the next member starts.
+    uint64_t position_;
+
+    util::FixedArray<std::thread> workers_;
+};
+
+} // namespace preprocess
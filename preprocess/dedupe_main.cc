@@ -1,13 +1,28 @@
 #include "fields.hh"
+#include "hash_set.hh"
+#include "line_batch.hh"
 #include "parallel.hh"
+#include "util/buffered_stream.hh"
+#include "util/file.hh"
+#include "util/file_stream.hh"
+#include "util/fixed_array.hh"
+#include "util/mmap.hh"
 #include "util/murmur_hash.hh"
+#include "util/pcqueue.hh"
 #include "util/probing_hash_table.hh"
 #include "util/scoped.hh"
+#include "util/usage.hh"
 
 #include <boost/program_options.hpp>
 #include <boost/program_options/positional_options.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <thread>
 
 #include <stdint.h>
 
@@ -18,24 +33,40 @@ struct Options {
   std::vector<FieldRange> key_fields;
   char delim;
   std::vector<std::string> files;
+  std::size_t threads;
+  // 0 for no limit.
+  uint64_t memory;
+  std::string temp_prefix;
+  std::string load_seen;
+  std::string save_seen;
 };
 
+const std::size_t kMaxThreads = 1024;
+
 void ParseArgs(int argc, char *argv[], Options &out) {
   namespace po = boost::program_options;
   po::options_description desc("Deduplication settings");
   std::string fields;
+  std::string memory;
 
   desc.add_options()
     ("help,h", po::bool_switch(), "Show this help message")
     ("fields,f", po::value(&fields)->default_value("1-"), "Fields to use for key like cut -f")
     ("delim,d", po::value(&out.delim)->default_value('\t'), "Field delimiter")
-    ("parallel,p", po::value(&out.files)->multitoken(), "Filter parallel data using four files: in_en in_fr out_en out_fr");
+    ("parallel,p", po::value(&out.files)->multitoken(), "Filter parallel data using four files: in_en in_fr out_en out_fr")
+    ("threads,t", po::value(&out.threads)->default_value(1), "Threads to hash and deduplicate with, from 1 to 1024.  Output order is unchanged.")
+    ("memory,S", po::value(&memory), "Limit hash table memory, e.g. 10G, by partitioning hashes to temporary files.")
+    ("temp_prefix,T", po::value(&out.temp_prefix)->default_value(util::DefaultTempDirectory()), "Prefix for temporary files used with --memory.")
+    ("load-seen", po::value(&out.load_seen), "Memory map hashes saved by --save-seen and remove lines with those keys.")
+    ("save-seen", po::value(&out.save_seen), "Save the hashes of loaded and deduplicated keys to this file for --load-seen.");
   po::positional_options_description pd;
   pd.add("parallel", -1);
 
   po::variables_map vm;
   po::store(po::command_line_parser(argc, argv).options(desc).positional(pd).run(), vm);
-  if (vm["help"].as<bool>() || (!out.files.empty() && out.files.size() != 4)) {
+  // Negative values wrap around to huge ones, so bound them.
+  const std::size_t threads = vm["threads"].as<std::size_t>();
+  if (vm["help"].as<bool>() || (!out.files.empty() && out.files.size() != 4) || !threads || threads > kMaxThreads || ((threads > 1 || vm.count("memory")) && vm.count("parallel")) || (threads > 1 && vm.count("memory")) || ((vm.count("load-seen") || vm.count("save-seen")) && vm.count("parallel")) || (vm.count("save-seen") && vm.count("memory"))) {
     std::cerr <<
       "Deduplicate lines in a file.\n"
       "Only 64-bit hashes are kept.  In the event of a hash collision, a unique line\n"
@@ -45,56 +76,460 @@ void ParseArgs(int argc, char *argv[], Options &out) {
       "the first instance of the key is preserved, while the rest are removed.\n" <<
       desc <<
       "Deduplicate lines in a file: " << argv[0] << " <in >out\n"
-      "Deduplicate parallel data, removing if either side is non-unique " << argv[0] << " -p in_en in_fr out_en out_fr\n";
+      "Deduplicate parallel data, removing if either side is non-unique " << argv[0] << " -p in_en in_fr out_en out_fr\n"
+      "Multiple threads, --memory, and seen hashes are only supported when\n"
+      "deduplicating stdin to stdout.  --threads cannot be combined with --memory and\n"
+      "--save-seen cannot be combined with --memory.\n"
+      "Deduplicate against previous runs: " << argv[0] << " --load-seen old --save-seen new <in >out\n";
     exit(1);
   }
   po::notify(vm);
 
   ParseFields(fields.c_str(), out.key_fields);
   DefragmentFields(out.key_fields);
+  out.memory = memory.empty() ? 0 : util::ParseSize(memory);
+  util::NormalizeTempPrefix(out.temp_prefix);
 }
 
-struct Entry {
-  typedef uint64_t Key;
-  uint64_t key;
-  uint64_t GetKey() const { return key; }
-  void SetKey(uint64_t to) { key = to; }
+typedef HashSetEntry Entry;
+typedef util::AutoProbing<Entry, util::IdentityHash> Table;
+
+// Hash the entire line.
+struct LineHasher {
+  uint64_t operator()(const util::StringPiece &line) const {
+    return util::MurmurHashNative(line.data(), line.size(), 1);
+  }
+};
+
+// Hash only the key fields.
+class FieldHasher {
+  public:
+    explicit FieldHasher(const Options &options)
+      : key_fields_(options.key_fields), delim_(options.delim) {}
+
+    uint64_t operator()(const util::StringPiece &line) const {
+      HashCallback hasher(1);
+      RangeFields(line, key_fields_, delim_, hasher);
+      return hasher.Hash();
+    }
+
+  private:
+    std::vector<FieldRange> key_fields_;
+    char delim_;
 };
 
 class Dedupe {
   public:
+    // Keys in seen, if provided, are treated as already present.
+    explicit Dedupe(const FrozenHashSet *seen = NULL) : seen_(seen) {}
+
     bool operator()(const util::StringPiece &line) {
-      return (*this)(util::MurmurHashNative(line.data(), line.size(), 1));
+      return (*this)(LineHasher()(line));
     }
 
     bool operator()(uint64_t key) {
+      if (seen_ && seen_->Contains(key)) return false;
       Entry entry;
       entry.key = key;
       Table::MutableIterator it;
       return !table_.FindOrInsert(entry, it);
     }
 
+    const Table &GetTable() const { return table_; }
+
   private:
-    typedef util::AutoProbing<Entry, util::IdentityHash> Table;
+    const FrozenHashSet *seen_;
     Table table_;
 };
 
 class FieldDedupe : public Dedupe {
   public:
-    explicit FieldDedupe(const Options &options)
-      : key_fields_(options.key_fields), delim_(options.delim) {}
+    explicit FieldDedupe(const Options &options, const FrozenHashSet *seen = NULL) : Dedupe(seen), hasher_(options) {}
 
     bool operator()(const util::StringPiece &line) {
-      HashCallback hasher(1);
-      RangeFields(line, key_fields_, delim_, hasher);
-      return (*static_cast<Dedupe*>(this))(hasher.Hash());
+      return (*static_cast<Dedupe*>(this))(hasher_(line));
     }
 
   private:
-    std::vector<FieldRange> key_fields_;
-    char delim_;
+    FieldHasher hasher_;
+};
+
+// Lines in flight between the reader, the workers, and the writer.
+struct Batch {
+  LineBatch lines;
+  std::vector<uint64_t> hashes;
+  // Not std::vector<bool> because workers write adjacent elements concurrently.
+  std::vector<char> keep;
+  // Workers that have yet to hash their stripe of the batch.
+  std::atomic<std::size_t> hashing;
+  // Posted once per worker when all hashes are available.
+  util::Semaphore hashed;
+  // Workers that have yet to deduplicate their partition of the batch.
+  std::atomic<std::size_t> deduping;
+
+  Batch() : hashed(0) {}
+};
+
+/* Multi-threaded deduplication of stdin to stdout.
+ * Every worker sees every batch in input order.  Worker i hashes the i-th
+ * stripe of lines in the batch then, once all stripes are hashed, owns the
+ * keys whose hash falls into the i-th partition of the hash space.  Since a
+ * key always goes to the same worker and each worker processes batches in
+ * order, the first occurrence of a key is kept exactly as in the single
+ * threaded version.  The last worker to finish a batch hands it to the writer,
+ * which happens in input order because every worker finishes a batch before
+ * starting the next one.
+ */
+template <class Hasher> class ThreadedDedupe {
+  public:
+    ThreadedDedupe(const Hasher &hasher, std::size_t threads, const FrozenHashSet *seen)
+      : hasher_(hasher),
+        threads_(threads),
+        seen_(seen),
+        tables_(threads),
+        batch_count_(2 * threads + 2),
+        batches_(batch_count_),
+        free_(batch_count_),
+        work_(threads),
+        done_(batch_count_ + 1),
+        running_(threads) {
+      for (std::size_t i = 0; i < batch_count_; ++i) {
+        batches_.push_back();
+        free_.Produce(&batches_.back());
+      }
+      for (std::size_t i = 0; i < threads_; ++i) {
+        tables_.push_back();
+        work_.push_back(batch_count_ + 1);
+      }
+    }
+
+    int Run() {
+      std::thread reader(&ThreadedDedupe<Hasher>::Read, this);
+      util::FixedArray<std::thread> workers(threads_);
+      for (std::size_t i = 0; i < threads_; ++i) {
+        workers.push_back(&ThreadedDedupe<Hasher>::Work, this, i);
+      }
+      uint64_t input = 0, output = 0;
+      {
+        util::FileStream out(1);
+        for (Batch *batch; (batch = done_.Consume());) {
+          for (std::size_t i = 0; i < batch->lines.size(); ++i) {
+            if (batch->keep[i]) {
+              out << batch->lines[i] << '\n';
+              ++output;
+            }
+          }
+          input += batch->lines.size();
+          free_.Produce(batch);
+        }
+      }
+      reader.join();
+      for (std::thread &w : workers) {
+        w.join();
+      }
+      ReportKept(input, output);
+      return 0;
+    }
+
+    // Valid after Run.
+    const util::FixedArray<Table> &Tables() const { return tables_; }
+
+  private:
+    static const std::size_t kBatchLines = 16384;
+    static const std::size_t kBatchBytes = 4 << 20;
+
+    void Read() {
+      util::FilePiece in(0, NULL, &std::cerr);
+      for (Batch *batch = free_.Consume(); batch->lines.Read(in, kBatchLines, kBatchBytes); batch = free_.Consume()) {
+        batch->hashes.resize(batch->lines.size());
+        batch->keep.resize(batch->lines.size());
+        batch->hashing = threads_;
+        batch->deduping = threads_;
+        for (std::size_t i = 0; i < threads_; ++i) {
+          work_[i].Produce(batch);
+        }
+      }
+      // Poison.
+      for (std::size_t i = 0; i < threads_; ++i) {
+        work_[i].Produce(NULL);
+      }
+    }
+
+    void Work(std::size_t index) {
+      Table &table = tables_[index];
+      Entry entry;
+      Table::MutableIterator it;
+      for (Batch *batch; (batch = work_[index].Consume());) {
+        const std::size_t size = batch->lines.size();
+        for (std::size_t i = index * size / threads_; i < (index + 1) * size / threads_; ++i) {
+          batch->hashes[i] = hasher_(batch->lines[i]);
+        }
+        if (!--batch->hashing) {
+          for (std::size_t i = 0; i < threads_; ++i) {
+            batch->hashed.post();
+          }
+        }
+        batch->hashed.wait();
+        for (std::size_t i = 0; i < size; ++i) {
+          // The table uses the low bits so partition on the high bits.
+          if ((batch->hashes[i] >> 40) % threads_ != index) continue;
+          entry.key = batch->hashes[i];
+          batch->keep[i] = !(seen_ && seen_->Contains(entry.key)) && !table.FindOrInsert(entry, it);
+        }
+        if (!--batch->deduping) {
+          done_.Produce(batch);
+        }
+      }
+      if (!--running_) {
+        done_.Produce(NULL);
+      }
+    }
+
+    const Hasher hasher_;
+    const std::size_t threads_;
+    const FrozenHashSet *const seen_;
+    util::FixedArray<Table> tables_;
+
+    const std::size_t batch_count_;
+    util::FixedArray<Batch> batches_;
+    util::PCQueue<Batch*> free_;
+    // One queue per worker so every worker sees every batch in order.
+    util::FixedArray<util::PCQueue<Batch*> > work_;
+    util::PCQueue<Batch*> done_;
+
+    std::atomic<std::size_t> running_;
+};
+
+// Save the loaded hashes and those in tables.
+void SaveSeen(const std::string &file, const FrozenHashSet *seen, const Table *begin, const Table *end) {
+  uint64_t entries = seen ? seen->Size() : 0;
+  for (const Table *t = begin; t != end; ++t) {
+    entries += t->Size();
+  }
+  HashSetWriter writer(file.c_str(), entries);
+  if (seen) seen->ForEach(writer);
+  for (const Table *t = begin; t != end; ++t) {
+    writer.InsertTable(*t);
+  }
+  writer.Finish();
+}
+
+template <class Hasher> int RunThreaded(const Hasher &hasher, const Options &options, const FrozenHashSet *seen) {
+  ThreadedDedupe<Hasher> dedupe(hasher, options.threads, seen);
+  int ret = dedupe.Run();
+  if (!options.save_seen.empty()) {
+    SaveSeen(options.save_seen, seen, dedupe.Tables().begin(), dedupe.Tables().end());
+  }
+  return ret;
+}
+
+template <class Pass> int RunSingle(Pass &pass, const Options &options, const FrozenHashSet *seen) {
+  int ret = FilterStdin(pass);
+  if (!options.save_seen.empty()) {
+    SaveSeen(options.save_seen, seen, &pass.GetTable(), &pass.GetTable() + 1);
+  }
+  return ret;
+}
+
+// Temporary files are read back by us, so there is no need to sync them.
+class TempWriter {
+  public:
+    explicit TempWriter(int fd) : fd_(fd) {}
+
+    void write(const void *data, std::size_t amount) {
+      util::WriteOrThrow(fd_, data, amount);
+    }
+
+    void flush() {}
+
+  private:
+    int fd_;
+};
+
+typedef util::BufferedStream<TempWriter> TempStream;
+
+// Sequentially read fixed-size records from the beginning of a temporary file.
+class RecordReader {
+  public:
+    explicit RecordReader(int fd) : fd_(fd), buffer_(kBufferSize), current_(Base()), end_(Base()) {
+      util::SeekOrThrow(fd_, 0);
+    }
+
+    template <class T> bool Read(T &out) {
+      if (current_ == end_) {
+        current_ = Base();
+        end_ = current_ + util::ReadOrEOF(fd_, buffer_.get(), kBufferSize);
+        if (current_ == end_) return false;
+      }
+      UTIL_THROW_IF2(current_ + sizeof(T) > end_, "Truncated temporary file " << util::NameFromFD(fd_));
+      std::memcpy(&out, current_, sizeof(T));
+      current_ += sizeof(T);
+      return true;
+    }
+
+  private:
+    // A multiple of every record size.
+    static const std::size_t kBufferSize = 16384;
+
+    const char *Base() const { return static_cast<const char*>(buffer_.get()); }
+
+    int fd_;
+    util::scoped_malloc buffer_;
+    const char *current_, *end_;
 };
 
+/* Deduplicate stdin to stdout with bounded hash table memory.
+ * 1. Hash every line to a temporary file, copying the lines to another
+ *    temporary file if stdin can't be read twice.
+ * 2. Radix partition the hashes by their top bits so each partition's table
+ *    fits in memory.  Within a partition, hashes stay in input order.
+ * 3. Deduplicate each partition separately with an exactly sized table,
+ *    writing a keep flag for each hash in partition order.
+ * 4. Read the lines again with their hashes, which say which partition's flag
+ *    is next, and output the lines to keep.
+ * All disk access is sequential.
+ */
+class ExternalDedupe {
+  public:
+    ExternalDedupe(uint64_t memory, const std::string &temp_prefix, const FrozenHashSet *seen)
+      : memory_(memory), temp_prefix_(temp_prefix), seen_(seen), lines_(0), bits_(0) {}
+
+    template <class Hasher> int Run(const Hasher &hasher) {
+      HashInput(hasher);
+      ChoosePartitions();
+      Scatter();
+      DedupePartitions();
+      return Output();
+    }
+
+  private:
+    typedef util::ProbingHashTable<Entry, util::IdentityHash> FixedTable;
+    // Too many partitions would exceed open file limits.
+    static const unsigned int kMaxBits = 8;
+    static const float kMultiplier;
+
+    std::size_t Partition(uint64_t hash) const {
+      return bits_ ? (hash >> (64 - bits_)) : 0;
+    }
+
+    template <class Hasher> void HashInput(const Hasher &hasher) {
+      // Regular files can be read again instead of copied.
+      reread_ = util::SizeFile(0) != util::kBadSize;
+      if (reread_) {
+        input_offset_ = util::AdvanceOrThrow(0, 0);
+      } else {
+        lines_file_.reset(util::MakeTemp(temp_prefix_));
+      }
+      hashes_.reset(util::MakeTemp(temp_prefix_));
+      util::FilePiece in(util::DupOrThrow(0), NULL, &std::cerr);
+      TempStream hash_out(hashes_.get());
+      std::unique_ptr<TempStream> lines_out(reread_ ? NULL : new TempStream(lines_file_.get()));
+      for (util::StringPiece line; in.ReadLineOrEOF(line); ++lines_) {
+        uint64_t hash = hasher(line);
+        hash_out.write(&hash, sizeof(uint64_t));
+        if (lines_out) *lines_out << line << '\n';
+      }
+    }
+
+    void ChoosePartitions() {
+      // Slack for uneven partitions.
+      while (bits_ < kMaxBits && static_cast<double>(FixedTable::Size(lines_ >> bits_, kMultiplier)) * 1.1 > memory_) {
+        ++bits_;
+      }
+      if (FixedTable::Size(lines_ >> bits_, kMultiplier) > memory_) {
+        std::cerr << "Warning: " << lines_ << " lines in " << (1 << bits_) << " partitions will exceed the memory limit." << std::endl;
+      }
+    }
+
+    void Scatter() {
+      const std::size_t partitions = static_cast<std::size_t>(1) << bits_;
+      partition_files_.Init(partitions);
+      counts_.resize(partitions);
+      util::FixedArray<TempStream> out(partitions);
+      for (std::size_t i = 0; i < partitions; ++i) {
+        partition_files_.push_back(util::MakeTemp(temp_prefix_));
+        out.push_back(partition_files_.back().get());
+      }
+      RecordReader in(hashes_.get());
+      for (uint64_t hash; in.Read(hash);) {
+        std::size_t p = Partition(hash);
+        out[p].write(&hash, sizeof(uint64_t));
+        ++counts_[p];
+      }
+    }
+
+    void DedupePartitions() {
+      flag_files_.Init(partition_files_.size());
+      // Memory is reused for each partition's table.
+      util::scoped_memory mem;
+      util::HugeMalloc(FixedTable::Size(*std::max_element(counts_.begin(), counts_.end()), kMultiplier), false, mem);
+      for (std::size_t p = 0; p < partition_files_.size(); ++p) {
+        std::size_t size = FixedTable::Size(counts_[p], kMultiplier);
+        std::memset(mem.get(), 0, size);
+        FixedTable table(mem.get(), size);
+        flag_files_.push_back(util::MakeTemp(temp_prefix_));
+        TempStream flags(flag_files_.back().get());
+        RecordReader in(partition_files_[p].get());
+        Entry entry;
+        FixedTable::MutableIterator it;
+        while (in.Read(entry.key)) {
+          char keep = !(seen_ && seen_->Contains(entry.key)) && !table.FindOrInsert(entry, it);
+          flags.write(&keep, 1);
+        }
+        // Free the disk space.
+        partition_files_[p].reset();
+      }
+    }
+
+    int Output() {
+      util::FixedArray<RecordReader> flags(flag_files_.size());
+      for (util::scoped_fd &f : flag_files_) {
+        flags.push_back(f.get());
+      }
+      RecordReader hashes(hashes_.get());
+      int lines_fd;
+      if (reread_) {
+        lines_fd = util::DupOrThrow(0);
+        util::SeekOrThrow(lines_fd, input_offset_);
+      } else {
+        lines_fd = lines_file_.release();
+        util::SeekOrThrow(lines_fd, 0);
+      }
+      util::FilePiece in(lines_fd);
+      util::FileStream out(1);
+      uint64_t output = 0;
+      for (util::StringPiece line; in.ReadLineOrEOF(line);) {
+        uint64_t hash;
+        char keep;
+        UTIL_THROW_IF2(!hashes.Read(hash), "Input changed while deduplicating.");
+        UTIL_THROW_IF2(!flags[Partition(hash)].Read(keep), "Missing flag for partition " << Partition(hash));
+        if (keep) {
+          out << line << '\n';
+          ++output;
+        }
+      }
+      ReportKept(lines_, output);
+      return 0;
+    }
+
+    const uint64_t memory_;
+    const std::string temp_prefix_;
+    const FrozenHashSet *const seen_;
+
+    bool reread_;
+    uint64_t input_offset_;
+    util::scoped_fd lines_file_;
+    util::scoped_fd hashes_;
+    uint64_t lines_;
+
+    unsigned int bits_;
+    util::FixedArray<util::scoped_fd> partition_files_;
+    std::vector<uint64_t> counts_;
+    util::FixedArray<util::scoped_fd> flag_files_;
+};
+
+const float ExternalDedupe::kMultiplier = 1.5;
+
 } // namespace
 } // namespace preprocess
 
@@ -102,9 +537,38 @@ int main(int argc, char *argv[]) {
   preprocess::Options options;
   ParseArgs(argc, argv, options);
 
-  if (options.key_fields.size() == 1 && options.key_fields[0].begin == 0 && options.key_fields[0].end == preprocess::FieldRange::kInfiniteEnd) {
-    return preprocess::FilterParallel<preprocess::Dedupe>(options.files);
+  bool whole_line = options.key_fields.size() == 1 && options.key_fields[0].begin == 0 && options.key_fields[0].end == preprocess::FieldRange::kInfiniteEnd;
+  std::unique_ptr<preprocess::FrozenHashSet> seen;
+  if (!options.load_seen.empty()) {
+    seen.reset(new preprocess::FrozenHashSet(options.load_seen.c_str()));
+  }
+  if (options.memory) {
+    preprocess::ExternalDedupe external(options.memory, options.temp_prefix, seen.get());
+    if (whole_line) {
+      return external.Run(preprocess::LineHasher());
+    } else {
+      return external.Run(preprocess::FieldHasher(options));
+    }
+  }
+  if (options.threads > 1) {
+    if (whole_line) {
+      return preprocess::RunThreaded(preprocess::LineHasher(), options, seen.get());
+    } else {
+      return preprocess::RunThreaded(preprocess::FieldHasher(options), options, seen.get());
+    }
+  }
+  if (!options.files.empty()) {
+    if (whole_line) {
+      return preprocess::FilterParallel<preprocess::Dedupe>(options.files);
+    } else {
+      return preprocess::FilterParallel<preprocess::FieldDedupe>(options.files, options);
+    }
+  }
+  if (whole_line) {
+    preprocess::Dedupe dedupe(seen.get());
+    return preprocess::RunSingle(dedupe, options, seen.get());
   } else {
-    return preprocess::FilterParallel<preprocess::FieldDedupe>(options.files, options);
+    preprocess::FieldDedupe dedupe(options, seen.get());
+    return preprocess::RunSingle(dedupe, options, seen.get());
   }
 }
@@ -1,7 +1,10 @@
 #include <thread>
 #include <deque>
+#include <functional>
 #include <vector>
+#include <cerrno>
 #include <climits>
+#include <cstdlib>
 #include <cstring>
 #include <type_traits>
 #include <unistd.h>
@@ -10,7 +13,7 @@
 #include "util/file_stream.hh"
 #include "util/file_piece.hh"
 #include "util/utf8.hh"
-#include "preprocess/captive_child.hh"
+#include "preprocess/child_pool.hh"
 
 namespace {
 
@@ -34,6 +37,9 @@ struct program_options : wrap_options {
 	// argv for wrapped command. Should start with the program name and end
 	// with NULL.
 	char **child_argv = 0;
+
+	// Number of copies of the command to run.
+	size_t jobs = 1;
 };
 
 size_t find_delimiter(std::vector<char32_t> const &delimiters, char32_t character) {
@@ -186,14 +192,87 @@ void wrap_lines(util::StringPiece const &line, wrap_options const &options, std:
 	}
 }
 
+// A line is sent as its wrapped pieces and reconstructed when read back.
+struct FoldFormat {
+	typedef DelimiterList Expect;
+	typedef util::FilePiece Source;
+
+	size_t column_width;
+
+	void Read(util::FilePiece &child_out, DelimiterList &delimiters, std::string &sentence) const {
+		// Let's assume that the wrapped process plus the chopped off
+		// delimiters won't be more than twice the input we give it.
+		sentence.reserve(sentence.size() + delimiters.size() * 2 * column_width);
+
+		DelimiterList::forward_iterator delimit(delimiters);
+		for (size_t i = 0; i < delimiters.size(); ++i, ++delimit) {
+			util::StringPiece line(child_out.ReadLine());
+			sentence.append(line.data(), line.length());
+			util::StringPiece delimiter(*delimit);
+			sentence.append(delimiter.data(), delimiter.size());
+		}
+	}
+
+	bool AtEnd(util::FilePiece &child_out) const {
+		return preprocess::LineFormat().AtEnd(child_out);
+	}
+};
+
+typedef preprocess::ChildPool<FoldFormat> Children;
+
+// Wrap lines from stdin and send all the pieces of each line to the children.
+void feed(Children &children, wrap_options const &options) {
+	util::FilePiece in(STDIN_FILENO);
+
+	std::deque<util::StringPiece> lines;
+	std::vector<util::StringPiece> delimiters;
+	std::string pieces;
+	for (util::StringPiece sentence : in) {
+
+		// If there is nothing to wrap, it will end up with a single line
+		// and a single empty delimiter.
+		wrap_lines(sentence, options, lines, delimiters);
+		// assert(lines.size() == delimiters.size());
+
+		pieces.clear();
+		for (auto const &line : lines) {
+			pieces.append(line.data(), line.size());
+			pieces.push_back('\n');
+		}
+
+		// When we're keeping delimiters all of these will be empty strings
+		// but their amount at least will tell the reader thread how many
+		// lines it needs to consume to reconstruct the single line.
+		// Might block until earlier lines have been written out.
+		children.Send(DelimiterList(delimiters), pieces);
+	}
+
+	// Closes the children's input once everything was sent.
+	children.Finish();
+}
+
+const unsigned long kMaxJobs = 1024;
+
+// Number of children to run, or 0 if arg is not a number from 1 to kMaxJobs.
+size_t parse_jobs(const char *arg) {
+	char *end;
+	errno = 0;
+	unsigned long jobs = std::strtoul(arg, &end, 10);
+	if (*arg == '-' || end == arg || *end || errno || jobs > kMaxJobs)
+		return 0;
+	return jobs;
+}
+
 int usage(char **argv) {
-	std::cerr << "usage: " << argv[0] << " [-w width] [-s] [-h] command [command-args ...]\n"
+	std::cerr << "usage: " << argv[0] << " [-w width] [-s] [-j jobs] [-h] command [command-args ...]\n"
 		    "\n"
 		    "Options:\n"
 		    "  -h        Display help\n"
 		    "  -w <num>  Wrap lines to have at most <num> bytes\n"
 		    "  -d <str>  Specify punctuation to break on. Order determines preference.\n"
-		    "  -s        Skip passing punctuation around wrapping points to the command\n";
+		    "  -s        Skip passing punctuation around wrapping points to the command\n"
+		    "  -j <num>  Run <num> copies of the command, each given the pieces of whole\n"
+		    "            lines. Output order is unchanged.\n";
 	return 1;
 }
 
@@ -207,7 +286,7 @@ std::vector<char32_t> parse_delimiters(char *value) {
 
 void parse_options(program_options &options, int argc, char **argv) {
 	while (true) {
-		switch(getopt(argc, argv, "+w:d:sh")) {
+		switch(getopt(argc, argv, "+w:d:sj:h")) {
 			case 'w':
 				options.column_width = std::atoi(optarg);
 				continue;
@@ -220,6 +299,12 @@ void parse_options(program_options &options, int argc, char **argv) {
 				options.keep_delimiters_in_lines = false;
 				continue;
 
+			case 'j':
+				options.jobs = parse_jobs(optarg);
+				if (options.jobs < 1)
+					std::exit(usage(argv));
+				continue;
+
 			case 'h':
 			case '?':
 			default:
@@ -244,108 +329,24 @@ int main(int argc, char **argv) {
 
 	parse_options(options, argc, argv);
 
-	util::UnboundedSingleQueue<DelimiterList> queue;
-
-	util::scoped_fd child_in_fd, child_out_fd;
-
-	pid_t child = preprocess::Launch(options.child_argv, child_in_fd, child_out_fd);
-
-	std::thread feeder([&child_in_fd, &queue, &options]() {
-		util::FilePiece in(STDIN_FILENO);
-		util::FileStream child_in(child_in_fd.release());
-
-		std::deque<util::StringPiece> lines;
-    std::vector<util::StringPiece> delimiters;
-		for (util::StringPiece sentence : in) {
-
-			// If there is nothing to wrap, it will end up with a single line
-			// and a single empty delimiter.
-			wrap_lines(sentence, options, lines, delimiters);
-			// assert(lines.size() == delimiters.size());
-
-			// When we're keeping delimiters all of these will be empty strings
-			// but their amount at least will tell the reader thread how many
-			// lines it needs to consume to reconstruct the single line.
-      DelimiterList list(delimiters);
-			queue.Produce(std::move(list));
-
-			// Feed the document to the child.
-			// Might block because it can cause a flush.
-			for (auto const &line : lines)
-				child_in << line << '\n';
-		}
+	FoldFormat format;
+	format.column_width = options.column_width;
+	Children children(options.child_argv, options.jobs, format);
 
-		// Tell the reader to stop
-		queue.Produce({});
+	std::thread feeder(feed, std::ref(children), std::cref(options));
 
-		// Flush (blocks) & close the child's stdin
-		child_in.flush();
-	});
-
-	std::thread reader([&child_out_fd, &queue, &options]() {
+	{
 		util::FileStream out(STDOUT_FILENO);
-		util::FilePiece child_out(child_out_fd.release());
-
-		DelimiterList delimiters;
-		std::string sentence;
-
-		for (size_t sentence_num = 1; queue.Consume(delimiters).size() > 0; ++sentence_num) {
-			sentence.clear();
-			
-			// Let's assume that the wrapped process plus the chopped off
-			// delimiters won't be more than twice the input we give it.
-			sentence.reserve(delimiters.size() * 2 * options.column_width);
-
-			try {
-        DelimiterList::forward_iterator delimit(delimiters);
-        for (size_t i = 0; i < delimiters.size(); ++i, ++delimit) {
-					util::StringPiece line(child_out.ReadLine());
-					sentence.append(line.data(), line.length());
-          util::StringPiece delimiter(*delimit);
-					sentence.append(delimiter.data(), delimiter.size());
-				}
-			} catch (util::EndOfFileException &e) {
-				UTIL_THROW(util::Exception, "Sub-process stopped producing while expecting more lines for sentence " << sentence_num << ".");
-			}
-
-			// Yes, this might introduce a newline at the end of the file, but
-			// yes that is what we generally want in our pipeline because we
-			// might concatenate all these files and that will mess up if they
-			// don't have a trailing newline.
+		util::StringPiece sentence;
+		// Yes, this might introduce a newline at the end of the file, but
+		// yes that is what we generally want in our pipeline because we
+		// might concatenate all these files and that will mess up if they
+		// don't have a trailing newline.
+		while (children.Receive(sentence))
 			out << sentence << '\n';
+	}
 
-			// Just to check, next time we call Consume(), will we block? If so,
-			// that means we've caught up with the producer. However, the order
-			// the producer fills queue is first giving us a new line-
-			// count and then sending the input to the sub-process. So if we do
-			// not have a new line count yet, the sub-process definitely can't
-			// have new output yet, and peek should block and once it unblocks
-			// we expect to have that line-count waiting. If we still don't,
-			// then what is this output that is being produced by the sub-
-			// process?
-			if (queue.Empty()) {
-				// If peek throws EOF now our sub-process stopped before its
-				// stdin was closed (producer produces the poison before it
-				// closes the sub-process's stdin.)
-				child_out.peek();
-				
-				// peek() came back. We have a line-number now, right? If not
-				// sub-process is producing output without any input to base it
-				// on. Which is bad.
-				if (queue.Empty())
-					UTIL_THROW(util::Exception, "sub-process is producing more output than it was given input");
-			}
-		}
-	});
-
-	int retval = preprocess::Wait(child);
-
-	// Order here doesn't matter that much. If either of the threads is blocked
-	// while the other finishes, it's an error state and the finishing thread
-	// will finish with an uncaught exception, which will just terminate()
-	// everything.
 	feeder.join();
-	reader.join();
-	
-	return retval;
+
+	return children.Wait();
 }
@@ -0,0 +1,70 @@
+#include "preprocess/hash_set.hh"
+
+#include "util/exception.hh"
+#include "util/file.hh"
+
+#include <cstdio>
+#include <cstring>
+
+namespace preprocess {
+
+namespace {
+
+const char kMagic[8] = {'H', 'a', 's', 'h', 'S', 'e', 't', '1'};
+// Written in native byte order to detect files from other architectures.
+const uint64_t kByteOrder = 0x0102030405060708ULL;
+const float kMultiplier = 1.5;
+
+struct Header {
+  char magic[8];
+  uint64_t byte_order;
+  uint64_t entries;
+  uint64_t table_size;
+};
+
+} // namespace
+
+FrozenHashSet::FrozenHashSet(const char *file, util::LoadMethod method) {
+  util::scoped_fd fd(util::OpenReadOrThrow(file));
+  uint64_t size = util::SizeOrThrow(fd.get());
+  UTIL_THROW_IF2(size < sizeof(Header), "Hash set " << file << " is too small to have a header.");
+  util::MapRead(method, fd.get(), 0, size, mem_);
+  Header header;
+  std::memcpy(&header, mem_.get(), sizeof(Header));
+  UTIL_THROW_IF2(std::memcmp(header.magic, kMagic, sizeof(kMagic)), "File " << file << " is not a hash set.");
+  UTIL_THROW_IF2(header.byte_order != kByteOrder, "Hash set " << file << " was written on a machine with different byte order.");
+  UTIL_THROW_IF2(header.table_size != size - sizeof(Header), "Hash set " << file << " has size " << size << " but the header says the table is " << header.table_size << " bytes.");
+  table_ = FrozenHashTable(mem_.begin() + sizeof(Header), header.table_size);
+  entries_ = header.entries;
+}
+
+HashSetWriter::HashSetWriter(const char *file, uint64_t entries)
+  : name_(file), temp_name_(name_ + ".tmp"), entries_(0) {
+  std::size_t table_size = FrozenHashTable::Size(entries, kMultiplier);
+  std::size_t size = sizeof(Header) + table_size;
+  mem_.reset(util::MapZeroedWrite(temp_name_.c_str(), size, file_), size, util::scoped_memory::MMAP_ALLOCATED);
+  table_ = FrozenHashTable(mem_.begin() + sizeof(Header), table_size);
+}
+
+HashSetWriter::~HashSetWriter() {
+  if (file_.get() != -1) {
+    // Abandoned without Finish.
+    mem_.reset();
+    std::remove(temp_name_.c_str());
+  }
+}
+
+void HashSetWriter::Finish() {
+  Header header;
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.byte_order = kByteOrder;
+  header.entries = entries_;
+  header.table_size = mem_.size() - sizeof(Header);
+  std::memcpy(mem_.get(), &header, sizeof(Header));
+  util::SyncOrThrow(mem_.get(), mem_.size());
+  mem_.reset();
+  file_.reset();
+  UTIL_THROW_IF(std::rename(temp_name_.c_str(), name_.c_str()), util::ErrnoException, "Could not rename " << temp_name_ << " to " << name_);
+}
+
+} // namespace preprocess
@@ -0,0 +1,91 @@
+#pragma once
+
+#include "util/file.hh"
+#include "util/mmap.hh"
+#include "util/probing_hash_table.hh"
+
+#include <string>
+
+#include <stdint.h>
+
+namespace preprocess {
+
+// Hash table entry for sets of 64-bit line hashes.
+struct HashSetEntry {
+  typedef uint64_t Key;
+  uint64_t key;
+  uint64_t GetKey() const { return key; }
+  void SetKey(uint64_t to) { key = to; }
+};
+
+typedef util::ProbingHashTable<HashSetEntry, util::IdentityHash> FrozenHashTable;
+
+/* A set of 64-bit hashes saved by HashSetWriter and memory mapped read-only.
+ * Loading is lazy so startup doesn't depend on the size of the set and many
+ * processes can share the same pages.
+ *
+ * The file is a header followed by the buckets of a FrozenHashTable in native
+ * byte order, which is also the byte order of MurmurHashNative.
+ */
+class FrozenHashSet {
+  public:
+    explicit FrozenHashSet(const char *file, util::LoadMethod method = util::LAZY);
+
+    bool Contains(uint64_t key) const {
+      FrozenHashTable::ConstIterator it;
+      return table_.Find(key, it);
+    }
+
+    uint64_t Size() const { return entries_; }
+
+    // Call with every key in the set.
+    template <class Callback> void ForEach(Callback &callback) const {
+      for (FrozenHashTable::ConstIterator i = table_.RawBegin(); i != table_.RawEnd(); ++i) {
+        if (i->key) callback(i->key);
+      }
+    }
+
+  private:
+    util::scoped_memory mem_;
+    FrozenHashTable table_;
+    uint64_t entries_;
+};
+
+/* Build a FrozenHashSet file.  The set is written to a temporary name and
+ * renamed into place by Finish so readers never see a partial file.
+ */
+class HashSetWriter {
+  public:
+    // entries is an upper bound on the number of unique keys that will be inserted.
+    HashSetWriter(const char *file, uint64_t entries);
+
+    ~HashSetWriter();
+
+    // Duplicate keys are fine.
+    void Insert(uint64_t key) {
+      HashSetEntry entry;
+      entry.key = key;
+      FrozenHashTable::MutableIterator it;
+      if (!table_.FindOrInsert(entry, it)) ++entries_;
+    }
+
+    void operator()(uint64_t key) { Insert(key); }
+
+    // Insert all keys in a table with HashSetEntry-like entries.
+    template <class Table> void InsertTable(const Table &table) {
+      for (typename Table::ConstIterator i = table.RawBegin(); i != table.RawEnd(); ++i) {
+        if (i->GetKey()) Insert(i->GetKey());
+      }
+    }
+
+    void Finish();
+
+  private:
+    std::string name_, temp_name_;
+    util::scoped_fd file_;
+    util::scoped_memory mem_;
+    FrozenHashTable table_;
+    uint64_t entries_;
+};
+
+} // namespace preprocess
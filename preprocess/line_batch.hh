@@ -0,0 +1,41 @@
+#pragma once
+
+#include "util/file_piece.hh"
+#include "util/string_piece.hh"
+
+#include <string>
+#include <vector>
+
+namespace preprocess {
+
+// Lines copied out of a FilePiece so they outlive the next read and can be
+// handed to other threads.
+class LineBatch {
+  public:
+    // Replace the contents with up to max_lines lines, stopping early once
+    // max_bytes have been read.  Returns false if the input is exhausted.
+    bool Read(util::FilePiece &in, std::size_t max_lines, std::size_t max_bytes) {
+      text_.clear();
+      ends_.clear();
+      util::StringPiece line;
+      while (ends_.size() < max_lines && text_.size() < max_bytes && in.ReadLineOrEOF(line)) {
+        text_.append(line.data(), line.size());
+        ends_.push_back(text_.size());
+      }
+      return !ends_.empty();
+    }
+
+    std::size_t size() const { return ends_.size(); }
+
+    util::StringPiece operator[](std::size_t i) const {
+      std::size_t begin = i ? ends_[i - 1] : 0;
+      return util::StringPiece(text_.data() + begin, ends_[i] - begin);
+    }
+
+  private:
+    std::string text_;
+    // End offset of each line in text_.
+    std::vector<std::size_t> ends_;
+};
+
+} // namespace preprocess
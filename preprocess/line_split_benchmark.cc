@@ -0,0 +1,120 @@
+/* Compare ways of splitting text into lines: the std::find loop FilePiece
+ * used to have, memchr per line, and util::FindBytes finding many lines per
+ * call, first on a buffer in memory and then through FilePiece.
+ */
+#include "util/file.hh"
+#include "util/file_piece.hh"
+#include "util/find_byte.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+
+#include <stdint.h>
+
+namespace {
+
+// Sum of line lengths, so the work cannot be skipped.
+uint64_t SplitFind(const std::string &text) {
+  uint64_t total = 0;
+  const char *end = text.data() + text.size();
+  for (const char *i = text.data(); i != end;) {
+    const char *newline = std::find(i, end, '\n');
+    total += newline - i;
+    i = newline == end ? end : newline + 1;
+  }
+  return total;
+}
+
+uint64_t SplitFindByte(const std::string &text) {
+  uint64_t total = 0;
+  const char *end = text.data() + text.size();
+  for (const char *i = text.data(); i != end;) {
+    const char *newline = util::FindByte(i, end, '\n');
+    total += newline - i;
+    i = newline == end ? end : newline + 1;
+  }
+  return total;
+}
+
+uint64_t SplitFindBytes(const std::string &text) {
+  uint64_t total = 0;
+  const char *end = text.data() + text.size();
+  const char *newlines[256];
+  const char *i = text.data();
+  while (std::size_t found = util::FindBytes(i, end, '\n', newlines, 256)) {
+    for (std::size_t n = 0; n < found; ++n) {
+      total += newlines[n] - i;
+      i = newlines[n] + 1;
+    }
+  }
+  return total + (end - i);
+}
+
+uint64_t ReadLine(const int &fd) {
+  util::SeekOrThrow(fd, 0);
+  util::FilePiece in(util::DupOrThrow(fd));
+  uint64_t total = 0;
+  util::StringPiece line;
+  while (in.ReadLineOrEOF(line)) total += line.size();
+  return total;
+}
+
+uint64_t ReadLines(const int &fd) {
+  util::SeekOrThrow(fd, 0);
+  util::FilePiece in(util::DupOrThrow(fd));
+  uint64_t total = 0;
+  util::StringPiece lines[256];
+  while (std::size_t found = in.ReadLines(lines, 256)) {
+    for (std::size_t n = 0; n < found; ++n) total += lines[n].size();
+  }
+  return total;
+}
+
+template <class Input> void Measure(const char *name, uint64_t (*run)(const Input &), const Input &input, uint64_t bytes) {
+  // Best of a few so page faults and caches settle.
+  double best = 1e100;
+  uint64_t checksum = 0;
+  for (unsigned i = 0; i < 5; ++i) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    checksum = run(input);
+    best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  }
+  std::cout << name << ": " << (static_cast<double>(bytes) / best / 1048576.0) << " MB/s (checksum " << checksum << ")" << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc > 3) {
+    std::cerr << "Usage: " << argv[0] << " [megabytes] [average line length]\n";
+    return 1;
+  }
+  uint64_t bytes = (argc > 1 ? std::strtoull(argv[1], NULL, 10) : 256) << 20;
+  unsigned long average = argc > 2 ? std::strtoul(argv[2], NULL, 10) : 64;
+  if (!average) {
+    std::cerr << "The average line length must be positive.\n";
+    return 1;
+  }
+  std::string text;
+  text.reserve(bytes);
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<unsigned long> length(0, 2 * average);
+  while (text.size() < bytes) {
+    text.append(std::min<uint64_t>(length(gen), bytes - text.size()), 'x');
+    if (text.size() < bytes) text += '\n';
+  }
+  std::cout << (bytes >> 20) << " MB with lines of " << average << " bytes on average" << std::endl;
+  Measure("std::find per line", SplitFind, text, bytes);
+  Measure("FindByte per line", SplitFindByte, text, bytes);
+  Measure("FindBytes batches", SplitFindBytes, text, bytes);
+
+  util::scoped_fd file(util::MakeTemp(util::DefaultTempDirectory() + "line_split_benchmark"));
+  util::WriteOrThrow(file.get(), text.data(), text.size());
+  std::string().swap(text);
+  Measure("FilePiece::ReadLine", ReadLine, file.get(), bytes);
+  Measure("FilePiece::ReadLines", ReadLines, file.get(), bytes);
+}
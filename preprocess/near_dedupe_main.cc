@@ -0,0 +1,358 @@
+/* Remove lines or base64 documents that are near-duplicates of an earlier one.
+ * Text is split into word shingles and summarized with MinHash or SimHash
+ * signatures.  Locality sensitive hashing splits signatures into bands so
+ * that similar documents are likely to share at least one band; candidates
+ * sharing a band are verified against the stored signature of the earlier
+ * document.
+ */
+#include "base64.hh"
+#include "line_batch.hh"
+#include "parallel.hh"
+#include "util/file_piece.hh"
+#include "util/file_stream.hh"
+#include "util/fixed_array.hh"
+#include "util/murmur_hash.hh"
+#include "util/pcqueue.hh"
+#include "util/probing_hash_table.hh"
+#include "util/tokenize_piece.hh"
+
+#include <boost/program_options.hpp>
+
+#include <algorithm>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+namespace preprocess {
+namespace {
+
+struct Options {
+  std::size_t shingle;
+  bool base64;
+  bool simhash;
+  std::size_t bands;
+  std::size_t rows;
+  float threshold;
+  unsigned int distance;
+  std::size_t threads;
+};
+
+void ParseArgs(int argc, char *argv[], Options &out) {
+  namespace po = boost::program_options;
+  po::options_description desc("Near-duplicate removal settings");
+  desc.add_options()
+    ("help,h", po::bool_switch(), "Show this help message")
+    ("shingle,n", po::value(&out.shingle)->default_value(3), "Words per shingle")
+    ("base64,b", po::bool_switch(&out.base64), "Each line is a base64-encoded document")
+    ("simhash", po::bool_switch(&out.simhash), "Use 64-bit SimHash instead of MinHash")
+    ("bands", po::value(&out.bands)->default_value(20), "MinHash: LSH bands")
+    ("rows", po::value(&out.rows)->default_value(6), "MinHash: hashes per band")
+    ("threshold,j", po::value(&out.threshold)->default_value(0.7), "MinHash: remove documents with estimated Jaccard similarity at least this")
+    ("distance,k", po::value(&out.distance)->default_value(3), "SimHash: remove documents within this Hamming distance")
+    ("threads,t", po::value(&out.threads)->default_value(1), "Threads to compute signatures with.  Output order is unchanged.");
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+  if (vm["help"].as<bool>() || !vm["shingle"].as<std::size_t>() || !vm["bands"].as<std::size_t>() || !vm["rows"].as<std::size_t>() || !vm["threads"].as<std::size_t>() || vm["distance"].as<unsigned int>() > 31) {
+    std::cerr <<
+      "Remove near-duplicate lines, keeping the first of each cluster.\n"
+      "Lines are split on whitespace into overlapping shingles of words.  With MinHash,\n"
+      "bands * rows hashes are kept per line and a line is removed if an earlier kept\n"
+      "line shares a band and the fraction of matching hashes is at least the\n"
+      "threshold.  The defaults find most pairs with Jaccard similarity above 0.7.\n"
+      "With SimHash, a line is removed if an earlier kept line's 64-bit fingerprint is\n"
+      "within the Hamming distance, which must be at most 31.\n" <<
+      desc <<
+      "Usage: " << argv[0] << " <in >out\n"
+      "Documents: " << argv[0] << " --base64 <base64_documents >out\n";
+    exit(1);
+  }
+  po::notify(vm);
+}
+
+// Deterministic seeds for the MinHash functions.
+uint64_t SplitMix64(uint64_t &state) {
+  uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+// Hash overlapping word n-grams.  Not thread safe due to buffers.
+class Shingler {
+  public:
+    Shingler(std::size_t n, bool base64) : n_(n), base64_(base64) {}
+
+    void operator()(const util::StringPiece &line, std::vector<uint64_t> &shingles) {
+      util::StringPiece text(line);
+      if (base64_) {
+        base64_decode(line, decoded_);
+        text = decoded_;
+      }
+      words_.clear();
+      for (util::TokenIter<util::BoolCharacter, true> it(text, util::kSpaces); it; ++it) {
+        words_.push_back(util::MurmurHashNative(it->data(), it->size()));
+      }
+      shingles.clear();
+      if (words_.empty()) return;
+      // Documents shorter than a shingle are one shingle.
+      std::size_t length = std::min(n_, words_.size());
+      for (std::size_t i = 0; i + length <= words_.size(); ++i) {
+        shingles.push_back(util::MurmurHashNative(&words_[i], length * sizeof(uint64_t), 1));
+      }
+    }
+
+  private:
+    const std::size_t n_;
+    const bool base64_;
+    std::string decoded_;
+    std::vector<uint64_t> words_;
+};
+
+// Make band keys valid for the hash table, which reserves 0.
+uint64_t NonZero(uint64_t key) {
+  return key ? key : 1;
+}
+
+// bands * rows 32-bit minimums of universal hashes.
+class MinHash {
+  public:
+    explicit MinHash(const Options &options)
+      : bands_(options.bands), rows_(options.rows), threshold_(options.threshold) {
+      uint64_t state = 0;
+      for (std::size_t i = 0; i < Words(); ++i) {
+        multiply_.push_back(SplitMix64(state) | 1);
+        add_.push_back(SplitMix64(state));
+      }
+    }
+
+    // Signature size in uint32_t.
+    std::size_t Words() const { return bands_ * rows_; }
+
+    std::size_t Bands() const { return bands_; }
+
+    void Sign(const std::vector<uint64_t> &shingles, uint32_t *out) const {
+      std::fill(out, out + Words(), std::numeric_limits<uint32_t>::max());
+      for (uint64_t shingle : shingles) {
+        for (std::size_t i = 0; i < Words(); ++i) {
+          out[i] = std::min(out[i], static_cast<uint32_t>((multiply_[i] * shingle + add_[i]) >> 32));
+        }
+      }
+    }
+
+    uint64_t BandKey(const uint32_t *signature, std::size_t band) const {
+      return NonZero(util::MurmurHashNative(signature + band * rows_, rows_ * sizeof(uint32_t), band + 1));
+    }
+
+    bool Similar(const uint32_t *a, const uint32_t *b) const {
+      std::size_t matches = 0;
+      for (std::size_t i = 0; i < Words(); ++i) {
+        matches += (a[i] == b[i]);
+      }
+      return static_cast<float>(matches) >= threshold_ * static_cast<float>(Words());
+    }
+
+  private:
+    const std::size_t bands_, rows_;
+    const float threshold_;
+    std::vector<uint64_t> multiply_, add_;
+};
+
+/* 64-bit SimHash stored as two uint32_t.  Split into distance + 1 bands, two
+ * fingerprints within the distance agree on at least one band.
+ */
+class SimHash {
+  public:
+    explicit SimHash(const Options &options) : distance_(options.distance) {}
+
+    std::size_t Words() const { return 2; }
+
+    std::size_t Bands() const { return distance_ + 1; }
+
+    void Sign(const std::vector<uint64_t> &shingles, uint32_t *out) const {
+      int counts[64] = {0};
+      for (uint64_t shingle : shingles) {
+        for (unsigned int bit = 0; bit < 64; ++bit) {
+          counts[bit] += ((shingle >> bit) & 1) ? 1 : -1;
+        }
+      }
+      uint64_t fingerprint = 0;
+      for (unsigned int bit = 0; bit < 64; ++bit) {
+        if (counts[bit] > 0) fingerprint |= static_cast<uint64_t>(1) << bit;
+      }
+      out[0] = static_cast<uint32_t>(fingerprint);
+      out[1] = static_cast<uint32_t>(fingerprint >> 32);
+    }
+
+    uint64_t BandKey(const uint32_t *signature, std::size_t band) const {
+      unsigned int begin = band * 64 / Bands(), end = (band + 1) * 64 / Bands();
+      uint64_t bits = Fingerprint(signature) >> begin;
+      if (end - begin < 64) bits &= (static_cast<uint64_t>(1) << (end - begin)) - 1;
+      return NonZero(util::MurmurHashNative(&bits, sizeof(uint64_t), band + 1));
+    }
+
+    bool Similar(const uint32_t *a, const uint32_t *b) const {
+      return static_cast<unsigned int>(__builtin_popcountll(Fingerprint(a) ^ Fingerprint(b))) <= distance_;
+    }
+
+  private:
+    static uint64_t Fingerprint(const uint32_t *signature) {
+      return static_cast<uint64_t>(signature[0]) | (static_cast<uint64_t>(signature[1]) << 32);
+    }
+
+    const unsigned int distance_;
+};
+
+// Band key to the index of the first kept document with that band.
+struct BandEntry {
+  typedef uint64_t Key;
+  uint64_t key;
+  uint64_t GetKey() const { return key; }
+  void SetKey(uint64_t to) { key = to; }
+  uint64_t document;
+};
+
+typedef util::AutoProbing<BandEntry, util::IdentityHash> BandTable;
+
+struct Batch {
+  LineBatch lines;
+  std::vector<uint32_t> signatures;
+  // Posted when signatures are ready.
+  util::Semaphore ready;
+
+  Batch() : ready(0) {}
+};
+
+/* Workers compute signatures for whole batches in parallel.  The main thread
+ * consumes batches in input order to decide which lines to keep, which is
+ * cheap compared to signing.
+ */
+template <class Signer> class NearDedupe {
+  public:
+    explicit NearDedupe(const Options &options)
+      : options_(options),
+        signer_(options),
+        batch_count_(2 * options.threads + 2),
+        batches_(batch_count_),
+        free_(batch_count_),
+        work_(batch_count_ + options.threads),
+        order_(batch_count_ + 1) {
+      for (std::size_t i = 0; i < batch_count_; ++i) {
+        batches_.push_back();
+        free_.Produce(&batches_.back());
+      }
+    }
+
+    int Run() {
+      std::thread reader(&NearDedupe<Signer>::Read, this);
+      util::FixedArray<std::thread> workers(options_.threads);
+      for (std::size_t i = 0; i < options_.threads; ++i) {
+        workers.push_back(&NearDedupe<Signer>::Work, this);
+      }
+      uint64_t input = 0, output = 0;
+      {
+        util::FileStream out(1);
+        for (Batch *batch; (batch = order_.Consume());) {
+          batch->ready.wait();
+          for (std::size_t i = 0; i < batch->lines.size(); ++i) {
+            if (Keep(&batch->signatures[i * signer_.Words()])) {
+              out << batch->lines[i] << '\n';
+              ++output;
+            }
+          }
+          input += batch->lines.size();
+          free_.Produce(batch);
+        }
+      }
+      reader.join();
+      for (std::thread &w : workers) {
+        w.join();
+      }
+      ReportKept(input, output);
+      return 0;
+    }
+
+  private:
+    static const std::size_t kBatchLines = 4096;
+    static const std::size_t kBatchBytes = 4 << 20;
+
+    void Read() {
+      util::FilePiece in(0, NULL, &std::cerr);
+      for (Batch *batch = free_.Consume(); batch->lines.Read(in, kBatchLines, kBatchBytes); batch = free_.Consume()) {
+        batch->signatures.resize(batch->lines.size() * signer_.Words());
+        work_.Produce(batch);
+        order_.Produce(batch);
+      }
+      // Poison.
+      for (std::size_t i = 0; i < options_.threads; ++i) {
+        work_.Produce(NULL);
+      }
+      order_.Produce(NULL);
+    }
+
+    void Work() {
+      Shingler shingler(options_.shingle, options_.base64);
+      std::vector<uint64_t> shingles;
+      for (Batch *batch; (batch = work_.Consume());) {
+        for (std::size_t i = 0; i < batch->lines.size(); ++i) {
+          shingler(batch->lines[i], shingles);
+          signer_.Sign(shingles, &batch->signatures[i * signer_.Words()]);
+        }
+        batch->ready.post();
+      }
+    }
+
+    bool Keep(const uint32_t *signature) {
+      const std::size_t words = signer_.Words();
+      BandTable::ConstIterator found;
+      for (std::size_t band = 0; band < signer_.Bands(); ++band) {
+        if (table_.Find(signer_.BandKey(signature, band), found) && signer_.Similar(signature, &kept_[found->document * words])) {
+          return false;
+        }
+      }
+      BandEntry entry;
+      entry.document = kept_.size() / words;
+      kept_.insert(kept_.end(), signature, signature + words);
+      BandTable::MutableIterator it;
+      for (std::size_t band = 0; band < signer_.Bands(); ++band) {
+        entry.key = signer_.BandKey(signature, band);
+        table_.FindOrInsert(entry, it);
+      }
+      return true;
+    }
+
+    const Options &options_;
+    const Signer signer_;
+
+    const std::size_t batch_count_;
+    util::FixedArray<Batch> batches_;
+    util::PCQueue<Batch*> free_;
+    util::PCQueue<Batch*> work_;
+    // Batches in input order for the main thread.
+    util::PCQueue<Batch*> order_;
+
+    BandTable table_;
+    // Signatures of kept documents.
+    std::vector<uint32_t> kept_;
+};
+
+} // namespace
+} // namespace preprocess
+
+int main(int argc, char *argv[]) {
+  try {
+    preprocess::Options options;
+    preprocess::ParseArgs(argc, argv, options);
+    if (options.simhash) {
+      return preprocess::NearDedupe<preprocess::SimHash>(options).Run();
+    } else {
+      return preprocess::NearDedupe<preprocess::MinHash>(options).Run();
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+}
@@ -12,27 +12,42 @@
 
 namespace preprocess {
 
+inline void ReportKept(uint64_t input, uint64_t output) {
+  std::cerr << "Kept " << output << " / " << input << " = " << (static_cast<float>(output) / static_cast<float>(input)) << std::endl;
+}
+
+// Filter stdin to stdout with a pass owned by the caller.
+template <class Pass> int FilterStdin(Pass &pass) {
+  uint64_t input = 0, output = 0;
+  util::StringPiece line;
+  util::FilePiece in(0, NULL, &std::cerr);
+  in.StartReadAhead();
+  util::FileStream out(1);
+  while (true) {
+    try {
+      line = in.ReadLine();
+    } catch (const util::EndOfFileException &e) { break; }
+    ++input;
+    if (pass(line)) {
+      out << line << '\n';
+      ++output;
+    }
+  }
+  ReportKept(input, output);
+  return 0;
+}
+
 template <class Pass, class... PassArguments> int FilterParallel(const std::vector<std::string> &files, PassArguments&&... pass_construct) {
   uint64_t input = 0, output = 0;
   if (files.empty()) {
     Pass pass(std::forward<PassArguments>(pass_construct)...);
-    util::StringPiece line;
-    util::FilePiece in(0, NULL, &std::cerr);
-    util::FileStream out(1);
-    while (true) {
-      try {
-        line = in.ReadLine();
-      } catch (const util::EndOfFileException &e) { break; }
-      ++input;
-      if (pass(line)) {
-        out << line << '\n';
-        ++output;
-      }
-    }
+    return FilterStdin(pass);
   } else if (files.size() == 4) {
     Pass pass0(std::forward<PassArguments>(pass_construct)...), pass1(std::forward<PassArguments>(pass_construct)...);
     util::StringPiece line0, line1;
     util::FilePiece in0(files[0].c_str(), &std::cerr), in1(files[1].c_str());
+    in0.StartReadAhead();
+    in1.StartReadAhead();
     util::FileStream out0(util::CreateOrThrow(files[2].c_str())), out1(util::CreateOrThrow(files[3].c_str()));
     while (true) {
       try {
@@ -57,7 +72,7 @@ template <class Pass, class... PassArguments> int FilterParallel(const std::vect
       "To filter parallel files, run in0 in1 out0 out1\n";
     return 1;
   }
-  std::cerr << "Kept " << output << " / " << input << " = " << (static_cast<float>(output) / static_cast<float>(input)) << std::endl;
+  ReportKept(input, output);
   return 0;
 }
 
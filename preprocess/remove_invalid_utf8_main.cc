@@ -4,6 +4,7 @@
 
 int main() {
   util::FilePiece in(0);
+  in.StartReadAhead();
   util::FileStream out(1);
   util::StringPiece line;
   while (in.ReadLineOrEOF(line)) {
@@ -17,6 +17,7 @@ int main(int argc, char *argv[]) {
     return 1;
   }
   util::FilePiece f(0, NULL, &std::cerr);
+  f.StartReadAhead();
   util::FileStream out(1);
   try {
     while (true) {
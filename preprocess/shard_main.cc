@@ -1,12 +1,19 @@
 #include "preprocess/fields.hh"
-#include "util/buffered_stream.hh"
-#include "util/threaded_buffered_stream.hh"
-#include "util/file_piece.hh"
+#include "util/compress.hh"
+#include "util/file.hh"
 #include "util/fixed_array.hh"
 #include "util/murmur_hash.hh"
+#include "util/pcqueue.hh"
 
+#include <condition_variable>
+#include <cstring>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <iomanip>
+#include <thread>
 
 #include <boost/program_options.hpp>
 #include <boost/program_options/positional_options.hpp>
@@ -18,8 +25,15 @@ struct Options {
   char delim;
   std::vector<std::string> outputs;
   util::WriteCompressed::Compression compression;
+  int level;
+  std::size_t threads;
+  std::size_t compress_threads;
+  std::size_t buffer_size;
 };
 
+// Negative thread counts wrap around to huge numbers.
+const std::size_t kMaxThreads = 1024;
+
 void ParseArgs(int argc, char *argv[], Options &out) {
   namespace po = boost::program_options;
   po::options_description desc("Arguments");
@@ -35,7 +49,11 @@ void ParseArgs(int argc, char *argv[], Options &out) {
     ("prefix,p", po::value(&prefix), "Prefix and count of outputs")
     ("number,n", po::value(&number), "Number of shards")
     ("output,o", po::value(&out.outputs)->multitoken(), "Output file names (or just list them without -o)")
-    ("compress,c", po::value(&compression_string)->default_value("none"), "Compression.  One of none, gzip, or bzip2");
+    ("compress,c", po::value(&compression_string)->default_value("none"), "Compression.  One of none, gzip, bzip2, xz, zstd, or lz4")
+    ("level,l", po::value(&out.level)->default_value(-1), "Compression level.  Default: 9 for gzip and bzip2, otherwise the library's default")
+    ("threads,t", po::value(&out.threads)->default_value(std::thread::hardware_concurrency()), "Number of threads hashing input")
+    ("compress-threads", po::value(&out.compress_threads)->default_value(std::thread::hardware_concurrency()), "Number of threads compressing and writing output, shared by all shards.  With gzip and at least two per shard, each shard is one stream compressed in parallel blocks.")
+    ("buffer-size,b", po::value(&out.buffer_size)->default_value(1 << 18), "Bytes of each shard's output to collect before compressing them as one gzip member or stream of the other formats.  Memory use is about this times the number of shards.");
 
   po::positional_options_description pd;
   pd.add("output", -1);
@@ -77,35 +95,340 @@ void ParseArgs(int argc, char *argv[], Options &out) {
     UTIL_THROW_IF2(vm.count("prefix"), "Specify --prefix or --output");
     UTIL_THROW_IF2(vm.count("number") && number != out.outputs.size(), "Number of outputs does not match");
   }
-  if (compression_string == "none") {
-    out.compression = util::WriteCompressed::NONE;
-  } else if (compression_string == "gzip") {
-    out.compression = util::WriteCompressed::GZIP;
-  } else if (compression_string == "bzip2") {
-    out.compression = util::WriteCompressed::BZIP;
-  } else {
-    UTIL_THROW(util::Exception, "Unknown compression algorithm " << compression_string);
+  out.compression = util::ParseCompression(compression_string);
+  if (out.level < 0 && (out.compression == util::WriteCompressed::GZIP || out.compression == util::WriteCompressed::BZIP)) {
+    out.level = 9;
   }
+  if (!out.threads) out.threads = 1;
+  if (!out.compress_threads) out.compress_threads = 1;
+  UTIL_THROW_IF2(out.threads > kMaxThreads, "--threads must be from 1 to " << kMaxThreads);
+  UTIL_THROW_IF2(out.compress_threads > kMaxThreads, "--compress-threads must be from 1 to " << kMaxThreads);
+  UTIL_THROW_IF2(!out.buffer_size, "--buffer-size must be positive");
 }
 
+/* Shards lines in a pipeline.  A thread reads input in batches of whole lines.
+ * Hashing threads take batches from a queue and group each batch's lines by
+ * shard.  The main thread appends each batch's groups to the shards' buffers
+ * in input order, so lines keep their order within a shard.  A full buffer is
+ * compressed as one gzip member or stream by a fixed pool of threads,
+ * however many shards there are, and appended to its file in order.
+ *
+ * With gzip and at least two compress threads per shard, each shard is
+ * instead written by its own WriteCompressed, which splits it into blocks
+ * compressed on its share of the threads like pigz.  A shard is then one
+ * gzip stream whose blocks share a dictionary.
+ */
+class Sharder {
+  public:
+    static const std::size_t kBatchBytes = 1 << 20;
+
+    explicit Sharder(const Options &options)
+      : options_(options),
+        window_size_(2 * options.threads),
+        window_(window_size_),
+        todo_(window_size_),
+        done_(window_size_),
+        total_(std::numeric_limits<uint64_t>::max()),
+        tasks_(2 * options.compress_threads),
+        outputs_(options.outputs.size()) {
+      for (const std::string &o : options.outputs) {
+        outputs_.push_back(util::CreateOrThrow(o.c_str()));
+      }
+      const std::size_t shards = options.outputs.size();
+      if (options.compression == util::WriteCompressed::GZIP && options.compress_threads >= 2 * shards) {
+        for (std::size_t shard = 0; shard < shards; ++shard) {
+          std::size_t threads = options.compress_threads / shards + (shard < options.compress_threads % shards);
+          streams_.emplace_back(new util::WriteCompressed(outputs_[shard].file.release(), options.compression, options.level, threads));
+        }
+      }
+    }
+
+    void Run(int fd) {
+      util::FixedArray<std::thread> hashers(options_.threads), compressors(options_.compress_threads);
+      for (std::size_t i = 0; i < options_.threads; ++i) {
+        hashers.push_back(&Sharder::HashThread, this);
+      }
+      // Streams have threads of their own.
+      for (std::size_t i = 0; streams_.empty() && i < options_.compress_threads; ++i) {
+        compressors.push_back(&Sharder::CompressThread, this);
+      }
+      std::thread reader(&Sharder::ReadThread, this, fd);
+      Distribute();
+      reader.join();
+      for (std::size_t i = 0; i < hashers.size(); ++i) {
+        std::unique_ptr<Batch> poison;
+        todo_.ProduceSwap(poison);
+      }
+      for (std::thread &t : hashers) {
+        t.join();
+      }
+      for (std::size_t shard = 0; shard < outputs_.size(); ++shard) {
+        // Even an empty shard should be a valid compressed file.
+        if (!outputs_[shard].buffer.empty() || (!outputs_[shard].sent && options_.compression != util::WriteCompressed::NONE)) {
+          Dispatch(shard);
+        }
+      }
+      for (std::size_t i = 0; i < compressors.size(); ++i) {
+        std::unique_ptr<Task> poison;
+        tasks_.ProduceSwap(poison);
+      }
+      for (std::thread &t : compressors) {
+        t.join();
+      }
+      for (std::unique_ptr<util::WriteCompressed> &stream : streams_) {
+        stream->flush();
+      }
+      streams_.clear();
+    }
+
+  private:
+    struct Line {
+      std::size_t offset, length, shard;
+    };
+
+    struct Batch {
+      uint64_t sequence;
+      // Whole lines, each ending with a newline.
+      std::string text;
+      std::vector<Line> lines;
+      // Lines grouped by shard.  Shard s is [starts[s], starts[s + 1]).
+      std::string grouped;
+      std::vector<std::size_t> starts;
+    };
+
+    // Part of a shard's output to compress and write.
+    struct Task {
+      std::size_t shard;
+      uint64_t sequence;
+      std::string data;
+      std::string compressed;
+    };
+
+    struct Output {
+      explicit Output(int fd) : file(fd), sent(0), written(0) {}
+      util::scoped_fd file;
+      // Only used by the main thread.
+      std::string buffer;
+      uint64_t sent;
+      // Compressed data waiting for earlier parts to be written.
+      std::mutex mutex;
+      uint64_t written;
+      std::map<uint64_t, std::string> waiting;
+    };
+
+    void ReadThread(int fd) {
+      util::ReadCompressed in(fd);
+      std::string carry;
+      for (uint64_t sequence = 0; ; ++sequence) {
+        std::unique_ptr<Batch> batch(Allocate());
+        std::string &text = batch->text;
+        text.swap(carry);
+        carry.clear();
+        bool eof = false;
+        const char *last_newline = NULL;
+        while (!eof && !last_newline) {
+          std::size_t had = text.size();
+          text.resize(std::max(had * 2, kBatchBytes));
+          std::size_t got = in.ReadOrEOF(&text[had], text.size() - had);
+          text.resize(had + got);
+          eof = (got == 0);
+          last_newline = static_cast<const char*>(memrchr(text.data(), '\n', text.size()));
+        }
+        if (eof) {
+          if (!text.empty() && text[text.size() - 1] != '\n') text.push_back('\n');
+        } else {
+          std::size_t keep = last_newline + 1 - text.data();
+          carry.assign(text.data() + keep, text.size() - keep);
+          text.resize(keep);
+        }
+        if (!text.empty()) {
+          window_.wait();
+          batch->sequence = sequence;
+          todo_.ProduceSwap(batch);
+        } else {
+          Release(std::move(batch));
+        }
+        if (eof) {
+          {
+            std::lock_guard<std::mutex> guard(done_mutex_);
+            total_ = text.empty() ? sequence : sequence + 1;
+          }
+          done_cond_.notify_all();
+          return;
+        }
+      }
+    }
+
+    void HashThread() {
+      std::unique_ptr<Batch> batch;
+      while (todo_.ConsumeSwap(batch)) {
+        Group(*batch);
+        uint64_t sequence = batch->sequence;
+        {
+          std::lock_guard<std::mutex> guard(done_mutex_);
+          done_[sequence % window_size_] = std::move(batch);
+        }
+        done_cond_.notify_all();
+      }
+    }
+
+    void Group(Batch &batch) const {
+      const std::size_t shard_count = outputs_.size();
+      batch.lines.clear();
+      batch.starts.assign(shard_count + 1, 0);
+      const char *const base = batch.text.data();
+      const char *const end = base + batch.text.size();
+      for (const char *begin = base; begin != end;) {
+        const char *newline = static_cast<const char*>(memchr(begin, '\n', end - begin));
+        util::StringPiece line(begin, newline - begin);
+        // FilePiece's ReadLine strips a carriage return too.
+        if (!line.empty() && line.data()[line.size() - 1] == '\r') line = util::StringPiece(line.data(), line.size() - 1);
+        HashCallback cb;
+        RangeFields(line, options_.key_fields, options_.delim, cb);
+        Line l;
+        l.offset = begin - base;
+        l.length = line.size();
+        l.shard = cb.Hash() % shard_count;
+        batch.lines.push_back(l);
+        batch.starts[l.shard + 1] += l.length + 1;
+        begin = newline + 1;
+      }
+      for (std::size_t s = 0; s < shard_count; ++s) {
+        batch.starts[s + 1] += batch.starts[s];
+      }
+      batch.grouped.resize(batch.starts[shard_count]);
+      // Fill each shard's range from the front, then put starts back.
+      for (const Line &l : batch.lines) {
+        char *to = &batch.grouped[batch.starts[l.shard]];
+        std::memcpy(to, base + l.offset, l.length);
+        to[l.length] = '\n';
+        batch.starts[l.shard] += l.length + 1;
+      }
+      for (std::size_t s = shard_count; s; --s) {
+        batch.starts[s] = batch.starts[s - 1];
+      }
+      batch.starts[0] = 0;
+    }
+
+    // Append batches to shard buffers in input order.
+    void Distribute() {
+      for (uint64_t next = 0; ; ++next) {
+        std::unique_ptr<Batch> batch;
+        {
+          std::unique_lock<std::mutex> lock(done_mutex_);
+          std::unique_ptr<Batch> &slot = done_[next % window_size_];
+          done_cond_.wait(lock, [this, &slot, next]{ return slot || next == total_; });
+          if (!slot) return;
+          batch = std::move(slot);
+        }
+        for (std::size_t shard = 0; shard < outputs_.size(); ++shard) {
+          std::size_t begin = batch->starts[shard], end = batch->starts[shard + 1];
+          if (begin == end) continue;
+          std::string &buffer = outputs_[shard].buffer;
+          buffer.append(batch->grouped.data() + begin, end - begin);
+          if (buffer.size() >= options_.buffer_size) Dispatch(shard);
+        }
+        Release(std::move(batch));
+        window_.post();
+      }
+    }
+
+    void Dispatch(std::size_t shard) {
+      if (!streams_.empty()) {
+        std::string &buffer = outputs_[shard].buffer;
+        streams_[shard]->write(buffer.data(), buffer.size());
+        buffer.clear();
+        return;
+      }
+      std::unique_ptr<Task> task;
+      {
+        std::lock_guard<std::mutex> guard(free_mutex_);
+        if (free_tasks_.empty()) {
+          task.reset(new Task());
+        } else {
+          task = std::move(free_tasks_.back());
+          free_tasks_.pop_back();
+        }
+      }
+      Output &out = outputs_[shard];
+      task->shard = shard;
+      task->sequence = out.sent++;
+      task->data.swap(out.buffer);
+      out.buffer.clear();
+      tasks_.ProduceSwap(task);
+    }
+
+    void CompressThread() {
+      std::unique_ptr<Task> task;
+      while (tasks_.ConsumeSwap(task)) {
+        std::string *data = &task->data;
+        if (options_.compression != util::WriteCompressed::NONE) {
+          util::Compress(options_.compression, task->data, task->compressed, options_.level);
+          data = &task->compressed;
+        }
+        Output &out = outputs_[task->shard];
+        {
+          std::lock_guard<std::mutex> guard(out.mutex);
+          if (task->sequence == out.written) {
+            util::WriteOrThrow(out.file.get(), data->data(), data->size());
+            ++out.written;
+            for (std::map<uint64_t, std::string>::iterator i; (i = out.waiting.find(out.written)) != out.waiting.end(); ++out.written) {
+              util::WriteOrThrow(out.file.get(), i->second.data(), i->second.size());
+              out.waiting.erase(i);
+            }
+          } else {
+            out.waiting[task->sequence].swap(*data);
+          }
+        }
+        task->data.clear();
+        task->compressed.clear();
+        std::lock_guard<std::mutex> guard(free_mutex_);
+        free_tasks_.push_back(std::move(task));
+      }
+    }
+
+    std::unique_ptr<Batch> Allocate() {
+      std::lock_guard<std::mutex> guard(free_mutex_);
+      if (free_batches_.empty()) return std::unique_ptr<Batch>(new Batch());
+      std::unique_ptr<Batch> ret(std::move(free_batches_.back()));
+      free_batches_.pop_back();
+      return ret;
+    }
+
+    void Release(std::unique_ptr<Batch> &&batch) {
+      std::lock_guard<std::mutex> guard(free_mutex_);
+      free_batches_.push_back(std::move(batch));
+    }
+
+    const Options &options_;
+    const std::size_t window_size_;
+
+    // Counts batches that may be read ahead of Distribute.
+    util::Semaphore window_;
+    util::PCQueue<std::unique_ptr<Batch> > todo_;
+
+    // Grouped batches by sequence number modulo the window.
+    std::mutex done_mutex_;
+    std::condition_variable done_cond_;
+    std::vector<std::unique_ptr<Batch> > done_;
+    uint64_t total_;
+
+    util::PCQueue<std::unique_ptr<Task> > tasks_;
+    util::FixedArray<Output> outputs_;
+    // One per shard when shards are written as parallel gzip streams.
+    std::vector<std::unique_ptr<util::WriteCompressed> > streams_;
+
+    std::mutex free_mutex_;
+    std::vector<std::unique_ptr<Batch> > free_batches_;
+    std::vector<std::unique_ptr<Task> > free_tasks_;
+};
+
 } // namespace preprocess
 
 int main(int argc, char *argv[]) {
   preprocess::Options options;
   preprocess::ParseArgs(argc, argv, options);
-  uint64_t shard_count = options.outputs.size();
-
-  util::FilePiece in(0);
-  util::StringPiece line;
-  util::FixedArray<util::ThreadedBufferedStream<util::WriteCompressed> > out(options.outputs.size());
-  std::string output(argv[1]);
-  for (const std::string &o : options.outputs) {
-    out.push_back(util::CreateOrThrow(o.c_str()), options.compression);
-  }
-  while (in.ReadLineOrEOF(line)) {
-    preprocess::HashCallback cb;
-    preprocess::RangeFields(line, options.key_fields, options.delim, cb);
-    out[cb.Hash() % shard_count] << line << '\n';
-  }
+  preprocess::Sharder sharder(options);
+  sharder.Run(0);
   return 0;
 }
@@ -1,38 +1,69 @@
+#include "hash_set.hh"
 #include "util/file_piece.hh"
 #include "util/file_stream.hh"
 #include "util/murmur_hash.hh"
 #include "util/probing_hash_table.hh"
 
+#include <boost/program_options.hpp>
+
 #include <iostream>
+#include <memory>
+#include <string>
 
-struct Entry {
-  typedef uint64_t Key;
-  uint64_t key;
-  uint64_t GetKey() const { return key; }
-  void SetKey(uint64_t to) { key = to; }
-};
+typedef preprocess::HashSetEntry Entry;
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
+  std::string subtract, load_seen, save_seen;
+  namespace po = boost::program_options;
+  po::options_description desc("Arguments");
+  desc.add_options()
+    ("help,h", po::bool_switch(), "Show this help message")
+    ("subtract", po::value(&subtract), "Remove lines that appear in this file")
+    ("load-seen", po::value(&load_seen), "Also remove lines whose hashes were saved by --save-seen")
+    ("save-seen", po::value(&save_seen), "Save the hashes of lines to subtract to this file");
+  po::positional_options_description pd;
+  pd.add("subtract", 1);
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(pd).run(), vm);
+  if (vm["help"].as<bool>() || (!vm.count("subtract") && !vm.count("load-seen"))) {
     std::cerr << "Usage: " << argv[0] << " subtract <from >output\n"
       "Copies from stdin to stdout, skipping lines that appear in `subtract`.\n"
       "The subtraction is approximate, based on the hash of the line.\n"
-      "This is set subtraction.  All copies of a line are removed.\n";
+      "This is set subtraction.  All copies of a line are removed.\n"
+      "To reuse the hashes of a large subtraction file across runs:\n"
+      "  " << argv[0] << " subtract --save-seen subtract.hashes </dev/null\n"
+      "  " << argv[0] << " --load-seen subtract.hashes <from >output\n"
+      << desc;
     return 1;
   }
+  po::notify(vm);
+  std::unique_ptr<preprocess::FrozenHashSet> seen;
+  if (!load_seen.empty()) {
+    seen.reset(new preprocess::FrozenHashSet(load_seen.c_str()));
+  }
   util::AutoProbing<Entry, util::IdentityHash> table;
   // Load subtraction into table.
-  for (util::StringPiece line : util::FilePiece(argv[1])) {
-    Entry entry;
-    entry.key = util::MurmurHashNative(line.data(), line.size(), 1);
-    util::AutoProbing<Entry, util::IdentityHash>::MutableIterator it;
-    table.FindOrInsert(entry, it);
+  if (!subtract.empty()) {
+    for (util::StringPiece line : util::FilePiece(subtract.c_str())) {
+      Entry entry;
+      entry.key = util::MurmurHashNative(line.data(), line.size(), 1);
+      util::AutoProbing<Entry, util::IdentityHash>::MutableIterator it;
+      table.FindOrInsert(entry, it);
+    }
+  }
+  if (!save_seen.empty()) {
+    preprocess::HashSetWriter writer(save_seen.c_str(), table.Size() + (seen ? seen->Size() : 0));
+    if (seen) seen->ForEach(writer);
+    writer.InsertTable(table);
+    writer.Finish();
   }
   util::FileStream out(1);
-  for (util::StringPiece line : util::FilePiece(0)) {
+  util::FilePiece in(0);
+  in.StartReadAhead();
+  for (util::StringPiece line : in) {
     uint64_t key = util::MurmurHashNative(line.data(), line.size(), 1);
     util::AutoProbing<Entry, util::IdentityHash>::ConstIterator it;
-    if (!table.Find(key, it)) {
+    if (!table.Find(key, it) && !(seen && seen->Contains(key))) {
       out << line << '\n';
     }
   }
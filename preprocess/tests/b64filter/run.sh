@@ -0,0 +1,21 @@
+#!/bin/bash
+. "$(dirname "$0")"/../vars
+diff <("$BIN"/b64filter cat <"$CUR"/input) "$CUR"/input
+diff <("$BIN"/b64filter tr a-z A-Z <"$CUR"/input) "$CUR"/upper.expected
+diff <("$BIN"/b64filter -j 3 cat <"$CUR"/input) "$CUR"/input
+# tr buffers its output until end of file.
+diff <("$BIN"/b64filter -j 4 tr a-z A-Z <"$CUR"/input) "$CUR"/upper.expected
+# Long documents go through the vectorized encoder and decoder.
+for f in "$CUR"/../dedupe/input "$CUR"/upper.expected; do base64 -w0 "$f"; echo; done >"$TMP"/b64_long
+diff <("$BIN"/b64filter cat <"$TMP"/b64_long) "$TMP"/b64_long
+rm "$TMP"/b64_long
+# Enough documents to be spread over several children.
+for i in $(seq 100); do cat "$CUR"/input; done >"$TMP"/b64_many
+for i in $(seq 100); do cat "$CUR"/upper.expected; done >"$TMP"/b64_many_upper
+"$BIN"/b64filter -j 3 tr a-z A-Z <"$TMP"/b64_many >"$TMP"/b64_output
+diff "$TMP"/b64_output "$TMP"/b64_many_upper
+rm "$TMP"/b64_many "$TMP"/b64_many_upper "$TMP"/b64_output
+# Bad job counts are rejected rather than wrapped or truncated.
+for j in -1 0 3x 100000; do
+  if "$BIN"/b64filter -j $j cat </dev/null 2>/dev/null; then exit 1; fi
+done
@@ -3,3 +3,20 @@
 diff <("$BIN"/cache cat <"$CUR"/input) "$CUR"/input
 diff <("$BIN"/cache -t " " -k 1 cat <"$CUR"/input) "$CUR"/space_expected
 
+diff <("$BIN"/cache -j 3 cat <"$CUR"/input) "$CUR"/input
+diff <("$BIN"/cache -j 2 -t " " -k 1 cat <"$CUR"/input) "$CUR"/space_expected
+# tr buffers its output until end of file.
+diff <("$BIN"/cache -j 4 tr a-z A-Z <"$CUR"/input) <(tr a-z A-Z <"$CUR"/input)
+rm -f "$TMP"/cache_file "$TMP"/cache_file.index
+tr a-z A-Z <"$CUR"/input >"$TMP"/upper
+"$BIN"/cache --cache-file "$TMP"/cache_file tr a-z A-Z <"$CUR"/input >"$TMP"/output
+diff "$TMP"/upper "$TMP"/output
+# Everything is cached so the child outputs nothing.
+"$BIN"/cache --cache-file "$TMP"/cache_file sh -c 'cat >/dev/null' <"$CUR"/input >"$TMP"/output
+diff "$TMP"/upper "$TMP"/output
+rm "$TMP"/cache_file.index
+"$BIN"/cache --cache-file "$TMP"/cache_file sh -c 'cat >/dev/null' <"$CUR"/input >"$TMP"/output
+diff "$TMP"/upper "$TMP"/output
+rm "$TMP"/cache_file "$TMP"/cache_file.index "$TMP"/upper "$TMP"/output
+diff <("$BIN"/cache --max-memory 1K cat <"$CUR"/input) "$CUR"/input
+diff <("$BIN"/cache --max-memory 4K -j 2 tr a-z A-Z <"$CUR"/input) <(tr a-z A-Z <"$CUR"/input)
@@ -6,3 +6,22 @@ diff "$CUR"/expected "$TMP"/output0
 diff <(rev "$CUR"/expected) "$TMP"/output1
 rm "$TMP"/output0 "$TMP"/output1
 diff <("$BIN"/dedupe -f 2 -d " " <"$CUR"/columns) "$CUR"/columns.out
+diff <("$BIN/dedupe" --threads 4 <"$CUR/input") "$CUR/expected"
+diff <("$BIN"/dedupe --threads 3 -f 2 -d " " <"$CUR"/columns) "$CUR"/columns.out
+diff <("$BIN/dedupe" --memory 1K <"$CUR/input") "$CUR/expected"
+diff <(cat "$CUR/input" | "$BIN/dedupe" --memory 1K) "$CUR/expected"
+diff <("$BIN"/dedupe --memory 1K -f 2 -d " " <"$CUR"/columns) "$CUR"/columns.out
+"$BIN/dedupe" --save-seen "$TMP"/seen <"$CUR/input" >"$TMP"/output0
+diff "$CUR/expected" "$TMP"/output0
+diff <("$BIN/dedupe" --load-seen "$TMP"/seen <"$CUR/input") /dev/null
+diff <("$BIN/dedupe" --threads 2 --load-seen "$TMP"/seen <"$CUR/input") /dev/null
+diff <("$BIN/dedupe" --memory 1K --load-seen "$TMP"/seen <"$CUR/input") /dev/null
+head -n 2 "$CUR/expected" | "$BIN/dedupe" --threads 2 --save-seen "$TMP"/seen >/dev/null
+"$BIN/dedupe" --load-seen "$TMP"/seen --save-seen "$TMP"/seen2 <"$CUR/input" >"$TMP"/output0
+diff <(tail -n +3 "$CUR/expected") "$TMP"/output0
+diff <("$BIN/dedupe" --load-seen "$TMP"/seen2 <"$CUR/input") /dev/null
+rm "$TMP"/seen "$TMP"/seen2 "$TMP"/output0
+# Thread counts that wrap around or are absurd print usage.
+for t in -1 0 100000; do
+  if "$BIN/dedupe" --threads $t </dev/null 2>/dev/null; then exit 1; fi
+done
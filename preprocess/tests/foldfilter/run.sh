@@ -7,3 +7,14 @@ diff <("$BIN/foldfilter" -w 10 cat <"$CUR"/input) "$CUR"/input
 # Line breaks are not great with leading space but it does work
 diff "$TMP/fold10" "$CUR/fold10.expected"
 rm "$TMP/fold10"
+diff <("$BIN/foldfilter" -j 3 -w 10 cat <"$CUR"/input) "$CUR"/input
+# Enough lines to be spread over several children.  tr buffers its output
+# until end of file.
+for i in $(seq 30); do cat "$CUR"/input; done >"$TMP/fold_many"
+"$BIN/foldfilter" -j 3 -w 10 -s tr a-z A-Z <"$TMP/fold_many" >"$TMP/fold_output"
+diff "$TMP/fold_output" <(tr a-z A-Z <"$TMP/fold_many")
+rm "$TMP/fold_many" "$TMP/fold_output"
+# Bad job counts are rejected rather than wrapped or truncated.
+for j in -1 0 3x 100000; do
+  if "$BIN/foldfilter" -j $j cat </dev/null 2>/dev/null; then exit 1; fi
+done
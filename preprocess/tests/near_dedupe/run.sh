@@ -0,0 +1,13 @@
+#!/bin/bash
+. "$(dirname "$0")"/../vars
+diff <("$BIN"/near_dedupe <"$CUR"/input) "$CUR"/expected
+diff <("$BIN"/near_dedupe --threads 3 <"$CUR"/input) "$CUR"/expected
+diff <("$BIN"/near_dedupe --simhash <"$CUR"/input) "$CUR"/simhash.expected
+diff <("$BIN"/near_dedupe --simhash --threads 2 <"$CUR"/input) "$CUR"/simhash.expected
+to_base64() {
+  while IFS= read -r line; do
+    printf '%s' "$line" | base64 -w0
+    echo
+  done
+}
+diff <(to_base64 <"$CUR"/input | "$BIN"/near_dedupe --base64) <(to_base64 <"$CUR"/expected)
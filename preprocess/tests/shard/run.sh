@@ -9,3 +9,38 @@ diff <(zcat "$TMP"/test{0,1,2,3} |sort) <(sort "$CUR"/input)
 "$BIN/shard" --prefix "$TMP"/test -c bzip2 --number 4 <"$CUR"/input
 diff <(bzcat "$TMP"/test{0,1,2,3} |sort) <(sort "$CUR"/input)
 rm "$TMP"/test_a "$TMP"/test_b "$TMP"/test{0,1,2,3}
+# Small buffers make many members per shard, which must stay in input order.
+"$BIN/shard" --prefix "$TMP"/test --number 4 <"$CUR"/input
+"$BIN/shard" --prefix "$TMP"/test_gz -c gzip --number 4 -t 3 --compress-threads 2 -b 100 <"$CUR"/input
+for i in 0 1 2 3; do
+  diff <(zcat "$TMP"/test_gz$i) "$TMP"/test$i
+done
+# Empty shards are still valid compressed files.
+"$BIN/shard" --prefix "$TMP"/test_gz -c gzip --number 4 </dev/null
+diff <(zcat "$TMP"/test_gz{0,1,2,3}) /dev/null
+rm "$TMP"/test{0,1,2,3} "$TMP"/test_gz{0,1,2,3}
+# Many xz streams per shard read back as one.
+"$BIN/shard" --prefix "$TMP"/test --number 4 <"$CUR"/input
+"$BIN/shard" --prefix "$TMP"/test_xz -c xz --number 4 -b 100 <"$CUR"/input
+for i in 0 1 2 3; do
+  diff <(xzcat "$TMP"/test_xz$i) "$TMP"/test$i
+done
+rm "$TMP"/test{0,1,2,3} "$TMP"/test_xz{0,1,2,3}
+# With two or more compress threads per shard, each gzip shard is one stream
+# compressed in parallel blocks.  Make enough input for several blocks.
+for i in $(seq 2000); do cat "$CUR"/input; done >"$TMP"/test_many
+"$BIN/shard" --prefix "$TMP"/test --number 2 <"$TMP"/test_many
+"$BIN/shard" --prefix "$TMP"/test_gz -c gzip --number 2 --compress-threads 5 <"$TMP"/test_many
+for i in 0 1; do
+  cmp <(zcat "$TMP"/test_gz$i) "$TMP"/test$i
+done
+"$BIN/shard" --prefix "$TMP"/test_gz -c gzip --number 2 --compress-threads 4 </dev/null
+diff <(zcat "$TMP"/test_gz{0,1}) /dev/null
+rm "$TMP"/test_many "$TMP"/test{0,1} "$TMP"/test_gz{0,1}
+# Negative and huge thread counts are an error, not a wrapped size_t.
+for threads in -1 100000; do
+  for option in -t --compress-threads; do
+    if ("$BIN/shard" $option $threads "$TMP"/test_a "$TMP"/test_b <"$CUR"/input; exit $?) >/dev/null 2>&1; then exit 1; fi
+  done
+done
+rm -f "$TMP"/test_a "$TMP"/test_b
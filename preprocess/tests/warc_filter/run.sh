@@ -0,0 +1,38 @@
+#!/bin/bash
+. "$(dirname "$0")"/../vars
+diff <("$BIN"/warc_filter -i "$CUR"/input -t response request) "$CUR"/request_response.expected
+diff <("$BIN"/warc_filter -u 'com/[13]$' --min-length 100 <"$CUR"/input) "$CUR"/uri_length.expected
+# Everything but the warcinfo record at the start.
+diff <("$BIN"/warc_filter -v -t warcinfo <"$CUR"/input) <(tail -c +141 "$CUR"/input)
+diff <("$BIN"/warc_filter --content-type TEXT/ -t warcinfo <"$CUR"/input) <(head -c 140 "$CUR"/input)
+diff <("$BIN"/warc_filter --content-type application/ <"$CUR"/input) /dev/null
+diff <("$BIN"/warc_filter -t response request -z <"$CUR"/input |gzip -dc) "$CUR"/request_response.expected
+diff <(gzip -c "$CUR"/input |"$BIN"/warc_filter -t response request) "$CUR"/request_response.expected
+# A gzipped file with a member per record is decompressed in parallel.
+"$BIN"/warc_filter -z -i "$CUR"/input >"$TMP"/warc_filter.warc.gz
+diff <("$BIN"/warc_filter --decompress-threads 2 -t response request -i "$TMP"/warc_filter.warc.gz) "$CUR"/request_response.expected
+rm "$TMP"/warc_filter.warc.gz
+# Malformed or duplicate Content-Length is an error whether the file is
+# memory mapped or read from a pipe, not a record running past the input.
+# The subshells keep bash from reporting the abort.
+for header in 'Content-Length: 18446744073709551614' 'Content-Length: -1' 'Content-Length: 2\r\nContent-Length: 3'; do
+  printf "WARC/1.0\r\nWARC-Type: response\r\n$header\r\n\r\nab\r\n\r\n" >"$TMP"/warc_filter_bad.warc
+  if ("$BIN"/warc_filter -t response -i "$TMP"/warc_filter_bad.warc; exit $?) >/dev/null 2>&1; then exit 1; fi
+  if ("$BIN"/warc_filter -t response <"$TMP"/warc_filter_bad.warc; exit $?) >/dev/null 2>&1; then exit 1; fi
+done
+rm "$TMP"/warc_filter_bad.warc
+# -z compresses at level 9, like warc_parallel and shard.
+cmp <("$BIN"/warc_filter -z <"$CUR"/input) <("$BIN"/warc_filter -z -l 9 <"$CUR"/input)
+# Records are checked on a pool of threads, which keeps their order.
+for args in '-i '"$CUR"/input '-z -i '"$CUR"/input; do
+  cmp <("$BIN"/warc_filter --threads 3 -u 'com/[13]$' -v $args) <("$BIN"/warc_filter --threads 1 -u 'com/[13]$' -v $args)
+done
+diff <("$BIN"/warc_filter --threads 3 -u 'com/[13]$' --min-length 100 <"$CUR"/input) "$CUR"/uri_length.expected
+if ("$BIN"/warc_filter --threads -1 <"$CUR"/input; exit $?) >/dev/null 2>&1; then exit 1; fi
+# A URI too long for std::regex never matches instead of overflowing the stack.
+uri=$(head -c 1000000 /dev/zero |tr '\0' a)
+printf "WARC/1.0\r\nWARC-Type: response\r\nWARC-Target-URI: http://$uri\r\nContent-Length: 2\r\n\r\nab\r\n\r\n" >"$TMP"/warc_filter_long.warc
+for threads in 1 3; do
+  diff <("$BIN"/warc_filter --threads $threads -u 'a+$' -i "$TMP"/warc_filter_long.warc) /dev/null
+done
+rm "$TMP"/warc_filter_long.warc
@@ -0,0 +1,16 @@
+#!/bin/bash
+. "$(dirname "$0")"/../vars
+diff <("$BIN"/warc_index "$CUR"/input) "$CUR"/index.expected
+diff <("$BIN"/warc_index -x "$CUR"/input <"$CUR"/index.expected) "$CUR"/input
+# One gzip member per record, as warc_parallel writes.
+"$BIN"/warc_parallel -o -j 1 -z cat <"$CUR"/input >"$TMP"/warc_index.warc.gz
+"$BIN"/warc_index "$TMP"/warc_index.warc.gz >"$TMP"/warc_index.index
+diff <(cut -f3- "$TMP"/warc_index.index) <(cut -f3- "$CUR"/index.expected)
+diff <("$BIN"/warc_index -x "$TMP"/warc_index.warc.gz <"$TMP"/warc_index.index) "$CUR"/input
+diff <(grep 'example.com/2' "$TMP"/warc_index.index |tac |"$BIN"/warc_index -x "$TMP"/warc_index.warc.gz) <(grep 'example.com/2' "$CUR"/index.expected |tac |"$BIN"/warc_index -x "$CUR"/input)
+# A member holding several records, as from gzipping a whole file, is refused
+# rather than indexed with every record pointing at all of it.  The subshell
+# keeps bash from reporting the abort.
+gzip -c "$CUR"/input >"$TMP"/warc_index.warc.gz
+if ("$BIN"/warc_index "$TMP"/warc_index.warc.gz; exit $?) >/dev/null 2>&1; then exit 1; fi
+rm "$TMP"/warc_index.warc.gz "$TMP"/warc_index.index
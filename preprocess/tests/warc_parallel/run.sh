@@ -0,0 +1,45 @@
+#!/bin/bash
+. "$(dirname "$0")"/../vars
+diff <("$BIN"/warc_parallel -j 1 cat <"$CUR"/input) "$CUR"/input
+diff <("$BIN"/warc_parallel -j 1 -z cat <"$CUR"/input |gzip -dc) "$CUR"/input
+# Without --ordered, records from several children are interleaved.
+diff <("$BIN"/warc_parallel -j 3 cat <"$CUR"/input |sort) <(sort "$CUR"/input)
+diff <("$BIN"/warc_parallel -j 3 -i "$CUR"/input "$CUR"/input -- cat |sort) <(cat "$CUR"/input "$CUR"/input |sort)
+diff <("$BIN"/warc_parallel --ordered -j 3 cat <"$CUR"/input) "$CUR"/input
+diff <("$BIN"/warc_parallel -o -j 3 -z cat <"$CUR"/input |gzip -dc) "$CUR"/input
+# Enough records to be spread over several children.
+inputs=()
+for i in $(seq 20); do inputs+=("$CUR"/input); done
+"$BIN"/warc_parallel --ordered -j 3 -i "${inputs[@]}" -- cat >"$TMP"/warc_output
+diff "$TMP"/warc_output <(cat "${inputs[@]}")
+rm "$TMP"/warc_output
+diff <("$BIN"/warc_parallel -o -j 3 -c bzip2 --compress-threads 2 cat <"$CUR"/input |bzip2 -dc) "$CUR"/input
+diff <("$BIN"/warc_parallel -j 1 -c gzip -l 1 --compress-threads 3 cat <"$CUR"/input |gzip -dc) "$CUR"/input
+# A pipe is read with WARCReader instead of being memory mapped.
+diff <(cat "$CUR"/input |"$BIN"/warc_parallel -o -j 2 cat) "$CUR"/input
+diff <(gzip -c "$CUR"/input |"$BIN"/warc_parallel -j 1 cat) "$CUR"/input
+# Gzipped files are decompressed in parallel, in chunks of 1 MB.  Records are
+# members here, then cross member and chunk boundaries, then are all in one.
+for i in $(seq 300); do cat "$CUR"/input; done >"$TMP"/warc_many
+"$BIN"/warc_parallel -o -j 1 -z cat <"$TMP"/warc_many >"$TMP"/warc_many.gz
+"$BIN"/warc_parallel -o -j 2 --decompress-threads 3 -i "$TMP"/warc_many.gz -- cat >"$TMP"/warc_output
+cmp "$TMP"/warc_output "$TMP"/warc_many
+split -b 1000 -a 4 "$TMP"/warc_many "$TMP"/warc_piece.
+# One member per file.
+gzip -c "$TMP"/warc_piece.* >"$TMP"/warc_many.gz
+rm "$TMP"/warc_piece.*
+"$BIN"/warc_parallel -o -j 2 --decompress-threads 3 -i "$TMP"/warc_many.gz -- cat >"$TMP"/warc_output
+cmp "$TMP"/warc_output "$TMP"/warc_many
+gzip -c "$TMP"/warc_many >"$TMP"/warc_many.gz
+"$BIN"/warc_parallel -o -j 2 -i "$TMP"/warc_many.gz -- cat >"$TMP"/warc_output
+cmp "$TMP"/warc_output "$TMP"/warc_many
+rm "$TMP"/warc_many "$TMP"/warc_many.gz "$TMP"/warc_output
+# -z compresses at level 9, as it did before --level existed.
+cmp <("$BIN"/warc_parallel -o -j 1 -z cat <"$CUR"/input) <("$BIN"/warc_parallel -o -j 1 -z -l 9 cat <"$CUR"/input)
+# Header lines starting with a space or tab continue the field before them,
+# whether the file is memory mapped, gzipped or read from a pipe.
+diff <("$BIN"/warc_parallel -o -j 1 -i "$CUR"/folded -- cat) "$CUR"/folded
+diff <("$BIN"/warc_parallel -o -j 1 cat <"$CUR"/folded) "$CUR"/folded
+"$BIN"/warc_parallel -o -j 1 -z cat <"$CUR"/folded >"$TMP"/folded.gz
+diff <("$BIN"/warc_parallel -o -j 1 --decompress-threads 2 -i "$TMP"/folded.gz -- cat) "$CUR"/folded
+rm "$TMP"/folded.gz
@@ -0,0 +1,130 @@
+/* Compare UTF-8 validators: decoding one character at a time as IsUTF8 used
+ * to, and each validator IsUTF8 can choose on this CPU.  Text is ASCII, then
+ * mixed ASCII and multibyte, each as one buffer and as lines.
+ */
+#include "util/utf8.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+namespace {
+
+bool DecodeEach(const char *begin, const char *end) {
+  try {
+    for (char32_t character : util::DecodeUTF8Range(util::StringPiece(begin, end - begin))) {
+      (void)character;
+    }
+    return true;
+  } catch (const util::NotUTF8Exception &) {
+    return false;
+  }
+}
+
+void AppendUTF8(char32_t c, std::string &to) {
+  if (c < 0x80) {
+    to += static_cast<char>(c);
+  } else if (c < 0x800) {
+    to += static_cast<char>(0xC0 | (c >> 6));
+    to += static_cast<char>(0x80 | (c & 0x3F));
+  } else if (c < 0x10000) {
+    to += static_cast<char>(0xE0 | (c >> 12));
+    to += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+    to += static_cast<char>(0x80 | (c & 0x3F));
+  } else {
+    to += static_cast<char>(0xF0 | (c >> 18));
+    to += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+    to += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+    to += static_cast<char>(0x80 | (c & 0x3F));
+  }
+}
+
+// Split on newlines once so the timing is only validation.
+std::vector<util::StringPiece> Lines(const std::string &text) {
+  std::vector<util::StringPiece> ret;
+  const char *begin = text.data(), *end = text.data() + text.size();
+  while (begin != end) {
+    const char *newline = std::find(begin, end, '\n');
+    ret.push_back(util::StringPiece(begin, newline - begin));
+    begin = newline == end ? end : newline + 1;
+  }
+  return ret;
+}
+
+void Measure(const char *name, bool (*validate)(const char *, const char *), const std::vector<util::StringPiece> &pieces, uint64_t bytes) {
+  double best = 1e100;
+  uint64_t valid = 0;
+  for (unsigned i = 0; i < 5; ++i) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    valid = 0;
+    for (const util::StringPiece &piece : pieces) {
+      valid += validate(piece.data(), piece.data() + piece.size());
+    }
+    best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  }
+  std::cout << "  " << name << ": " << (static_cast<double>(bytes) / best / 1e9) << " GB/s (" << valid << " valid)" << std::endl;
+}
+
+void MeasureAll(const char *title, const std::string &text) {
+  std::vector<std::pair<const char *, std::vector<util::StringPiece> > > layouts;
+  layouts.push_back(std::make_pair("one buffer", std::vector<util::StringPiece>(1, util::StringPiece(text))));
+  layouts.push_back(std::make_pair("lines", Lines(text)));
+  for (const std::pair<const char *, std::vector<util::StringPiece> > &layout : layouts) {
+    std::cout << title << ", " << layout.first << ":" << std::endl;
+    Measure("DecodeUTF8Range", DecodeEach, layout.second, text.size());
+    for (const util::UTF8Validator &validator : util::UTF8Validators()) {
+      Measure(validator.name, validator.function, layout.second, text.size());
+    }
+  }
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc > 2) {
+    std::cerr << "Usage: " << argv[0] << " [megabytes]\n";
+    return 1;
+  }
+  std::size_t bytes = (argc > 1 ? std::strtoull(argv[1], NULL, 10) : 64) << 20;
+  std::mt19937 gen(1);
+  std::uniform_int_distribution<int> letter('a', 'z'), kind(0, 9), line(40, 200);
+  std::uniform_int_distribution<char32_t> two(0x80, 0x7FF), three(0x800, 0xD7FF), four(0x10000, 0x10FFFF);
+
+  std::string ascii, mixed;
+  ascii.reserve(bytes);
+  mixed.reserve(bytes + 4);
+  for (std::size_t next = line(gen); ascii.size() < bytes; ) {
+    if (ascii.size() >= next) {
+      ascii += '\n';
+      next += line(gen);
+    } else {
+      ascii += static_cast<char>(letter(gen));
+    }
+  }
+  for (std::size_t next = line(gen); mixed.size() < bytes; ) {
+    if (mixed.size() >= next) {
+      mixed += '\n';
+      next += line(gen);
+      continue;
+    }
+    // Mostly ASCII with some of each length, like multilingual web text.
+    int k = kind(gen);
+    if (k < 6) {
+      mixed += static_cast<char>(letter(gen));
+    } else if (k < 8) {
+      AppendUTF8(two(gen), mixed);
+    } else if (k < 9) {
+      AppendUTF8(three(gen), mixed);
+    } else {
+      AppendUTF8(four(gen), mixed);
+    }
+  }
+  MeasureAll("ASCII", ascii);
+  MeasureAll("Mixed", mixed);
+}
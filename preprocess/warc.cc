@@ -4,13 +4,36 @@
 #include "util/file.hh"
 #include "util/compress.hh"
 
+#include <algorithm>
+#include <cerrno>
 #include <cstdlib>
+#include <cstring>
 #include <limits>
 #include <string>
 #include <strings.h>
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 namespace preprocess {
 
+namespace {
+
+// Content-Length value, possibly after spaces.  Signs and values that do not
+// fit are errors rather than wrapping around.
+std::size_t ParseContentLength(util::StringPiece value) {
+  const char *begin = value.data(), *end = value.data() + value.size();
+  while (begin != end && (*begin == ' ' || *begin == '\t')) ++begin;
+  UTIL_THROW_IF2(begin == end || *begin < '0' || *begin > '9', "Content-Length parse error in `" << value << '\'');
+  char *parsed;
+  errno = 0;
+  unsigned long long length = std::strtoull(begin, &parsed, 10);
+  UTIL_THROW_IF2(parsed != end || errno == ERANGE || length > std::numeric_limits<std::size_t>::max(), "Content-Length parse error in `" << value << '\'');
+  return length;
+}
+
+} // namespace
+
 bool ReadMore(util::ReadCompressed &reader, std::string &out) {
   const std::size_t kRead = 4096;
   std::size_t had = out.size();
@@ -73,13 +96,12 @@ bool WARCReader::Read(std::string &out) {
     if (line.size() >= kContentLengthLength && !strncasecmp(line.data(), kContentLength, kContentLengthLength)) {
       UTIL_THROW_IF2(seen_content_length, "Two Content-Length headers?");
       seen_content_length = true;
-      char *end;
-      length = std::strtoll(line.data() + kContentLengthLength, &end, 10);
       // TODO: tolerate whitespace?
-      UTIL_THROW_IF2(end != line.data() + line.size(), "Content-Length parse error in `" << line << '\'');
+      length = ParseContentLength(util::StringPiece(line.data() + kContentLengthLength, line.size() - kContentLengthLength));
     }
   }
   UTIL_THROW_IF2(!seen_content_length, "No Content-Length: header in " << out);
+  UTIL_THROW_IF(length > std::numeric_limits<std::size_t>::max() - header.Consumed() - 4, util::EndOfFileException, "Unexpected end of file while reading content of length " << length);
   std::size_t total_length = header.Consumed() + length + 4 /* CRLF CRLF after data as specified in the standard. */;
 
   if (total_length < out.size()) {
@@ -99,4 +121,184 @@ bool WARCReader::Read(std::string &out) {
   return true;
 }
 
+bool WARCRecord::Field(util::StringPiece name, util::StringPiece &value) const {
+  for (const std::pair<util::StringPiece, util::StringPiece> &field : fields) {
+    if (field.first.size() == name.size() && !strncasecmp(field.first.data(), name.data(), name.size())) {
+      value = field.second;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool WARCMapReader::Mappable(int fd) {
+  struct stat info;
+  if (fstat(fd, &info) || !S_ISREG(info.st_mode)) return false;
+  if (info.st_size < static_cast<off_t>(util::ReadCompressed::kMagicSize)) return true;
+  char magic[util::ReadCompressed::kMagicSize];
+  util::ErsatzPRead(fd, magic, sizeof(magic), 0);
+  return !util::ReadCompressed::DetectCompressedMagic(magic);
+}
+
+WARCMapReader::WARCMapReader(int fd) : file_(fd) {
+  uint64_t size = util::SizeOrThrow(fd);
+  if (size) {
+    util::MapRead(util::LAZY, fd, 0, size, mem_);
+    madvise(mem_.get(), mem_.size(), MADV_SEQUENTIAL);
+  }
+  current_ = mem_.begin();
+}
+
+namespace {
+
+util::StringPiece Trim(const char *begin, const char *end) {
+  while (begin != end && (*begin == ' ' || *begin == '\t')) ++begin;
+  while (end != begin && (end[-1] == ' ' || end[-1] == '\t')) --end;
+  return util::StringPiece(begin, end - begin);
+}
+
+} // namespace
+
+const char *ParseWARCRecord(const char *const begin, const char *end, WARCRecord &record) {
+  record.fields.clear();
+  // Header lines end with LF, optionally preceded by CR, as in WARCReader.
+  bool first = true;
+  const char *line = begin;
+  while (true) {
+    const char *newline = static_cast<const char*>(memchr(line, '\n', end - line));
+    UTIL_THROW_IF(!newline, util::EndOfFileException, "WARC ended in header.");
+    const char *line_end = (newline != line && newline[-1] == '\r') ? newline - 1 : newline;
+    if (first) {
+      UTIL_THROW_IF(util::StringPiece(line, line_end - line) != "WARC/1.0", util::Exception, "Expected WARC/1.0 header but got `" << util::StringPiece(line, line_end - line) << '\'');
+      first = false;
+    } else if (line == line_end) {
+      line = newline + 1;
+      break;
+    } else if (*line == ' ' || *line == '\t') {
+      // Continues the previous field's value.
+      UTIL_THROW_IF2(record.fields.empty(), "WARC header starts with a continuation line: `" << util::StringPiece(line, line_end - line) << '\'');
+      util::StringPiece &value = record.fields.back().second;
+      util::StringPiece more(Trim(line, line_end));
+      if (!more.empty()) {
+        const char *value_begin = value.empty() ? more.data() : value.data();
+        value = util::StringPiece(value_begin, more.data() + more.size() - value_begin);
+      }
+    } else {
+      const char *colon = std::find(line, line_end, ':');
+      UTIL_THROW_IF2(colon == line_end, "WARC header line without a colon: `" << util::StringPiece(line, line_end - line) << '\'');
+      record.fields.push_back(std::make_pair(util::StringPiece(line, colon - line), Trim(colon + 1, line_end)));
+    }
+    line = newline + 1;
+  }
+  record.header = util::StringPiece(begin, line - begin);
+
+  // Reject duplicates as WARCReader does rather than picking one.
+  const util::StringPiece kContentLength("Content-Length");
+  util::StringPiece length_string;
+  bool seen_content_length = false;
+  for (const std::pair<util::StringPiece, util::StringPiece> &field : record.fields) {
+    if (field.first.size() == kContentLength.size() && !strncasecmp(field.first.data(), kContentLength.data(), kContentLength.size())) {
+      UTIL_THROW_IF2(seen_content_length, "Two Content-Length headers?");
+      seen_content_length = true;
+      length_string = field.second;
+    }
+  }
+  UTIL_THROW_IF2(!seen_content_length, "No Content-Length: header in " << record.header);
+  std::size_t length = ParseContentLength(length_string);
+
+  // Written so that a huge length cannot wrap around.
+  UTIL_THROW_IF(end - line < 4 || length > static_cast<std::size_t>(end - line) - 4, util::EndOfFileException, "Unexpected end of file while reading content of length " << length);
+  record.payload = util::StringPiece(line, length);
+  const char *record_end = line + length + 4;
+  UTIL_THROW_IF2(util::StringPiece(record_end - 4, 4) != util::StringPiece("\r\n\r\n", 4), "End of WARC record missing CRLF CRLF");
+  record.record = util::StringPiece(begin, record_end - begin);
+  return record_end;
+}
+
+bool WARCMapReader::Read(WARCRecord &record) {
+  const char *end = mem_.begin() + mem_.size();
+  if (current_ == end) return false;
+  current_ = ParseWARCRecord(current_, end, record);
+  return true;
+}
+
+void WARCSeekReader::Seek(uint64_t offset, std::size_t length) {
+  raw_.resize(length);
+  util::ErsatzPRead(file_.get(), &raw_[0], length, offset);
+  if (length >= 2 && raw_[0] == '\x1f' && raw_[1] == '\x8b') {
+    decompressed_.clear();
+    std::size_t member = util::GZDecompressMember(raw_, decompressed_);
+    UTIL_THROW_IF2(member != length, "The gzip member at offset " << offset << " is " << member << " bytes long, not " << length);
+    current_ = decompressed_.data();
+    end_ = current_ + decompressed_.size();
+  } else {
+    current_ = raw_.data();
+    end_ = current_ + raw_.size();
+  }
+}
+
+bool WARCGzipReader::Parallel(int fd) {
+  struct stat info;
+  if (fstat(fd, &info) || !S_ISREG(info.st_mode) || info.st_size < 2) return false;
+  std::string probe(std::min<uint64_t>(info.st_size, DecompressPool::kChunkBytes), 0);
+  util::ErsatzPRead(fd, &probe[0], probe.size(), 0);
+  if (probe[0] != '\x1f' || probe[1] != '\x8b') return false;
+  // A file that is one big member, as gzip writes, would be decompressed into
+  // memory all at once.  Expect small members like the first.
+  std::string first;
+  try {
+    util::GZDecompressMember(probe, first, 16 * DecompressPool::kChunkBytes);
+  } catch (const util::GZException &e) {
+    return false;
+  }
+  return true;
+}
+
+namespace {
+util::StringPiece MapSequential(int fd, util::scoped_memory &mem) {
+  util::MapRead(util::LAZY, fd, 0, util::SizeOrThrow(fd), mem);
+  madvise(mem.get(), mem.size(), MADV_SEQUENTIAL);
+  return util::StringPiece(mem.begin(), mem.size());
+}
+} // namespace
+
+WARCGzipReader::WARCGzipReader(int fd, std::size_t threads)
+  : file_(fd), pool_(MapSequential(fd, mem_), threads), current_(NULL), end_(NULL) {}
+
+bool WARCGzipReader::Read(WARCRecord &record) {
+  while (true) {
+    if (current_ != end_) {
+      try {
+        current_ = ParseWARCRecord(current_, end_, record);
+        return true;
+      } catch (const util::EndOfFileException &e) {
+        // The record continues in the next piece.
+      }
+    }
+    std::size_t left = end_ - current_;
+    if (left) {
+      buffer_.erase(0, current_ - buffer_.data());
+    } else {
+      buffer_.clear();
+    }
+    if (!pool_.Read(next_)) {
+      UTIL_THROW_IF(left, util::EndOfFileException, "WARC ended in the middle of a record.");
+      return false;
+    }
+    if (left) {
+      buffer_ += next_;
+    } else {
+      buffer_.swap(next_);
+    }
+    current_ = buffer_.data();
+    end_ = current_ + buffer_.size();
+  }
+}
+
+bool WARCSeekReader::Read(WARCRecord &record) {
+  if (current_ == end_) return false;
+  current_ = ParseWARCRecord(current_, end_, record);
+  return true;
+}
+
 } // namespace preprocess
@@ -1,8 +1,17 @@
 #pragma once
 
+#include "preprocess/decompress_pool.hh"
+
 #include "util/compress.hh"
+#include "util/file.hh"
+#include "util/mmap.hh"
+#include "util/string_piece.hh"
 
 #include <string>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
 
 namespace preprocess {
 
@@ -18,4 +27,97 @@ class WARCReader {
     std::string overhang_;
 };
 
+// Views of one record in a WARCMapReader's mapping or a WARCSeekReader's
+// buffer.
+struct WARCRecord {
+  // The whole record, from WARC/1.0 through the CRLF CRLF after the payload.
+  util::StringPiece record;
+  // From WARC/1.0 through the blank line ending the header.
+  util::StringPiece header;
+  // Content-Length bytes after the header.
+  util::StringPiece payload;
+  // Header fields in order, excluding the version line.  Names are as they
+  // appear without the colon and values have surrounding whitespace removed.
+  // A value folded onto lines starting with a space or tab runs through the
+  // last of them, line breaks included.
+  std::vector<std::pair<util::StringPiece, util::StringPiece> > fields;
+
+  // Case-insensitive lookup of the first field named name.
+  bool Field(util::StringPiece name, util::StringPiece &value) const;
+};
+
+/* Reads an uncompressed WARC file by memory mapping it.  Records are views of
+ * the mapping, so nothing is copied and they stay valid as long as the reader.
+ */
+class WARCMapReader {
+  public:
+    // Whether fd is a regular file that is not compressed, so it can be mapped.
+    static bool Mappable(int fd);
+
+    // Takes ownership of fd.
+    explicit WARCMapReader(int fd);
+
+    bool Read(WARCRecord &record);
+
+    // Byte offset of a record from Read in the file.
+    uint64_t Offset(const WARCRecord &record) const {
+      return record.record.data() - mem_.begin();
+    }
+
+  private:
+    util::scoped_fd file_;
+    util::scoped_memory mem_;
+    const char *current_;
+};
+
+/* Reads a gzipped WARC file by decompressing its members on a pool of threads.
+ * This scales when members are small, as when Common Crawl writes a member per
+ * record.  Parallel checks that the first member is.
+ */
+class WARCGzipReader {
+  public:
+    // Whether fd is a regular file that starts with a small gzip member.
+    static bool Parallel(int fd);
+
+    // Takes ownership of fd.
+    WARCGzipReader(int fd, std::size_t threads);
+
+    // The record is valid until the next call.
+    bool Read(WARCRecord &record);
+
+  private:
+    util::scoped_fd file_;
+    util::scoped_memory mem_;
+    DecompressPool pool_;
+
+    // Decompressed data starting with a partial record carried over from the
+    // previous piece, if any.
+    std::string buffer_, next_;
+    const char *current_, *end_;
+};
+
+// Parse the record at the start of [begin, end), returning where it ends.
+const char *ParseWARCRecord(const char *begin, const char *end, WARCRecord &record);
+
+/* Reads records at known offsets, as listed by warc_index, without reading the
+ * rest of the file.  In a gzipped WARC an offset and length are a gzip member,
+ * which is decompressed on its own; in an uncompressed WARC they are a record.
+ */
+class WARCSeekReader {
+  public:
+    // Takes ownership of fd, which must support pread.
+    explicit WARCSeekReader(int fd) : file_(fd), current_(NULL), end_(NULL) {}
+
+    // Load the gzip member or record of length bytes at offset.
+    void Seek(uint64_t offset, std::size_t length);
+
+    // Next record of what was loaded.  Records are valid until the next Seek.
+    bool Read(WARCRecord &record);
+
+  private:
+    util::scoped_fd file_;
+    std::string raw_, decompressed_;
+    const char *current_, *end_;
+};
+
 } // namespace preprocess
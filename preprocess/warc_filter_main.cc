@@ -0,0 +1,381 @@
+#include "compress_pool.hh"
+#include "warc.hh"
+
+#include "util/compress.hh"
+#include "util/file_stream.hh"
+#include "util/file.hh"
+#include "util/pcqueue.hh"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <strings.h>
+
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+namespace preprocess {
+namespace {
+
+struct Options {
+  std::vector<std::string> inputs;
+  std::vector<std::string> types;
+  std::vector<std::string> content_types;
+  std::string uri;
+  std::size_t min_length, max_length;
+  bool invert;
+  util::WriteCompressed::Compression compression;
+  int level;
+  std::size_t threads;
+  std::size_t compress_threads;
+  std::size_t decompress_threads;
+};
+
+// libstdc++'s std::regex recurses for each character, so a long enough URI
+// would overflow the stack.  Longer URIs do not match.
+const std::size_t kMaxURI = 8192;
+
+// Negative --threads wraps around to a huge number.
+const std::size_t kMaxThreads = 1024;
+
+void ParseArgs(int argc, char *argv[], Options &out) {
+  namespace po = boost::program_options;
+  po::options_description desc("Arguments");
+  bool gzip;
+  std::string compression;
+  desc.add_options()
+    ("help,h", po::bool_switch(), "Show this help message")
+    ("inputs,i", po::value(&out.inputs)->multitoken(), "Input files, read one after another.  Default: read from stdin.")
+    ("type,t", po::value(&out.types)->multitoken(), "Keep records with one of these WARC-Type values, like response or request.")
+    ("content-type", po::value(&out.content_types)->multitoken(), "Keep records whose Content-Type starts with one of these, ignoring case.")
+    ("uri,u", po::value(&out.uri), "Keep records whose WARC-Target-URI contains a match for this ECMAScript regular expression.  URIs longer than 8192 bytes never match.")
+    ("min-length", po::value(&out.min_length)->default_value(0), "Keep records with at least this many bytes of payload.")
+    ("max-length", po::value(&out.max_length)->default_value(std::numeric_limits<std::size_t>::max(), "unlimited"), "Keep records with at most this many bytes of payload.")
+    ("invert,v", po::bool_switch(&out.invert), "Drop the records that would be kept and keep the rest.")
+    ("gzip,z", po::bool_switch(&gzip), "Compress output in gzip format, the same as --compress gzip")
+    ("compress,c", po::value(&compression)->default_value("none"), "Compress output with none, gzip, bzip2, xz, zstd, or lz4.  Each record is a separate member.")
+    ("level,l", po::value(&out.level)->default_value(-1), "Compression level.  Default: 9 for gzip and bzip2, otherwise the library's default")
+    ("threads", po::value(&out.threads)->default_value(std::thread::hardware_concurrency()), "Number of threads checking records.  Matching --uri usually costs more than reading.")
+    ("compress-threads", po::value(&out.compress_threads)->default_value(std::thread::hardware_concurrency()), "Number of threads compressing output.")
+    ("decompress-threads", po::value(&out.decompress_threads)->default_value(std::thread::hardware_concurrency()), "Number of threads decompressing each gzipped input file, which works when records are separate members.  0 reads gzip on one thread.");
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).run(), vm);
+  if (vm["help"].as<bool>()) {
+    std::cerr <<
+      "Filters WARC records by their headers without running a child process.\n"
+      "A record is kept if it passes every condition given.\n" <<
+      desc <<
+      "Example:\n" <<
+      argv[0] << " -i in.warc.gz -t response -u '^https?://[^/]*\\.fr/' --max-length 1000000 -z >out.warc.gz\n";
+    exit(1);
+  }
+  po::notify(vm);
+  out.compression = gzip ? util::WriteCompressed::GZIP : util::ParseCompression(compression);
+  if (out.level < 0 && (out.compression == util::WriteCompressed::GZIP || out.compression == util::WriteCompressed::BZIP)) {
+    out.level = 9;
+  }
+  if (!out.compress_threads) out.compress_threads = 1;
+  if (!out.threads) out.threads = 1;
+  if (out.threads > kMaxThreads) {
+    std::cerr << "--threads must be at most " << kMaxThreads << ".\n";
+    exit(1);
+  }
+}
+
+class Filter {
+  public:
+    explicit Filter(const Options &options)
+      : types_(options.types),
+        content_types_(options.content_types),
+        use_uri_(!options.uri.empty()),
+        uri_(options.uri, std::regex::ECMAScript | std::regex::optimize),
+        min_length_(options.min_length),
+        max_length_(options.max_length),
+        invert_(options.invert) {}
+
+    bool Keep(const WARCRecord &record) const {
+      return Match(record) != invert_;
+    }
+
+  private:
+    bool Match(const WARCRecord &record) const {
+      if (record.payload.size() < min_length_ || record.payload.size() > max_length_) return false;
+      util::StringPiece value;
+      if (!types_.empty()) {
+        if (!record.Field("WARC-Type", value)) return false;
+        if (std::find(types_.begin(), types_.end(), value) == types_.end()) return false;
+      }
+      if (!content_types_.empty()) {
+        if (!record.Field("Content-Type", value)) return false;
+        bool found = false;
+        for (const std::string &prefix : content_types_) {
+          if (value.size() >= prefix.size() && !strncasecmp(value.data(), prefix.data(), prefix.size())) {
+            found = true;
+            break;
+          }
+        }
+        if (!found) return false;
+      }
+      if (use_uri_) {
+        if (!record.Field("WARC-Target-URI", value) || value.size() > kMaxURI) return false;
+        if (!std::regex_search(value.data(), value.data() + value.size(), uri_)) return false;
+      }
+      return true;
+    }
+
+    const std::vector<std::string> types_;
+    const std::vector<std::string> content_types_;
+    const bool use_uri_;
+    const std::regex uri_;
+    const std::size_t min_length_, max_length_;
+    const bool invert_;
+};
+
+// Checks each record on the reading thread.
+template <class Out> class SerialCheck {
+  public:
+    SerialCheck(const Filter &filter, Out &out) : filter_(filter), out_(out) {}
+
+    void Add(const WARCRecord &record, bool /*stable*/) {
+      if (filter_.Keep(record)) out_(record.record);
+    }
+
+    void Drain() {}
+
+  private:
+    const Filter &filter_;
+    Out &out_;
+};
+
+/* Checks batches of records on a pool of threads and writes those kept in
+ * input order from the calling thread.  Workers parse each record's header
+ * again from its bytes, which are copied unless they stay valid until Drain.
+ */
+template <class Out> class ParallelCheck {
+  public:
+    static const std::size_t kBatchRecords = 256;
+    static const std::size_t kBatchBytes = 1 << 20;
+
+    ParallelCheck(const Filter &filter, std::size_t threads, Out &out)
+      : filter_(filter), out_(out), window_size_(2 * threads), todo_(window_size_) {
+      filling_ = NewBatch();
+      for (std::size_t i = 0; i < threads; ++i) {
+        workers_.emplace_back(&ParallelCheck::Work, this);
+      }
+    }
+
+    ~ParallelCheck() {
+      // Records may point into a reader's memory, so let workers finish.
+      for (std::unique_ptr<Batch> &batch : pending_) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        Batch *b = batch.get();
+        done_cond_.wait(lock, [b]{ return b->done; });
+      }
+      for (std::size_t i = 0; i < workers_.size(); ++i) {
+        todo_.Produce(NULL);
+      }
+      for (std::thread &t : workers_) {
+        t.join();
+      }
+    }
+
+    // stable means record.record stays valid until Drain.
+    void Add(const WARCRecord &record, bool stable) {
+      Batch &batch = *filling_;
+      Entry entry;
+      if (stable) {
+        entry.data = record.record.data();
+        entry.offset = 0;
+      } else {
+        entry.data = NULL;
+        entry.offset = batch.storage.size();
+        batch.storage.append(record.record.data(), record.record.size());
+      }
+      entry.size = record.record.size();
+      batch.entries.push_back(entry);
+      batch.bytes += entry.size;
+      if (batch.entries.size() == kBatchRecords || batch.bytes >= kBatchBytes) Dispatch();
+    }
+
+    // Write every record added so far.
+    void Drain() {
+      if (!filling_->entries.empty()) Dispatch();
+      while (!pending_.empty()) WriteFront();
+    }
+
+  private:
+    // A record at data, or at offset in the batch's storage if data is NULL.
+    struct Entry {
+      const char *data;
+      std::size_t offset, size;
+    };
+
+    struct Batch {
+      std::vector<Entry> entries;
+      std::string storage;
+      std::size_t bytes;
+      std::vector<char> keep;
+      std::exception_ptr error;
+      bool done;
+    };
+
+    static util::StringPiece Record(const Batch &batch, const Entry &entry) {
+      return util::StringPiece((entry.data ? entry.data : batch.storage.data()) + entry.offset, entry.size);
+    }
+
+    std::unique_ptr<Batch> NewBatch() {
+      std::unique_ptr<Batch> ret;
+      if (free_.empty()) {
+        ret.reset(new Batch());
+      } else {
+        ret = std::move(free_.back());
+        free_.pop_back();
+      }
+      ret->entries.clear();
+      ret->storage.clear();
+      ret->bytes = 0;
+      ret->error = std::exception_ptr();
+      ret->done = false;
+      return ret;
+    }
+
+    void Dispatch() {
+      if (pending_.size() == window_size_) WriteFront();
+      Batch *batch = filling_.get();
+      pending_.push_back(std::move(filling_));
+      filling_ = NewBatch();
+      todo_.Produce(batch);
+    }
+
+    void WriteFront() {
+      Batch &batch = *pending_.front();
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cond_.wait(lock, [&batch]{ return batch.done; });
+      }
+      if (batch.error) std::rethrow_exception(batch.error);
+      for (std::size_t i = 0; i < batch.entries.size(); ++i) {
+        if (batch.keep[i]) out_(Record(batch, batch.entries[i]));
+      }
+      free_.push_back(std::move(pending_.front()));
+      pending_.pop_front();
+    }
+
+    void Work() {
+      WARCRecord record;
+      Batch *batch;
+      while ((batch = todo_.Consume())) {
+        try {
+          batch->keep.resize(batch->entries.size());
+          for (std::size_t i = 0; i < batch->entries.size(); ++i) {
+            util::StringPiece bytes(Record(*batch, batch->entries[i]));
+            ParseWARCRecord(bytes.data(), bytes.data() + bytes.size(), record);
+            batch->keep[i] = filter_.Keep(record);
+          }
+        } catch (...) {
+          batch->error = std::current_exception();
+        }
+        {
+          std::lock_guard<std::mutex> guard(mutex_);
+          batch->done = true;
+        }
+        done_cond_.notify_all();
+      }
+    }
+
+    const Filter &filter_;
+    Out &out_;
+    const std::size_t window_size_;
+
+    util::PCQueue<Batch*> todo_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable done_cond_;
+
+    // Only the calling thread touches these.
+    std::unique_ptr<Batch> filling_;
+    // Dispatched batches in input order.
+    std::deque<std::unique_ptr<Batch> > pending_;
+    std::vector<std::unique_ptr<Batch> > free_;
+};
+
+// Give check each record, reading files in turn.
+template <class Check> void FilterInputs(const std::vector<int> &files, const Options &options, Check &check) {
+  WARCRecord record;
+  for (int fd : files) {
+    if (WARCMapReader::Mappable(fd)) {
+      WARCMapReader reader(fd);
+      while (reader.Read(record)) {
+        check.Add(record, true);
+      }
+      // Records point into the mapping, which goes away with the reader.
+      check.Drain();
+    } else if (options.decompress_threads && WARCGzipReader::Parallel(fd)) {
+      WARCGzipReader reader(fd, options.decompress_threads);
+      while (reader.Read(record)) {
+        check.Add(record, false);
+      }
+    } else {
+      // Parse the fields of a record WARCReader has already found.
+      WARCReader reader(fd);
+      std::string str;
+      while (reader.Read(str)) {
+        ParseWARCRecord(str.data(), str.data() + str.size(), record);
+        check.Add(record, false);
+      }
+    }
+  }
+  check.Drain();
+}
+
+template <class Out> void Check(const std::vector<int> &files, const Options &options, const Filter &filter, Out &out) {
+  if (options.threads > 1) {
+    ParallelCheck<Out> check(filter, options.threads, out);
+    FilterInputs(files, options, check);
+  } else {
+    SerialCheck<Out> check(filter, out);
+    FilterInputs(files, options, check);
+  }
+}
+
+int Run(const Options &options) {
+  Filter filter(options);
+  std::vector<int> files;
+  for (const std::string &name : options.inputs) {
+    files.push_back(util::OpenReadOrThrow(name.c_str()));
+  }
+  if (files.empty()) files.push_back(0);
+  if (options.compression == util::WriteCompressed::NONE) {
+    util::FileStream stream(1);
+    auto out = [&stream](util::StringPiece record) { stream << record; };
+    Check(files, options, filter, out);
+  } else {
+    CompressPool pool(1, options.compression, options.level, options.compress_threads, true);
+    auto out = [&pool](util::StringPiece record) { pool.Write(record); };
+    Check(files, options, filter, out);
+    pool.Finish();
+  }
+  return 0;
+}
+
+} // namespace
+} // namespace preprocess
+
+int main(int argc, char *argv[]) {
+  preprocess::Options options;
+  preprocess::ParseArgs(argc, argv, options);
+  return preprocess::Run(options);
+}
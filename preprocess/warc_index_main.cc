@@ -0,0 +1,192 @@
+#include "warc.hh"
+
+#include "util/compress.hh"
+#include "util/exception.hh"
+#include "util/file_piece.hh"
+#include "util/file_stream.hh"
+#include "util/file.hh"
+#include "util/mmap.hh"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/program_options/options_description.hpp>
+#include <boost/program_options/parsers.hpp>
+#include <boost/program_options/positional_options.hpp>
+#include <boost/program_options/variables_map.hpp>
+
+namespace preprocess {
+namespace {
+
+struct Options {
+  std::string input;
+  bool extract;
+};
+
+void ParseArgs(int argc, char *argv[], Options &out) {
+  namespace po = boost::program_options;
+  po::options_description desc("Arguments");
+  desc.add_options()
+    ("help,h", po::bool_switch(), "Show this help message")
+    ("input", po::value(&out.input)->required(), "WARC file, uncompressed or gzipped")
+    ("extract,x", po::bool_switch(&out.extract), "Read index lines from stdin and write their records to stdout, uncompressed");
+  po::positional_options_description positional;
+  positional.add("input", 1);
+  po::variables_map vm;
+  po::store(po::command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+  if (argc == 1 || vm["help"].as<bool>()) {
+    std::cerr <<
+      "Indexes a WARC file so records can be read without reading the whole file.\n"
+      "Each index line is tab-separated: the offset and length of the gzip member\n"
+      "holding the record, or of the record in an uncompressed file, then\n"
+      "WARC-Type, WARC-Target-URI, and WARC-Record-ID.  Missing fields are -.\n"
+      "A gzipped file must have one record per member, as in Common Crawl or from\n"
+      "warc_parallel -z.\n" <<
+      desc <<
+      "Examples:\n" <<
+      argv[0] << " in.warc.gz >in.index\n" <<
+      "grep 'http://example.com/' in.index |" << argv[0] << " -x in.warc.gz >out.warc\n";
+    exit(1);
+  }
+  po::notify(vm);
+}
+
+void WriteField(const WARCRecord &record, const char *name, util::FileStream &out) {
+  util::StringPiece value;
+  if (record.Field(name, value) && !value.empty()) {
+    out << value;
+  } else {
+    out << '-';
+  }
+}
+
+void WriteEntry(uint64_t offset, uint64_t length, const WARCRecord &record, util::FileStream &out) {
+  out << offset << '\t' << length << '\t';
+  WriteField(record, "WARC-Type", out);
+  out << '\t';
+  WriteField(record, "WARC-Target-URI", out);
+  out << '\t';
+  WriteField(record, "WARC-Record-ID", out);
+  out << '\n';
+}
+
+// The ID as written to the index.
+util::StringPiece RecordID(const WARCRecord &record) {
+  util::StringPiece id;
+  if (!record.Field("WARC-Record-ID", id) || id.empty()) return "-";
+  return id;
+}
+
+void IndexUncompressed(int fd, util::FileStream &out) {
+  WARCMapReader reader(fd);
+  WARCRecord record;
+  while (reader.Read(record)) {
+    WriteEntry(reader.Offset(record), record.record.size(), record, out);
+  }
+}
+
+// Members are decompressed whole, so refuse any that would not fit in memory,
+// such as a file gzipped all at once.
+const std::size_t kMemberLimit = 64 << 20;
+
+void IndexGzip(int fd, util::FileStream &out) {
+  util::scoped_fd file(fd);
+  uint64_t size = util::SizeOrThrow(fd);
+  util::scoped_memory mem;
+  util::MapRead(util::LAZY, fd, 0, size, mem);
+  madvise(mem.get(), mem.size(), MADV_SEQUENTIAL);
+  std::string decompressed;
+  WARCRecord record;
+  for (uint64_t offset = 0; offset < size;) {
+    decompressed.clear();
+    std::size_t length;
+    try {
+      length = util::GZDecompressMember(util::StringPiece(mem.begin() + offset, size - offset), decompressed, kMemberLimit);
+    } catch (const util::GZException &e) {
+      UTIL_THROW(util::Exception, "The gzip member at offset " << offset << " is truncated or holds more than " << (kMemberLimit >> 20) << " MB.  Indexing requires each gzip member to hold one whole record.");
+    }
+    const char *end = decompressed.data() + decompressed.size();
+    const char *record_end;
+    try {
+      record_end = ParseWARCRecord(decompressed.data(), end, record);
+    } catch (const util::EndOfFileException &e) {
+      UTIL_THROW(util::Exception, "A record continues past the end of the gzip member at offset " << offset << ".  Indexing requires each gzip member to hold one whole record.");
+    }
+    // Otherwise every record in the member would point at all of it.
+    UTIL_THROW_IF2(record_end != end, "The gzip member at offset " << offset << " holds more than one record.  Indexing requires each gzip member to hold one whole record.");
+    WriteEntry(offset, length, record, out);
+    offset += length;
+  }
+}
+
+void Index(int fd) {
+  util::FileStream out(1);
+  if (WARCMapReader::Mappable(fd)) {
+    IndexUncompressed(fd, out);
+    return;
+  }
+  struct stat info;
+  UTIL_THROW_IF_ARG(fstat(fd, &info), util::FDException, (fd), "Could not stat");
+  UTIL_THROW_IF2(!S_ISREG(info.st_mode), "The WARC must be a file, not a pipe, so offsets can be read back");
+  char magic[2];
+  util::ErsatzPRead(fd, magic, sizeof(magic), 0);
+  UTIL_THROW_IF2(magic[0] != '\x1f' || magic[1] != '\x8b', "Only uncompressed and gzipped WARC files can be indexed");
+  IndexGzip(fd, out);
+}
+
+// Fields of an index line up to the record ID.
+util::StringPiece NextField(util::StringPiece &line) {
+  const char *tab = static_cast<const char*>(memchr(line.data(), '\t', line.size()));
+  const char *end = tab ? tab : line.data() + line.size();
+  util::StringPiece ret(line.data(), end - line.data());
+  line = tab ? util::StringPiece(tab + 1, line.data() + line.size() - tab - 1) : util::StringPiece();
+  return ret;
+}
+
+uint64_t ParseNumber(util::StringPiece field, util::StringPiece line) {
+  char *end;
+  uint64_t ret = std::strtoull(field.data(), &end, 10);
+  UTIL_THROW_IF2(field.empty() || end != field.data() + field.size(), "Bad number in index line `" << line << '\'');
+  return ret;
+}
+
+void Extract(int fd) {
+  WARCSeekReader reader(fd);
+  util::FilePiece in(0);
+  util::FileStream out(1);
+  WARCRecord record;
+  for (util::StringPiece line : in) {
+    util::StringPiece rest(line);
+    uint64_t offset = ParseNumber(NextField(rest), line);
+    uint64_t length = ParseNumber(NextField(rest), line);
+    NextField(rest);
+    NextField(rest);
+    util::StringPiece id(NextField(rest));
+    UTIL_THROW_IF2(id.empty(), "No record ID in index line `" << line << '\'');
+    // A member may hold several records, so find the first with this ID.
+    reader.Seek(offset, length);
+    do {
+      UTIL_THROW_IF2(!reader.Read(record), "No record " << id << " at offset " << offset);
+    } while (RecordID(record) != id);
+    out << record.record;
+  }
+}
+
+} // namespace
+} // namespace preprocess
+
+int main(int argc, char *argv[]) {
+  preprocess::Options options;
+  preprocess::ParseArgs(argc, argv, options);
+  int fd = util::OpenReadOrThrow(options.input.c_str());
+  if (options.extract) {
+    preprocess::Extract(fd);
+  } else {
+    preprocess::Index(fd);
+  }
+}
@@ -1,15 +1,13 @@
-#include "captive_child.hh"
+#include "child_pool.hh"
+#include "compress_pool.hh"
 #include "warc.hh"
 
 #include "util/compress.hh"
 #include "util/file_stream.hh"
 #include "util/file.hh"
 #include "util/fixed_array.hh"
-#include "util/pcqueue.hh"
-
-#include <sys/types.h>
-#include <sys/wait.h>
 
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
@@ -21,125 +19,89 @@
 namespace preprocess {
 namespace {
 
-// Thread to read from queue and dump to a worker.  Steals process_in.
-void InputToProcess(util::PCQueue<std::string> *queue, int process_in) {
-  // Steal fd for consistency with OutputFromProcess.
-  util::scoped_fd fd(process_in);
-  std::string warc;
-  while (true) {
-    queue->ConsumeSwap(warc);
-    if (warc.empty()) return;
-    util::WriteOrThrow(process_in, warc.data(), warc.size());
-  }
-}
+// WARC records in and out.
+struct WARCFormat {
+  struct Expect {};
+  typedef WARCReader Source;
 
-// Thread to write from a worker to output.  Steals process_out.
-void OutputFromProcess(bool compress, int process_out, util::FileStream *out, std::mutex *out_mutex) {
-  WARCReader reader(process_out);
-  std::string str;
-  if (compress) {
-    std::string compressed;
-    while (reader.Read(str)) {
-      util::GZCompress(str, compressed);
-      std::lock_guard<std::mutex> guard(*out_mutex);
-      *out << compressed;
-    }
-  } else {
-    while (reader.Read(str)) {
-      std::lock_guard<std::mutex> guard(*out_mutex);
-      *out << str;
-    }
+  void Read(WARCReader &from, Expect &, std::string &out) const {
+    std::string str;
+    UTIL_THROW_IF(!from.Read(str), util::EndOfFileException, " before the child produced a record for each input record.  --ordered requires exactly one output record per input record.");
+    out += str;
   }
-}
 
-// Thread to read WARC input from a file.  Steals from.  Does not poison the queue.
-void ReadInput(int from, util::PCQueue<std::string> *queue) {
-  preprocess::WARCReader reader(from);
-  std::string str;
-  while (reader.Read(str)) {
-    queue->ProduceSwap(str);
+  bool AtEnd(WARCReader &from) const {
+    std::string str;
+    return !from.Read(str);
   }
-}
 
-// A child process going from WARC to WARC.
-class Worker {
-  public:
-    Worker(util::PCQueue<std::string> &in, util::FileStream &out, std::mutex &out_mutex, bool compress, char *argv[]) {
-      util::scoped_fd in_file, out_file;
-      Launch(argv, in_file, out_file);
-      input_ = std::thread(InputToProcess, &in, in_file.release());
-      output_ = std::thread(OutputFromProcess, compress, out_file.release(), &out, &out_mutex);
-    }
-
-    void Join() {
-      input_.join();
-      output_.join();
-    }
-
-  private:
-    std::thread input_, output_;
+  bool ReadAny(WARCReader &from, std::string &out) const {
+    std::string str;
+    if (!from.Read(str)) return false;
+    out += str;
+    return true;
+  }
 };
 
-void ChildReaper(std::size_t expect) {
-  try {
-    for (; expect; --expect) {
-      int wstatus;
-      pid_t process = waitpid(-1, &wstatus, 0);
-      UTIL_THROW_IF(-1 == process, util::ErrnoException, "waitpid");
-      UTIL_THROW_IF(!WIFEXITED(wstatus), util::Exception, "Child process " << process << " terminated abnormally.");
-      UTIL_THROW_IF(WEXITSTATUS(wstatus), util::Exception, "Child process " << process << " terminated with code " << WEXITSTATUS(wstatus) << ".");
-    }
-  } catch (const std::exception &e) {
-    std::cerr << e.what() << std::endl;
-    abort();
-  }
-}
+// An input file, which is memory mapped if it is uncompressed.
+struct Input {
+  int fd;
+  WARCMapReader *mapped;
+  std::size_t decompress_threads;
+};
 
-class WorkerPool {
-  public:
-    WorkerPool(std::size_t number, util::FileStream &out, bool compress, char *argv[]) : in_(number), workers_(number) {
-      for (std::size_t i = 0; i < number; ++i) {
-        workers_.push_back(in_, out, out_mutex_, compress, argv);
+// Thread to read WARC input from files in turn.  Steals from.  Mapped records
+// are written to the children straight from the mapping.
+template <class Children> void ReadInput(std::vector<Input> from, Children *children, std::mutex *send_mutex) {
+  std::string str;
+  WARCRecord record;
+  for (const Input &input : from) {
+    if (input.mapped) {
+      while (input.mapped->Read(record)) {
+        std::lock_guard<std::mutex> guard(*send_mutex);
+        children->SendReference(WARCFormat::Expect(), record.record);
       }
-      child_reaper_ = std::thread(ChildReaper, number);
-    }
-
-    util::PCQueue<std::string> &InputQueue() { return in_; }
-
-    void Join() {
-      // Poison all of them first.
-      std::string str;
-      for (std::size_t i = 0; i < workers_.size(); ++i) {
-        in_.Produce(str);
+    } else if (input.decompress_threads && WARCGzipReader::Parallel(input.fd)) {
+      WARCGzipReader reader(input.fd, input.decompress_threads);
+      while (reader.Read(record)) {
+        std::lock_guard<std::mutex> guard(*send_mutex);
+        children->Send(WARCFormat::Expect(), record.record);
       }
-      for (Worker &i : workers_) {
-        i.Join();
+    } else {
+      preprocess::WARCReader reader(input.fd);
+      while (reader.Read(str)) {
+        std::lock_guard<std::mutex> guard(*send_mutex);
+        children->Send(WARCFormat::Expect(), str);
       }
-      child_reaper_.join();
     }
-    
-  private:
-    util::PCQueue<std::string> in_;
-    std::mutex out_mutex_;
-    util::FixedArray<Worker> workers_;
-
-    std::thread child_reaper_;
-};
+  }
+}
 
 struct Options {
   std::vector<std::string> inputs;
   std::size_t workers;
-  bool compress;
+  util::WriteCompressed::Compression compression;
+  int level;
+  std::size_t compress_threads;
+  std::size_t decompress_threads;
+  bool ordered;
 };
 
 void ParseBoostArgs(int restricted_argc, int real_argc, char *argv[], Options &out) {
   namespace po = boost::program_options;
   po::options_description desc("Arguments");
+  bool gzip;
+  std::string compression;
   desc.add_options()
     ("help,h", po::bool_switch(), "Show this help message")
-    ("inputs,i", po::value(&out.inputs)->multitoken(), "Input files, which will be read in parallel and jumbled together.  Default: read from stdin.")
+    ("inputs,i", po::value(&out.inputs)->multitoken(), "Input files, which will be read in parallel and jumbled together unless --ordered.  Default: read from stdin.")
     ("jobs,j", po::value(&out.workers)->default_value(std::thread::hardware_concurrency()), "Number of child process workers to use.")
-    ("gzip,z", po::bool_switch(&out.compress), "Compress output in gzip format");
+    ("gzip,z", po::bool_switch(&gzip), "Compress output in gzip format, the same as --compress gzip")
+    ("compress,c", po::value(&compression)->default_value("none"), "Compress output with none, gzip, bzip2, xz, zstd, or lz4.  Each record is a separate member.")
+    ("level,l", po::value(&out.level)->default_value(-1), "Compression level.  Default: 9 for gzip and bzip2, otherwise the library's default")
+    ("compress-threads", po::value(&out.compress_threads)->default_value(std::thread::hardware_concurrency()), "Number of threads compressing output.")
+    ("decompress-threads", po::value(&out.decompress_threads)->default_value(std::thread::hardware_concurrency()), "Number of threads decompressing each gzipped input file, which works when records are separate members.  0 reads gzip on one thread.")
+    ("ordered,o", po::bool_switch(&out.ordered), "Write output records in input order, with input files read one after another.  The child must produce exactly one record for each record it is given.");
   po::variables_map vm;
   po::store(po::command_line_parser(restricted_argc, argv).options(desc).run(), vm);
   if (real_argc == 1 || vm["help"].as<bool>()) {
@@ -151,11 +113,17 @@ void ParseBoostArgs(int restricted_argc, int real_argc, char *argv[], Options &o
       desc <<
       "Examples:\n" <<
       argv[0] << " -j 20 ./process_warc.sh\n" <<
-      argv[0] << " -i a.warc b.warc -- ./process_warc.sh\n"
+      argv[0] << " -i a.warc b.warc -- ./process_warc.sh\n" <<
+      argv[0] << " --ordered -j 20 ./process_warc.sh\n"
       "process_warc.sh is expected to take WARC on stdin and produce WARC on stdout.\n";
     exit(1);
   }
   po::notify(vm);
+  out.compression = gzip ? util::WriteCompressed::GZIP : util::ParseCompression(compression);
+  if (out.level < 0 && (out.compression == util::WriteCompressed::GZIP || out.compression == util::WriteCompressed::BZIP)) {
+    out.level = 9;
+  }
+  if (!out.compress_threads) out.compress_threads = 1;
 }
 
 // Figuring out where the command line for the child is.
@@ -168,10 +136,10 @@ char **FindChild(int argc, char *argv[]) {
     if (!strcmp(a, "--help") || !strcmp(a, "-h")) {
       // Help, doesn't matter, just make sure command is past that.
       return argv + i + 1;
-    } else if (!strcmp(a, "--gzip") || !strcmp(a, "-z")) {
+    } else if (!strcmp(a, "--gzip") || !strcmp(a, "-z") || !strcmp(a, "--ordered") || !strcmp(a, "-o")) {
       i += 1;
-    } else if (!strcmp(a, "--jobs") || !strcmp(a, "-j")) {
-      UTIL_THROW_IF2(i + 1 == argc, "Expected argument to jobs");
+    } else if (!strcmp(a, "--jobs") || !strcmp(a, "-j") || !strcmp(a, "--compress") || !strcmp(a, "-c") || !strcmp(a, "--level") || !strcmp(a, "-l") || !strcmp(a, "--compress-threads") || !strcmp(a, "--decompress-threads")) {
+      UTIL_THROW_IF2(i + 1 == argc, "Expected argument to " << a);
       i += 2;
     } else if (!strcmp(a, "--inputs") || !strcmp(a, "-i")) {
       used_inputs = true;
@@ -192,23 +160,61 @@ char **FindChild(int argc, char *argv[]) {
   exit(1);
 }
 
-void Run(const Options &options, char *child[]) {
-  util::FileStream out(1);
-
-  WorkerPool pool(options.workers, out, options.compress, child);
+template <bool Ordered> int Run(const Options &options, char *child[]) {
+  typedef ChildPool<WARCFormat, Ordered> Children;
+  Children children(child, options.workers);
 
-  util::FixedArray<std::thread> readers(options.inputs.empty() ? 1 : options.inputs.size());
-  if (options.inputs.empty()) {
-    readers.push_back(ReadInput, 0, &pool.InputQueue());
+  std::vector<int> files;
+  for (const std::string &name : options.inputs) {
+    files.push_back(util::OpenReadOrThrow(name.c_str()));
+  }
+  if (files.empty()) files.push_back(0);
+  // Mappings must outlive the children, which write from them.
+  std::vector<std::unique_ptr<WARCMapReader> > mapped;
+  std::vector<Input> inputs;
+  for (int fd : files) {
+    Input input;
+    input.fd = fd;
+    input.mapped = nullptr;
+    input.decompress_threads = options.decompress_threads;
+    if (WARCMapReader::Mappable(fd)) {
+      mapped.emplace_back(new WARCMapReader(fd));
+      input.mapped = mapped.back().get();
+    }
+    inputs.push_back(input);
+  }
+  // Ordered output is reproducible only if records are sent in a fixed order.
+  std::mutex send_mutex;
+  util::FixedArray<std::thread> readers(Ordered ? 1 : inputs.size());
+  if (Ordered) {
+    readers.push_back(ReadInput<Children>, inputs, &children, &send_mutex);
   } else {
-    for (const std::string &name : options.inputs) {
-      readers.push_back(ReadInput, util::OpenReadOrThrow(name.c_str()), &pool.InputQueue());
+    for (const Input &input : inputs) {
+      readers.push_back(ReadInput<Children>, std::vector<Input>(1, input), &children, &send_mutex);
     }
   }
-  for (std::thread &r : readers) {
-    r.join();
+  std::thread finisher([&readers, &children]{
+    for (std::thread &r : readers) {
+      r.join();
+    }
+    children.Finish();
+  });
+
+  util::StringPiece record;
+  if (options.compression == util::WriteCompressed::NONE) {
+    util::FileStream out(1);
+    while (children.Receive(record)) {
+      out << record;
+    }
+  } else {
+    CompressPool out(1, options.compression, options.level, options.compress_threads, true);
+    while (children.Receive(record)) {
+      out.Write(record);
+    }
+    out.Finish();
   }
-  pool.Join();
+  finisher.join();
+  return children.Wait();
 }
 
 } // namespace
@@ -218,5 +224,5 @@ int main(int argc, char *argv[]) {
   char **child = preprocess::FindChild(argc, argv);
   preprocess::Options options;
   preprocess::ParseBoostArgs(child - argv, argc, argv, options);
-  Run(options, child);
+  return options.ordered ? preprocess::Run<true>(options, child) : preprocess::Run<false>(options, child);
 }
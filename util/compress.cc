@@ -2,15 +2,25 @@
 
 #include "util/file.hh"
 #include "util/have.hh"
+#include "util/pcqueue.hh"
 #include "util/scoped.hh"
+#include "util/uring_read.hh"
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 #include <cassert>
 #include <climits>
 #include <cstdlib>
 #include <cstring>
+#include <limits>
+#include <utility>
 
 #ifdef HAVE_ZLIB
 #include <zlib.h>
@@ -24,6 +34,14 @@
 #include <lzma.h>
 #endif
 
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4frame.h>
+#endif
+
 namespace util {
 
 CompressedException::CompressedException() throw() {}
@@ -38,6 +56,12 @@ BZException::~BZException() throw() {}
 XZException::XZException() throw() {}
 XZException::~XZException() throw() {}
 
+ZStdException::ZStdException() throw() {}
+ZStdException::~ZStdException() throw() {}
+
+LZ4Exception::LZ4Exception() throw() {}
+LZ4Exception::~LZ4Exception() throw() {}
+
 void ReadBase::ReplaceThis(ReadBase *with, ReadCompressed &thunk) {
   thunk.internal_.reset(with);
 }
@@ -65,13 +89,13 @@ class Uncompressed : public ReadBase {
     explicit Uncompressed(int fd) : fd_(fd) {}
 
     std::size_t Read(void *to, std::size_t amount, ReadCompressed &thunk) {
-      std::size_t got = PartialRead(fd_.get(), to, amount);
+      std::size_t got = fd_.Read(to, amount);
       ReadCount(thunk) += got;
       return got;
     }
 
   private:
-    scoped_fd fd_;
+    UringRead fd_;
 };
 
 class UncompressedWithHeader : public ReadBase {
@@ -134,12 +158,12 @@ template <class Compression> class ReadStream : public ReadBase {
   private:
     void ReadInput(ReadCompressed &thunk) {
       assert(!back_.AvailInput());
-      std::size_t got = ReadOrEOF(file_.get(), in_buffer_.get(), kInputBuffer);
+      std::size_t got = file_.ReadOrEOF(in_buffer_.get(), kInputBuffer);
       back_.SetInput(in_buffer_.get(), got);
       ReadCount(thunk) += got;
     }
 
-    scoped_fd file_;
+    UringRead file_;
     scoped_malloc in_buffer_;
 
     Compression back_;
@@ -408,13 +432,32 @@ const std::size_t BZipWrite::kMinOutput = 1; /* seemingly no magic number? */
 #endif // HAVE_BZLIB
 
 #ifdef HAVE_XZLIB
+void XZHandleError(lzma_ret value) {
+  switch (value) {
+    case LZMA_OK:
+      return;
+    case LZMA_MEM_ERROR:
+      throw std::bad_alloc();
+    case LZMA_FORMAT_ERROR:
+      UTIL_THROW(XZException, "xzlib says file format not recognized");
+    case LZMA_OPTIONS_ERROR:
+      UTIL_THROW(XZException, "xzlib says unsupported compression options");
+    case LZMA_DATA_ERROR:
+      UTIL_THROW(XZException, "xzlib says this file is corrupt");
+    case LZMA_BUF_ERROR:
+      UTIL_THROW(XZException, "xzlib says unexpected end of input");
+    default:
+      UTIL_THROW(XZException, "unrecognized xzlib error " << value);
+  }
+}
+
 class XZip {
   public:
     XZip(const void *base, std::size_t amount)
       : stream_(), action_(LZMA_RUN) {
       memset(&stream_, 0, sizeof(stream_));
       SetInput(base, amount);
-      HandleError(lzma_stream_decoder(&stream_, UINT64_MAX, 0));
+      XZHandleError(lzma_stream_decoder(&stream_, UINT64_MAX, 0));
     }
 
     ~XZip() {
@@ -435,7 +478,7 @@ class XZip {
     bool Process() {
       lzma_ret status = lzma_code(&stream_, action_);
       if (status == LZMA_STREAM_END) return false;
-      HandleError(status);
+      XZHandleError(status);
       return true;
     }
 
@@ -451,30 +494,324 @@ class XZip {
     std::size_t AvailOutput() const { return stream_.avail_out; }
 
   private:
-    void HandleError(lzma_ret value) {
-      switch (value) {
-        case LZMA_OK:
-          return;
-        case LZMA_MEM_ERROR:
-          throw std::bad_alloc();
-        case LZMA_FORMAT_ERROR:
-          UTIL_THROW(XZException, "xzlib says file format not recognized");
-        case LZMA_OPTIONS_ERROR:
-          UTIL_THROW(XZException, "xzlib says unsupported compression options");
-        case LZMA_DATA_ERROR:
-          UTIL_THROW(XZException, "xzlib says this file is corrupt");
-        case LZMA_BUF_ERROR:
-          UTIL_THROW(XZException, "xzlib says unexpected end of input");
-        default:
-          UTIL_THROW(XZException, "unrecognized xzlib error " << value);
-      }
+    lzma_stream stream_;
+    lzma_action action_;
+};
+
+class XZipWrite {
+  public:
+    static const std::size_t kSizeMax;
+    static const std::size_t kMinOutput;
+
+    explicit XZipWrite(int level) : level_(level < 0 ? LZMA_PRESET_DEFAULT : std::min(level, 9)) {
+      memset(&stream_, 0, sizeof(stream_));
+      Reset();
     }
 
+    ~XZipWrite() {
+      lzma_end(&stream_);
+    }
+
+    void SetOutput(void *base, std::size_t amount) {
+      stream_.next_out = static_cast<uint8_t*>(base);
+      stream_.avail_out = amount;
+    }
+
+    void SetInput(const void *base, std::size_t amount) {
+      stream_.next_in = static_cast<const uint8_t*>(base);
+      stream_.avail_in = amount;
+    }
+
+    const uint8_t *NextOutput() const {
+      return reinterpret_cast<const uint8_t*>(stream_.next_out);
+    }
+
+    const uint8_t *NextInput() const {
+      return reinterpret_cast<const uint8_t*>(stream_.next_in);
+    }
+
+    std::size_t AvailInput() const { return stream_.avail_in; }
+    std::size_t AvailOutput() const { return stream_.avail_out; }
+
+    bool EnoughOutput() const {
+      return AvailOutput() >= kMinOutput;
+    }
+
+    void Process() {
+      XZHandleError(lzma_code(&stream_, LZMA_RUN));
+    }
+
+    bool Finish() {
+      lzma_ret status = lzma_code(&stream_, LZMA_FINISH);
+      if (status == LZMA_STREAM_END) return true;
+      XZHandleError(status);
+      return false;
+    }
+
+    // Start a new stream, keeping the output buffer.
+    void Reset() {
+      uint8_t *next_out = stream_.next_out;
+      std::size_t avail_out = stream_.avail_out;
+      XZHandleError(lzma_easy_encoder(&stream_, level_, LZMA_CHECK_CRC64));
+      SetOutput(next_out, avail_out);
+    }
+
+  private:
     lzma_stream stream_;
-    lzma_action action_;
+    uint32_t level_;
 };
+
+const std::size_t XZipWrite::kSizeMax = std::numeric_limits<std::size_t>::max();
+const std::size_t XZipWrite::kMinOutput = 1;
 #endif // HAVE_XZLIB
 
+#ifdef HAVE_ZSTD
+void ZStdHandleError(std::size_t value) {
+  UTIL_THROW_IF(ZSTD_isError(value), ZStdException, "zstd error: " << ZSTD_getErrorName(value));
+}
+
+// ZSTD_inBuffer and ZSTD_outBuffer with the interface of the other libraries.
+class ZStd {
+  public:
+    static const std::size_t kSizeMax;
+
+    ZStd() {
+      SetInput(NULL, 0);
+      SetOutput(NULL, 0);
+    }
+
+    void SetOutput(void *to, std::size_t amount) {
+      out_.dst = to;
+      out_.size = amount;
+      out_.pos = 0;
+    }
+
+    void SetInput(const void *base, std::size_t amount) {
+      in_.src = base;
+      in_.size = amount;
+      in_.pos = 0;
+    }
+
+    const uint8_t *NextOutput() const {
+      return static_cast<const uint8_t*>(out_.dst) + out_.pos;
+    }
+
+    const uint8_t *NextInput() const {
+      return static_cast<const uint8_t*>(in_.src) + in_.pos;
+    }
+
+    std::size_t AvailInput() const { return in_.size - in_.pos; }
+    std::size_t AvailOutput() const { return out_.size - out_.pos; }
+
+  protected:
+    ZSTD_inBuffer in_;
+    ZSTD_outBuffer out_;
+};
+
+const std::size_t ZStd::kSizeMax = std::numeric_limits<std::size_t>::max();
+
+class ZStdRead : public ZStd {
+  public:
+    ZStdRead(const void *base, std::size_t amount) : stream_(ZSTD_createDStream()) {
+      if (!stream_) throw std::bad_alloc();
+      SetInput(base, amount);
+    }
+
+    ~ZStdRead() {
+      ZSTD_freeDStream(stream_);
+    }
+
+    // Returns false at the end of a frame.
+    bool Process() {
+      std::size_t before = out_.pos;
+      bool empty = !AvailInput();
+      std::size_t ret = ZSTD_decompressStream(stream_, &out_, &in_);
+      ZStdHandleError(ret);
+      // ReadStream only passes empty input at the end of the file.
+      UTIL_THROW_IF(ret && empty && out_.pos == before, ZStdException, "zstd input is truncated");
+      return ret != 0;
+    }
+
+  private:
+    ZSTD_DStream *stream_;
+};
+
+class ZStdWrite : public ZStd {
+  public:
+    static const std::size_t kMinOutput;
+
+    explicit ZStdWrite(int level, std::size_t threads = 1) : context_(ZSTD_createCCtx()) {
+      if (!context_) throw std::bad_alloc();
+      ZStdHandleError(ZSTD_CCtx_setParameter(context_, ZSTD_c_compressionLevel, level < 0 ? ZSTD_CLEVEL_DEFAULT : level));
+      // Fails if the library was built without threads, which just means one.
+      if (threads > 1) ZSTD_CCtx_setParameter(context_, ZSTD_c_nbWorkers, threads);
+    }
+
+    ~ZStdWrite() {
+      ZSTD_freeCCtx(context_);
+    }
+
+    bool EnoughOutput() const {
+      return AvailOutput() >= kMinOutput;
+    }
+
+    void Process() {
+      ZStdHandleError(ZSTD_compressStream2(context_, &out_, &in_, ZSTD_e_continue));
+    }
+
+    bool Finish() {
+      std::size_t remaining = ZSTD_compressStream2(context_, &out_, &in_, ZSTD_e_end);
+      ZStdHandleError(remaining);
+      return !remaining;
+    }
+
+    void Reset() {
+      ZStdHandleError(ZSTD_CCtx_reset(context_, ZSTD_reset_session_only));
+    }
+
+  private:
+    ZSTD_CCtx *context_;
+};
+
+const std::size_t ZStdWrite::kMinOutput = 1;
+#endif // HAVE_ZSTD
+
+#ifdef HAVE_LZ4
+void LZ4HandleError(std::size_t value) {
+  UTIL_THROW_IF(LZ4F_isError(value), LZ4Exception, "LZ4 error: " << LZ4F_getErrorName(value));
+}
+
+class LZ4 {
+  public:
+    static const std::size_t kSizeMax;
+
+    void SetOutput(void *to, std::size_t amount) {
+      next_out_ = static_cast<uint8_t*>(to);
+      avail_out_ = amount;
+    }
+
+    void SetInput(const void *base, std::size_t amount) {
+      next_in_ = static_cast<const uint8_t*>(base);
+      avail_in_ = amount;
+    }
+
+    const uint8_t *NextOutput() const { return next_out_; }
+    const uint8_t *NextInput() const { return next_in_; }
+
+    std::size_t AvailInput() const { return avail_in_; }
+    std::size_t AvailOutput() const { return avail_out_; }
+
+  protected:
+    LZ4() : next_out_(NULL), avail_out_(0), next_in_(NULL), avail_in_(0) {}
+
+    void Produced(std::size_t amount) {
+      next_out_ += amount;
+      avail_out_ -= amount;
+    }
+
+    void Consumed(std::size_t amount) {
+      next_in_ += amount;
+      avail_in_ -= amount;
+    }
+
+    uint8_t *next_out_;
+    std::size_t avail_out_;
+    const uint8_t *next_in_;
+    std::size_t avail_in_;
+};
+
+const std::size_t LZ4::kSizeMax = std::numeric_limits<std::size_t>::max();
+
+class LZ4Read : public LZ4 {
+  public:
+    LZ4Read(const void *base, std::size_t amount) {
+      LZ4HandleError(LZ4F_createDecompressionContext(&context_, LZ4F_VERSION));
+      SetInput(base, amount);
+    }
+
+    ~LZ4Read() {
+      LZ4F_freeDecompressionContext(context_);
+    }
+
+    // Returns false at the end of a frame.
+    bool Process() {
+      std::size_t produced = avail_out_, consumed = avail_in_;
+      std::size_t hint = LZ4F_decompress(context_, next_out_, &produced, next_in_, &consumed, NULL);
+      LZ4HandleError(hint);
+      // ReadStream only passes empty input at the end of the file.
+      UTIL_THROW_IF(hint && !avail_in_ && !produced, LZ4Exception, "LZ4 input is truncated");
+      Produced(produced);
+      Consumed(consumed);
+      return hint != 0;
+    }
+
+  private:
+    LZ4F_dctx *context_;
+};
+
+class LZ4Write : public LZ4 {
+  public:
+    // Input is compressed this much at a time so kMinOutput always fits it.
+    static const std::size_t kInputBlock = 1 << 16;
+    static const std::size_t kMinOutput;
+
+    explicit LZ4Write(int level) : started_(false) {
+      memset(&preferences_, 0, sizeof(preferences_));
+      preferences_.compressionLevel = level < 0 ? 0 : level;
+      LZ4HandleError(LZ4F_createCompressionContext(&context_, LZ4F_VERSION));
+    }
+
+    ~LZ4Write() {
+      LZ4F_freeCompressionContext(context_);
+    }
+
+    bool EnoughOutput() const {
+      return AvailOutput() >= kMinOutput;
+    }
+
+    void Process() {
+      Start();
+      std::size_t amount = std::min(avail_in_, kInputBlock);
+      std::size_t produced = LZ4F_compressUpdate(context_, next_out_, avail_out_, next_in_, amount, NULL);
+      LZ4HandleError(produced);
+      Produced(produced);
+      Consumed(amount);
+    }
+
+    bool Finish() {
+      if (avail_in_) {
+        Process();
+        return false;
+      }
+      Start();
+      std::size_t produced = LZ4F_compressEnd(context_, next_out_, avail_out_, NULL);
+      LZ4HandleError(produced);
+      Produced(produced);
+      return true;
+    }
+
+    void Reset() {
+      started_ = false;
+    }
+
+  private:
+    void Start() {
+      if (started_) return;
+      std::size_t produced = LZ4F_compressBegin(context_, next_out_, avail_out_, &preferences_);
+      LZ4HandleError(produced);
+      Produced(produced);
+      started_ = true;
+    }
+
+    LZ4F_cctx *context_;
+    LZ4F_preferences_t preferences_;
+    bool started_;
+};
+
+// The header and compressing a block or ending the frame.
+const std::size_t LZ4Write::kMinOutput = LZ4F_HEADER_SIZE_MAX + LZ4F_compressBound(LZ4Write::kInputBlock, NULL);
+#endif // HAVE_LZ4
+
 class IStreamReader : public ReadBase {
   public:
     explicit IStreamReader(std::istream &stream) : stream_(stream) {}
@@ -493,7 +830,7 @@ class IStreamReader : public ReadBase {
 };
 
 enum MagicResult {
-  UTIL_UNKNOWN, UTIL_GZIP, UTIL_BZIP, UTIL_XZIP
+  UTIL_UNKNOWN, UTIL_GZIP, UTIL_BZIP, UTIL_XZIP, UTIL_ZSTD, UTIL_LZ4
 };
 
 MagicResult DetectMagic(const void *from_void, std::size_t length) {
@@ -509,6 +846,14 @@ MagicResult DetectMagic(const void *from_void, std::size_t length) {
   if (length >= sizeof(kXZMagic) && !memcmp(header, kXZMagic, sizeof(kXZMagic))) {
     return UTIL_XZIP;
   }
+  const uint8_t kZStdMagic[4] = { 0x28, 0xB5, 0x2F, 0xFD };
+  if (length >= sizeof(kZStdMagic) && !memcmp(header, kZStdMagic, sizeof(kZStdMagic))) {
+    return UTIL_ZSTD;
+  }
+  const uint8_t kLZ4Magic[4] = { 0x04, 0x22, 0x4D, 0x18 };
+  if (length >= sizeof(kLZ4Magic) && !memcmp(header, kLZ4Magic, sizeof(kLZ4Magic))) {
+    return UTIL_LZ4;
+  }
   return UTIL_UNKNOWN;
 }
 
@@ -543,6 +888,18 @@ ReadBase *ReadFactory(int fd, uint64_t &raw_amount, const void *already_data, co
       return new ReadStream<XZip>(hold.release(), header.data(), header.size());
 #else
       UTIL_THROW(CompressedException, "This looks like an xz file, but xz support was not compiled in.");
+#endif
+    case UTIL_ZSTD:
+#ifdef HAVE_ZSTD
+      return new ReadStream<ZStdRead>(hold.release(), header.data(), header.size());
+#else
+      UTIL_THROW(CompressedException, "This looks like a zstd file, but zstd support was not compiled in.");
+#endif
+    case UTIL_LZ4:
+#ifdef HAVE_LZ4
+      return new ReadStream<LZ4Read>(hold.release(), header.data(), header.size());
+#else
+      UTIL_THROW(CompressedException, "This looks like an LZ4 file, but LZ4 support was not compiled in.");
 #endif
     default:
       UTIL_THROW_IF(require_compressed, CompressedException, "Uncompressed data detected after a compresssed file.  This could be supported but usually indicates an error.");
@@ -597,12 +954,13 @@ WriteBase::~WriteBase() {}
 
 template <class Compressor> class WriteStream : public WriteBase {
   public:
-    WriteStream(int out, int level = 9, std::size_t compressed_buffer = 4096)
-      : buf_size_(std::max<std::size_t>(Compressor::kMinOutput, compressed_buffer)),
+    // args are for the compressor's constructor.
+    template <typename... Args> explicit WriteStream(int out, Args&&... args)
+      : buf_size_(std::max<std::size_t>(Compressor::kMinOutput, 4096)),
         buf_(buf_size_),
         writer_(out),
         dirty_(true /* Even if input is empty, generate a valid gzip file */),
-        compressor_(level) {
+        compressor_(std::forward<Args>(args)...) {
       compressor_.SetOutput(buf_.get(), buf_size_);
     }
 
@@ -669,27 +1027,261 @@ class WriteUncompressed : public WriteBase {
     FileWriter writer_;
 };
 
-WriteCompressed::WriteCompressed(int fd, WriteCompressed::Compression compression) {
+#ifdef HAVE_ZLIB
+namespace {
+
+/* Writes one gzip member per flush, like WriteStream<GZipWrite>, but
+ * compresses blocks of kBlockBytes on a pool of threads as pigz does.  Each
+ * block is raw deflate primed with the last 32 KB of the block before it, and
+ * all but the last end with a sync flush so they concatenate into one deflate
+ * stream.  The calling thread writes the blocks out in order with the header
+ * and a trailer whose CRC is combined from the blocks' CRCs.
+ */
+class GZipParallelWrite : public WriteBase {
+  public:
+    static const std::size_t kBlockBytes = 1 << 17;
+    static const std::size_t kWindowBytes = 1 << 15;
+
+    GZipParallelWrite(int out, int level, std::size_t threads)
+      : writer_(out),
+        level_(level),
+        window_size_(2 * threads),
+        todo_(window_size_),
+        dirty_(true /* Even if input is empty, generate a valid gzip file */),
+        started_(false),
+        crc_(crc32(0, Z_NULL, 0)),
+        length_(0) {
+      filling_ = NewBlock();
+      for (std::size_t i = 0; i < threads; ++i) {
+        workers_.emplace_back(&GZipParallelWrite::CompressThread, this);
+      }
+    }
+
+    ~GZipParallelWrite() {
+      for (std::size_t i = 0; i < workers_.size(); ++i) {
+        todo_.Produce(NULL);
+      }
+      for (std::thread &t : workers_) {
+        t.join();
+      }
+    }
+
+    void write(const void *data_void, std::size_t amount) {
+      const char *data = static_cast<const char*>(data_void);
+      while (amount) {
+        std::size_t take = std::min(amount, kBlockBytes - filling_->input.size());
+        filling_->input.append(data, take);
+        data += take;
+        amount -= take;
+        if (filling_->input.size() == kBlockBytes) Dispatch(false);
+      }
+      dirty_ = true;
+    }
+
+    void flush() {
+      if (!dirty_) return;
+      Dispatch(true);
+      while (!pending_.empty()) WriteFront();
+      uint8_t trailer[8];
+      for (unsigned i = 0; i < 4; ++i) {
+        trailer[i] = static_cast<uint8_t>(crc_ >> (8 * i));
+        trailer[4 + i] = static_cast<uint8_t>(length_ >> (8 * i));
+      }
+      writer_.write(trailer, sizeof(trailer));
+      writer_.flush();
+      dictionary_.clear();
+      started_ = false;
+      crc_ = crc32(0, Z_NULL, 0);
+      length_ = 0;
+      dirty_ = false; /* No need for an empty gzip after the first one */
+    }
+
+  private:
+    struct Block {
+      std::string input;
+      std::string dictionary;
+      bool last;
+      std::string output;
+      uLong crc;
+      std::exception_ptr error;
+      bool done;
+    };
+
+    std::unique_ptr<Block> NewBlock() {
+      std::unique_ptr<Block> ret;
+      if (free_.empty()) {
+        ret.reset(new Block());
+        ret->input.reserve(kBlockBytes);
+      } else {
+        ret = std::move(free_.back());
+        free_.pop_back();
+        ret->input.clear();
+      }
+      return ret;
+    }
+
+    // Send filling_ to the workers.  last ends the member.
+    void Dispatch(bool last) {
+      if (pending_.size() == window_size_) WriteFront();
+      Block *block = filling_.get();
+      block->dictionary.swap(dictionary_);
+      block->last = last;
+      block->done = false;
+      if (!last) {
+        const std::string &input = block->input;
+        std::size_t keep = std::min(input.size(), kWindowBytes);
+        dictionary_.assign(input.data() + input.size() - keep, keep);
+      }
+      pending_.push_back(std::move(filling_));
+      filling_ = NewBlock();
+      todo_.Produce(block);
+    }
+
+    void WriteFront() {
+      Block &block = *pending_.front();
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_cond_.wait(lock, [&block]{ return block.done; });
+      }
+      if (block.error) std::rethrow_exception(block.error);
+      if (!started_) {
+        // No file name or time; the last byte says Unix.
+        const uint8_t header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, static_cast<uint8_t>(level_ == 9 ? 2 : (level_ == 1 ? 4 : 0)), 3};
+        writer_.write(header, sizeof(header));
+        started_ = true;
+      }
+      writer_.write(block.output.data(), block.output.size());
+      crc_ = crc32_combine(crc_, block.crc, block.input.size());
+      length_ += block.input.size();
+      free_.push_back(std::move(pending_.front()));
+      pending_.pop_front();
+    }
+
+    void CompressThread() {
+      z_stream stream;
+      memset(&stream, 0, sizeof(stream));
+      // Raw deflate: the header and trailer are written around the blocks.
+      if (Z_OK != deflateInit2(&stream, level_, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY)) {
+        stream.state = NULL;
+      }
+      Block *block;
+      while ((block = todo_.Consume())) {
+        try {
+          UTIL_THROW_IF(!stream.state, GZException, "Failed to initialize zlib compression.");
+          Compress(stream, *block);
+        } catch (...) {
+          block->error = std::current_exception();
+        }
+        {
+          std::lock_guard<std::mutex> guard(mutex_);
+          block->done = true;
+        }
+        done_cond_.notify_all();
+      }
+      if (stream.state) deflateEnd(&stream);
+    }
+
+    void Compress(z_stream &stream, Block &block) {
+      UTIL_THROW_IF(Z_OK != deflateReset(&stream), GZException, "Trying to reset");
+      if (!block.dictionary.empty()) {
+        UTIL_THROW_IF(Z_OK != deflateSetDictionary(&stream, reinterpret_cast<const Bytef*>(block.dictionary.data()), block.dictionary.size()), GZException, "Failed to set the dictionary");
+      }
+      block.crc = crc32(0, reinterpret_cast<const Bytef*>(block.input.data()), block.input.size());
+      stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(block.input.data()));
+      stream.avail_in = block.input.size();
+      // Room for the sync flush's empty stored block too.
+      block.output.resize(deflateBound(&stream, block.input.size()) + 16);
+      stream.next_out = reinterpret_cast<Bytef*>(&block.output[0]);
+      stream.avail_out = block.output.size();
+      int flush = block.last ? Z_FINISH : Z_SYNC_FLUSH;
+      while (true) {
+        int result = deflate(&stream, flush);
+        if (result == Z_STREAM_END) break;
+        UTIL_THROW_IF(result != Z_OK && result != Z_BUF_ERROR, GZException, "zlib encountered " << (stream.msg ? stream.msg : "an error ") << " code " << result);
+        // A sync flush is done once deflate stops short of filling the output.
+        if (!block.last && stream.avail_out) break;
+        std::size_t done = block.output.size() - stream.avail_out;
+        block.output.resize(block.output.size() * 2);
+        stream.next_out = reinterpret_cast<Bytef*>(&block.output[done]);
+        stream.avail_out = block.output.size() - done;
+      }
+      block.output.resize(block.output.size() - stream.avail_out);
+    }
+
+    FileWriter writer_;
+    const int level_;
+    const std::size_t window_size_;
+
+    PCQueue<Block*> todo_;
+    std::vector<std::thread> workers_;
+
+    std::mutex mutex_;
+    std::condition_variable done_cond_;
+
+    // Only the calling thread touches these.
+    std::unique_ptr<Block> filling_;
+    // Dispatched blocks in output order.
+    std::deque<std::unique_ptr<Block> > pending_;
+    std::vector<std::unique_ptr<Block> > free_;
+    // Input for priming the next block.
+    std::string dictionary_;
+    bool dirty_;
+    // Whether this member's header was written.
+    bool started_;
+    uLong crc_;
+    uint32_t length_;
+};
+
+const std::size_t GZipParallelWrite::kBlockBytes;
+const std::size_t GZipParallelWrite::kWindowBytes;
+
+} // namespace
+#endif // HAVE_ZLIB
+
+WriteCompressed::WriteCompressed(int fd, WriteCompressed::Compression compression, int level, std::size_t threads) {
   switch (compression) {
     case NONE:
       backend_.reset(new WriteUncompressed(fd));
       return;
     case GZIP:
 #ifdef HAVE_ZLIB
-      backend_.reset(new WriteStream<GZipWrite>(fd));
+      if (threads > 1) {
+        backend_.reset(new GZipParallelWrite(fd, level < 0 ? 9 : level, threads));
+      } else {
+        backend_.reset(new WriteStream<GZipWrite>(fd, level < 0 ? 9 : level));
+      }
 #else
       UTIL_THROW(CompressedException, "gzip support not compiled in");
 #endif
       return;
     case BZIP:
 #ifdef HAVE_BZLIB
-      backend_.reset(new WriteStream<BZipWrite>(fd));
+      backend_.reset(new WriteStream<BZipWrite>(fd, level < 0 ? 9 : level));
 #else
       UTIL_THROW(CompressedException, "bzip support not compiled in");
 #endif
       return;
     case XZIP:
-      UTIL_THROW(CompressedException, "xzip writing not implemented yet");
+#ifdef HAVE_XZLIB
+      backend_.reset(new WriteStream<XZipWrite>(fd, level));
+#else
+      UTIL_THROW(CompressedException, "xz support not compiled in");
+#endif
+      return;
+    case ZSTD:
+#ifdef HAVE_ZSTD
+      backend_.reset(new WriteStream<ZStdWrite>(fd, level, threads));
+#else
+      UTIL_THROW(CompressedException, "zstd support not compiled in");
+#endif
+      return;
+    case LZ4:
+#ifdef HAVE_LZ4
+      backend_.reset(new WriteStream<LZ4Write>(fd, level));
+#else
+      UTIL_THROW(CompressedException, "LZ4 support not compiled in");
+#endif
+      return;
   }
 }
 
@@ -705,39 +1297,127 @@ void WriteCompressed::flush() {
   backend_->flush();
 }
 
-#ifdef HAVE_ZLIB
 namespace {
 
-void EnsureOutput(GZipWrite &writer, std::string &to) {
-  const std::size_t kIncrement = 4096;
-  if (!writer.EnoughOutput()) {
+template <class Writer> void EnsureOutput(Writer &writer, std::string &to) {
+  while (!writer.EnoughOutput()) {
     std::size_t old_done = writer.NextOutput() - reinterpret_cast<const uint8_t*>(to.data());
-    to.resize(to.size() + kIncrement);
+    // Double so large inputs take few passes.
+    to.resize(to.size() + std::max<std::size_t>(to.size(), 4096));
     writer.SetOutput(&to[old_done], to.size() - old_done);
   }
 }
 
-} // namespace
-
-void GZCompress(StringPiece from, std::string &to, int level) {
+template <class Writer> void CompressAll(Writer &writer, StringPiece from, std::string &to) {
   to.clear();
   to.resize(4096);
-  GZipWrite writer(level);
   writer.SetInput(from.data(), from.size());
   writer.SetOutput(&to[0], to.size());
-  while (!writer.EnoughOutput()) {
-    EnsureOutput(writer, to);
-    writer.Process();
-  }
   do {
     EnsureOutput(writer, to);
   } while (!writer.Finish());
   to.resize(writer.NextOutput() - reinterpret_cast<const uint8_t*>(to.data()));
 }
+
+} // namespace
+
+#ifdef HAVE_ZLIB
+void GZCompress(StringPiece from, std::string &to, int level) {
+  GZipWrite writer(level);
+  CompressAll(writer, from, to);
+}
+
+std::size_t GZDecompressMember(StringPiece from, std::string &to, std::size_t limit) {
+  // A member over 4 GB does not fit zlib's counters anyway.
+  GZipRead reader(from.data(), std::min<std::size_t>(from.size(), GZip::kSizeMax));
+  std::size_t start = to.size();
+  // from may run on to the end of a file, so it is only a hint for the size.
+  to.resize(start + std::max<std::size_t>(std::min<std::size_t>(from.size() * 4, 1 << 16), 4096));
+  reader.SetOutput(&to[start], to.size() - start);
+  while (reader.Process()) {
+    if (!reader.AvailOutput()) {
+      std::size_t done = reader.NextOutput() - reinterpret_cast<const uint8_t*>(to.data());
+      UTIL_THROW_IF(done - start > limit, GZException, "gzip member decompresses to more than " << limit << " bytes");
+      // Double this member's output, not whatever to already held.
+      to.resize(to.size() + (to.size() - start));
+      reader.SetOutput(&to[done], to.size() - done);
+    } else {
+      UTIL_THROW_IF(!reader.AvailInput(), GZException, "gzip member is truncated");
+    }
+  }
+  to.resize(reader.NextOutput() - reinterpret_cast<const uint8_t*>(to.data()));
+  UTIL_THROW_IF(to.size() - start > limit, GZException, "gzip member decompresses to more than " << limit << " bytes");
+  return reader.NextInput() - reinterpret_cast<const uint8_t*>(from.data());
+}
 #else
 void GZCompress(StringPiece, std::string &, int) {
   UTIL_THROW(CompressedException, "gzip not compiled in");
 }
+
+std::size_t GZDecompressMember(StringPiece, std::string &, std::size_t) {
+  UTIL_THROW(CompressedException, "gzip not compiled in");
+}
+#endif
+
+void Compress(WriteCompressed::Compression compression, StringPiece from, std::string &to, int level) {
+  switch (compression) {
+    case WriteCompressed::NONE:
+      to.assign(from.data(), from.size());
+      return;
+    case WriteCompressed::GZIP:
+      GZCompress(from, to, level);
+      return;
+    case WriteCompressed::BZIP:
+#ifdef HAVE_BZLIB
+      {
+        BZipWrite writer(level < 0 ? 9 : level);
+        CompressAll(writer, from, to);
+      }
+#else
+      UTIL_THROW(CompressedException, "bzip support not compiled in");
+#endif
+      return;
+    case WriteCompressed::XZIP:
+#ifdef HAVE_XZLIB
+      {
+        XZipWrite writer(level);
+        CompressAll(writer, from, to);
+      }
+#else
+      UTIL_THROW(CompressedException, "xz support not compiled in");
+#endif
+      return;
+    case WriteCompressed::ZSTD:
+#ifdef HAVE_ZSTD
+      {
+        ZStdWrite writer(level);
+        CompressAll(writer, from, to);
+      }
+#else
+      UTIL_THROW(CompressedException, "zstd support not compiled in");
 #endif
+      return;
+    case WriteCompressed::LZ4:
+#ifdef HAVE_LZ4
+      {
+        LZ4Write writer(level);
+        CompressAll(writer, from, to);
+      }
+#else
+      UTIL_THROW(CompressedException, "LZ4 support not compiled in");
+#endif
+      return;
+  }
+}
+
+WriteCompressed::Compression ParseCompression(StringPiece name) {
+  if (name == "none") return WriteCompressed::NONE;
+  if (name == "gzip") return WriteCompressed::GZIP;
+  if (name == "bzip2") return WriteCompressed::BZIP;
+  if (name == "xz") return WriteCompressed::XZIP;
+  if (name == "zstd") return WriteCompressed::ZSTD;
+  if (name == "lz4") return WriteCompressed::LZ4;
+  UTIL_THROW(CompressedException, "Unknown compression algorithm " << name);
+}
 
 } // namespace util
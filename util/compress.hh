@@ -6,6 +6,7 @@
 #include "util/scoped.hh"
 
 #include <cstddef>
+#include <limits>
 #include <stdint.h>
 #include <string>
 
@@ -35,6 +36,18 @@ class XZException : public CompressedException {
     ~XZException() throw();
 };
 
+class ZStdException : public CompressedException {
+  public:
+    ZStdException() throw();
+    ~ZStdException() throw();
+};
+
+class LZ4Exception : public CompressedException {
+  public:
+    LZ4Exception() throw();
+    ~LZ4Exception() throw();
+};
+
 class ReadCompressed;
 
 class ReadBase {
@@ -101,12 +114,15 @@ class WriteBase {
     WriteBase();
 };
 
-/* Currently xzip is missing */
 class WriteCompressed {
   public:
-    enum Compression { NONE, GZIP, BZIP, XZIP };
-    // Takes ownership of fd.
-    explicit WriteCompressed(int fd, Compression compression);
+    enum Compression { NONE, GZIP, BZIP, XZIP, ZSTD, LZ4 };
+    // Takes ownership of fd.  A negative level is 9 for gzip and bzip2 and the
+    // library's default otherwise.  threads is how many threads gzip and zstd
+    // use to compress; the other formats ignore it.  gzip with more than one
+    // thread compresses blocks in parallel like pigz, still writing one member
+    // per flush.
+    explicit WriteCompressed(int fd, Compression compression, int level = -1, std::size_t threads = 1);
 
     ~WriteCompressed();
 
@@ -122,6 +138,20 @@ class WriteCompressed {
 // but I needed the compression in the thread with fused output.
 void GZCompress(StringPiece from, std::string &to, int level = 9);
 
+// Decompress the gzip member at the start of from, appending to to.  Returns
+// the member's compressed size, which is where the next member starts.  Throws
+// GZException if the member is truncated or decompresses to more than about
+// limit bytes.
+std::size_t GZDecompressMember(StringPiece from, std::string &to, std::size_t limit = std::numeric_limits<std::size_t>::max());
+
+// Compress from into one complete gzip member, bzip2 or xz stream, or zstd or
+// LZ4 frame, replacing to.  Concatenating the results is a valid file of that
+// type.  A negative level is the library's default.
+void Compress(WriteCompressed::Compression compression, StringPiece from, std::string &to, int level = -1);
+
+// Parse none, gzip, bzip2, xz, zstd, or lz4.
+WriteCompressed::Compression ParseCompression(StringPiece name);
+
 } // namespace util
 
 #endif // UTIL_COMPRESS_H
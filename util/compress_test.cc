@@ -7,6 +7,7 @@
 #include <boost/test/unit_test.hpp>
 #include <boost/scoped_ptr.hpp>
 
+#include <algorithm>
 #include <fstream>
 #include <string>
 #include <cstdlib>
@@ -97,10 +98,10 @@ BOOST_AUTO_TEST_CASE(Uncompressed) {
   TestSequence("cat");
 }
 
-void WriteCompressedTest(WriteCompressed::Compression compression) {
+void WriteCompressedTest(WriteCompressed::Compression compression, std::size_t threads = 1) {
   scoped_fd file(MakeTemp(DefaultTempDirectory()));
   {
-    WriteCompressed writer(DupOrThrow(file.get()), compression);
+    WriteCompressed writer(DupOrThrow(file.get()), compression, -1, threads);
     uint32_t i = 0;
     /* Flush somewhere */
     for (; i < kSize4 / 3; ++i) {
@@ -116,6 +117,48 @@ void WriteCompressedTest(WriteCompressed::Compression compression) {
   VerifyRead(reader);
 }
 
+void ConcatenatedTest(WriteCompressed::Compression compression) {
+  std::string input;
+  input.resize(kSize4 * 4);
+  for (uint32_t i = 0; i < kSize4; ++i) {
+    memcpy(&input[i * 4], &i, sizeof(uint32_t));
+  }
+  // Two streams written back to back read as one file.
+  std::string first, second;
+  Compress(compression, StringPiece(input.data(), input.size() / 2), first);
+  Compress(compression, StringPiece(input.data() + input.size() / 2, input.size() - input.size() / 2), second, 1);
+
+  scoped_fd written(MakeTemp("compress_test"));
+  WriteOrThrow(written.get(), first.data(), first.size());
+  WriteOrThrow(written.get(), second.data(), second.size());
+  SeekOrThrow(written.get(), 0);
+  ReadCompressed reader(written.release());
+
+  std::string returned;
+  returned.resize(kSize4 * 4);
+  std::size_t got = 0;
+  while (std::size_t amount = reader.ReadOrEOF(&returned[got], returned.size() - got)) {
+    got += amount;
+    if (got == returned.size()) break;
+  }
+  BOOST_REQUIRE_EQUAL(input.size(), got);
+  BOOST_CHECK(returned == input);
+}
+
+// Reading a file cut short throws instead of returning what it got.
+template <class Exception> void TruncatedTest(WriteCompressed::Compression compression) {
+  std::string input(kSize4 * 4, 'a');
+  std::string compressed;
+  Compress(compression, input, compressed);
+
+  scoped_fd written(MakeTemp("compress_test"));
+  WriteOrThrow(written.get(), compressed.data(), compressed.size() - 3);
+  SeekOrThrow(written.get(), 0);
+  ReadCompressed reader(written.release());
+  std::string returned(input.size(), 0);
+  BOOST_CHECK_THROW(while (reader.ReadOrEOF(&returned[0], returned.size())) {}, Exception);
+}
+
 BOOST_AUTO_TEST_CASE(UncompressedWrite) {
   WriteCompressedTest(WriteCompressed::NONE);
 }
@@ -127,6 +170,29 @@ BOOST_AUTO_TEST_CASE(ReadGZ) {
 BOOST_AUTO_TEST_CASE(WriteGZ) {
   WriteCompressedTest(WriteCompressed::GZIP);
 }
+BOOST_AUTO_TEST_CASE(WriteGZThreads) {
+  WriteCompressedTest(WriteCompressed::GZIP, 3);
+}
+BOOST_AUTO_TEST_CASE(WriteGZThreadsMember) {
+  // Text spanning many blocks, with repeats for the dictionary to find.
+  std::string input;
+  for (uint32_t i = 0; input.size() < 1000000; ++i) {
+    input += std::to_string(i % 1000 * 7919) + ' ';
+  }
+  scoped_fd file(MakeTemp(DefaultTempDirectory()));
+  {
+    WriteCompressed writer(DupOrThrow(file.get()), WriteCompressed::GZIP, -1, 3);
+    for (std::size_t i = 0; i < input.size(); i += 9999) {
+      writer.write(input.data() + i, std::min<std::size_t>(9999, input.size() - i));
+    }
+  }
+  std::string compressed(SizeOrThrow(file.get()), 0);
+  ErsatzPRead(file.get(), &compressed[0], compressed.size(), 0);
+  // The blocks form one member.
+  std::string returned;
+  BOOST_CHECK_EQUAL(compressed.size(), GZDecompressMember(compressed, returned));
+  BOOST_CHECK(returned == input);
+}
 BOOST_AUTO_TEST_CASE(WriteGZString) {
   std::string input;
   input.resize(kSize4 * 4);
@@ -147,6 +213,30 @@ BOOST_AUTO_TEST_CASE(WriteGZString) {
 
   BOOST_CHECK(returned == input);
 }
+BOOST_AUTO_TEST_CASE(DecompressGZMembers) {
+  std::string input;
+  input.resize(kSize4 * 4);
+  for (uint32_t i = 0; i < kSize4; ++i) {
+    memcpy(&input[i * 4], &i, sizeof(uint32_t));
+  }
+  StringPiece first_half(input.data(), input.size() / 2);
+  StringPiece second_half(input.data() + first_half.size(), input.size() - first_half.size());
+  std::string first, second;
+  GZCompress(first_half, first);
+  GZCompress(second_half, second, 1);
+  std::string file(first + second);
+
+  std::string returned;
+  BOOST_CHECK_EQUAL(first.size(), GZDecompressMember(file, returned));
+  BOOST_CHECK(returned == first_half);
+  BOOST_CHECK_EQUAL(second.size(), GZDecompressMember(StringPiece(file.data() + first.size(), second.size()), returned));
+  BOOST_CHECK(returned == input);
+
+  std::string truncated;
+  BOOST_CHECK_THROW(GZDecompressMember(StringPiece(first.data(), first.size() - 10), truncated), GZException);
+  std::string limited;
+  BOOST_CHECK_THROW(GZDecompressMember(first, limited, 10000), GZException);
+}
 #endif // HAVE_ZLIB
 
 #ifdef HAVE_BZLIB
@@ -156,12 +246,48 @@ BOOST_AUTO_TEST_CASE(ReadBZ) {
 BOOST_AUTO_TEST_CASE(WriteBZ) {
   WriteCompressedTest(WriteCompressed::BZIP);
 }
+BOOST_AUTO_TEST_CASE(CompressBZConcatenated) {
+  ConcatenatedTest(WriteCompressed::BZIP);
+}
 #endif // HAVE_BZLIB
 
 #ifdef HAVE_XZLIB
 BOOST_AUTO_TEST_CASE(ReadXZ) {
   TestSequence("xz");
 }
+BOOST_AUTO_TEST_CASE(WriteXZ) {
+  WriteCompressedTest(WriteCompressed::XZIP);
+}
+BOOST_AUTO_TEST_CASE(CompressXZConcatenated) {
+  ConcatenatedTest(WriteCompressed::XZIP);
+}
+#endif
+
+#ifdef HAVE_ZSTD
+BOOST_AUTO_TEST_CASE(WriteZStd) {
+  WriteCompressedTest(WriteCompressed::ZSTD);
+}
+BOOST_AUTO_TEST_CASE(WriteZStdThreads) {
+  WriteCompressedTest(WriteCompressed::ZSTD, 2);
+}
+BOOST_AUTO_TEST_CASE(CompressZStdConcatenated) {
+  ConcatenatedTest(WriteCompressed::ZSTD);
+}
+BOOST_AUTO_TEST_CASE(TruncatedZStd) {
+  TruncatedTest<ZStdException>(WriteCompressed::ZSTD);
+}
+#endif
+
+#ifdef HAVE_LZ4
+BOOST_AUTO_TEST_CASE(WriteLZ4) {
+  WriteCompressedTest(WriteCompressed::LZ4);
+}
+BOOST_AUTO_TEST_CASE(CompressLZ4Concatenated) {
+  ConcatenatedTest(WriteCompressed::LZ4);
+}
+BOOST_AUTO_TEST_CASE(TruncatedLZ4) {
+  TruncatedTest<LZ4Exception>(WriteCompressed::LZ4);
+}
 #endif
 
 BOOST_AUTO_TEST_CASE(IStream) {
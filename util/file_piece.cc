@@ -3,6 +3,7 @@
 #include "util/double-conversion/double-conversion.h"
 #include "util/exception.hh"
 #include "util/file.hh"
+#include "util/find_byte.hh"
 #include "util/mmap.hh"
 
 #if defined(_WIN32) || defined(_WIN64)
@@ -76,7 +77,7 @@ FilePiece::FilePiece(std::istream &stream, const char * /*name*/, std::size_t mi
 StringPiece FilePiece::ReadLine(char delim, bool strip_cr) {
   std::size_t skip = 0;
   while (true) {
-    const char *i = std::find(position_ + skip, position_end_, delim);
+    const char *i = FindByte(position_ + skip, position_end_, delim);
     if (UTIL_LIKELY(i != position_end_)) {
       // End of line.
       // Take 1 byte off the end if it's an unwanted carriage return.
@@ -105,6 +106,26 @@ bool FilePiece::ReadLineOrEOF(StringPiece &to, char delim, bool strip_cr) {
   return true;
 }
 
+std::size_t FilePiece::ReadLines(StringPiece *to, std::size_t max, char delim, bool strip_cr) {
+  const std::size_t kBatch = 256;
+  const char *ends[kBatch];
+  std::size_t got = 0;
+  while (got < max) {
+    std::size_t want = std::min(max - got, kBatch);
+    std::size_t found = FindBytes(position_, position_end_, delim, ends, want);
+    for (std::size_t i = 0; i < found; ++i) {
+      const char *end = ends[i];
+      const std::size_t subtract_cr = (strip_cr && end > position_ && *(end - 1) == '\r') ? 1 : 0;
+      to[got++] = StringPiece(position_, end - position_ - subtract_cr);
+      position_ = end + 1;
+    }
+    if (found < want) break;
+  }
+  if (got || !max) return got;
+  // No whole line in the buffer, so let ReadLine read more.
+  return ReadLineOrEOF(*to, delim, strip_cr) ? 1 : 0;
+}
+
 float FilePiece::ReadFloat() {
   return ReadNumber<float>();
 }
@@ -127,6 +148,7 @@ void FilePiece::InitializeNoRead(const char *name, std::size_t min_buffer) {
   position_end_ = NULL;
   mapped_offset_ = 0;
   at_end_ = false;
+  want_read_ahead_ = false;
 }
 
 void FilePiece::Initialize(const char *name, std::ostream *show_progress, std::size_t min_buffer) {
@@ -356,8 +378,15 @@ void FilePiece::ReadShift() {
     }
   }
 
-  std::size_t read_return = fell_back_.Read(static_cast<uint8_t*>(data_.get()) + already_read, default_map_size_ - already_read);
-  progress_.Set(fell_back_.RawAmount());
+  std::size_t read_return;
+  if (want_read_ahead_) {
+    if (!read_ahead_) read_ahead_.reset(new ReadAhead(fell_back_, default_map_size_));
+    read_return = read_ahead_->Read(static_cast<uint8_t*>(data_.get()) + already_read, default_map_size_ - already_read);
+    progress_.Set(read_ahead_->RawAmount());
+  } else {
+    read_return = fell_back_.Read(static_cast<uint8_t*>(data_.get()) + already_read, default_map_size_ - already_read);
+    progress_.Set(fell_back_.RawAmount());
+  }
 
   if (read_return == 0) {
     at_end_ = true;
@@ -6,11 +6,13 @@
 #include "util/exception.hh"
 #include "util/file.hh"
 #include "util/mmap.hh"
+#include "util/read_ahead.hh"
 #include "util/spaces.hh"
 #include "util/string_piece.hh"
 
 #include <cstddef>
 #include <iosfwd>
+#include <memory>
 #include <string>
 #include <cassert>
 #include <stdint.h>
@@ -146,6 +148,14 @@ class FilePiece {
      */
     bool ReadLineOrEOF(StringPiece &to, char delim = '\n', bool strip_cr = true);
 
+    /** Read up to max lines into to, returning how many were read or 0 at EOF.
+     *
+     * This returns the lines already in the buffer, at least one, which saves
+     * a call per line when lines are short.  The lines are valid until the
+     * next call that reads.  Lines and strip_cr are as in ReadLineOrEOF.
+     */
+    std::size_t ReadLines(StringPiece *to, std::size_t max, char delim = '\n', bool strip_cr = true);
+
     float ReadFloat();
     double ReadDouble();
     long int ReadLong();
@@ -174,6 +184,14 @@ class FilePiece {
     // Force a progress update.
     void UpdateProgress();
 
+    /* When reading with read() rather than mmap, as for pipes and compressed
+     * files, read and decompress the next buffer on a background thread while
+     * the caller parses this one.  Returned StringPieces stay valid as before.
+     * Destruction waits for a read in progress, so only use this when the
+     * input will be read to the end or its writer will close it.
+     */
+    void StartReadAhead() { want_read_ahead_ = true; }
+
   private:
     void InitializeNoRead(const char *name, std::size_t min_buffer);
     // Calls InitializeNoRead, so don't call both.
@@ -216,6 +234,10 @@ class FilePiece {
     std::string file_name_;
 
     ReadCompressed fell_back_;
+
+    bool want_read_ahead_;
+    // Reads from fell_back_, so declared after it to be destroyed first.
+    std::unique_ptr<ReadAhead> read_ahead_;
 };
 
 } // namespace util
@@ -53,6 +53,42 @@ BOOST_AUTO_TEST_CASE(MMapReadLine) {
   BOOST_CHECK_THROW(test.get(), EndOfFileException);
 }
 
+/* Batches of lines, with a small buffer so batches end at shifts */
+BOOST_AUTO_TEST_CASE(MMapReadLines) {
+  std::fstream ref(FileLocation().c_str(), std::ios::in);
+  FilePiece test(FileLocation().c_str(), NULL, 1);
+  std::string ref_line;
+  StringPiece lines[7];
+  std::size_t got = 0, used = 0;
+  while (getline(ref, ref_line)) {
+    if (used == got) {
+      got = test.ReadLines(lines, 7);
+      used = 0;
+      BOOST_REQUIRE(got);
+    }
+    BOOST_CHECK_EQUAL(ref_line, lines[used++]);
+  }
+  BOOST_CHECK_EQUAL(used, got);
+  BOOST_CHECK_EQUAL(0, test.ReadLines(lines, 7));
+}
+
+BOOST_AUTO_TEST_CASE(ReadLinesCarriageReturn) {
+  scoped_fd file(MakeTemp("file_piece_test"));
+  const char text[] = "a\r\n\r\nb\nc";
+  WriteOrThrow(file.get(), text, sizeof(text) - 1);
+  SeekOrThrow(file.get(), 0);
+  FilePiece test(file.release());
+  StringPiece lines[5];
+  std::size_t got = test.ReadLines(lines, 5);
+  if (got < 4) got += test.ReadLines(lines + got, 5 - got);
+  BOOST_REQUIRE_EQUAL(4, got);
+  BOOST_CHECK_EQUAL("a", lines[0]);
+  BOOST_CHECK_EQUAL("", lines[1]);
+  BOOST_CHECK_EQUAL("b", lines[2]);
+  BOOST_CHECK_EQUAL("c", lines[3]);
+  BOOST_CHECK_EQUAL(0, test.ReadLines(lines, 5));
+}
+
 /* mmap with seek beforehand */
 BOOST_AUTO_TEST_CASE(MMapSeek) {
   std::fstream ref(FileLocation().c_str(), std::ios::in);
@@ -98,6 +134,27 @@ BOOST_AUTO_TEST_CASE(StreamReadLine) {
   BOOST_CHECK_THROW(test.get(), EndOfFileException);
   BOOST_REQUIRE(!pclose(catter));
 }
+
+/* read() on a background thread */
+BOOST_AUTO_TEST_CASE(StreamReadAhead) {
+  std::fstream ref(FileLocation().c_str(), std::ios::in);
+
+  std::string popen_args = "cat \"";
+  popen_args += FileLocation();
+  popen_args += '"';
+
+  FILE *catter = popen(popen_args.c_str(), "r");
+  BOOST_REQUIRE(catter);
+
+  FilePiece test(dup(fileno(catter)), "file_piece.cc", NULL, 1);
+  test.StartReadAhead();
+  std::string ref_line;
+  while (getline(ref, ref_line)) {
+    BOOST_CHECK_EQUAL(ref_line, test.ReadLine());
+  }
+  BOOST_CHECK_THROW(test.get(), EndOfFileException);
+  BOOST_REQUIRE(!pclose(catter));
+}
 #endif
 
 #ifdef HAVE_ZLIB
@@ -124,6 +181,25 @@ BOOST_AUTO_TEST_CASE(PlainZipReadLine) {
   BOOST_CHECK_THROW(test.get(), EndOfFileException);
 }
 
+// gzip file decompressed on a background thread
+BOOST_AUTO_TEST_CASE(PlainZipReadAhead) {
+  std::string location(FileLocation());
+  std::fstream ref(location.c_str(), std::ios::in);
+
+  std::string command("gzip <\"");
+  command += location + "\" >\"" + location + "\".gz";
+
+  BOOST_REQUIRE_EQUAL(0, system(command.c_str()));
+  FilePiece test((location + ".gz").c_str(), NULL, 1);
+  unlink((location + ".gz").c_str());
+  test.StartReadAhead();
+  std::string ref_line;
+  while (getline(ref, ref_line)) {
+    BOOST_CHECK_EQUAL(ref_line, test.ReadLine());
+  }
+  BOOST_CHECK_THROW(test.get(), EndOfFileException);
+}
+
 // gzip stream.  Apple doesn't like popen, fileno, dup.  This is an issue with
 // the test.
 #if !defined __APPLE__ && !defined __MINGW32__
@@ -0,0 +1,86 @@
+#include "util/find_byte.hh"
+
+#include <cstring>
+
+#include <stdint.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define UTIL_FIND_BYTE_X86
+#include <immintrin.h>
+#endif
+
+namespace util {
+
+const char *FindByte(const char *begin, const char *end, char byte) {
+  // glibc's memchr is already vectorized and picks its own instruction set.
+  const char *ret = static_cast<const char*>(memchr(begin, byte, end - begin));
+  return ret ? ret : end;
+}
+
+namespace {
+
+typedef std::size_t (*FindBytesFunction)(const char *begin, const char *end, char byte, const char **to, std::size_t max);
+
+std::size_t FindBytesScalar(const char *begin, const char *end, char byte, const char **to, std::size_t max) {
+  std::size_t found = 0;
+  for (; found < max; ++found) {
+    begin = FindByte(begin, end, byte);
+    if (begin == end) break;
+    to[found] = begin++;
+  }
+  return found;
+}
+
+#ifdef UTIL_FIND_BYTE_X86
+// Record the set bits of mask as offsets from base.  Returns true when full.
+inline bool Record(uint32_t mask, const char *base, const char **to, std::size_t &found, std::size_t max) {
+  for (; mask; mask &= mask - 1) {
+    to[found++] = base + __builtin_ctz(mask);
+    if (found == max) return true;
+  }
+  return false;
+}
+
+std::size_t FindBytesSSE2(const char *begin, const char *end, char byte, const char **to, std::size_t max) {
+  const __m128i needle = _mm_set1_epi8(byte);
+  std::size_t found = 0;
+  if (!max) return 0;
+  for (; end - begin >= 16; begin += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+    if (Record(mask, begin, to, found, max)) return found;
+  }
+  return found + FindBytesScalar(begin, end, byte, to + found, max - found);
+}
+
+__attribute__((target("avx2"))) std::size_t FindBytesAVX2(const char *begin, const char *end, char byte, const char **to, std::size_t max) {
+  const __m256i needle = _mm256_set1_epi8(byte);
+  std::size_t found = 0;
+  if (!max) return 0;
+  for (; end - begin >= 32; begin += 32) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+    if (Record(mask, begin, to, found, max)) return found;
+  }
+  return found + FindBytesScalar(begin, end, byte, to + found, max - found);
+}
+#endif // UTIL_FIND_BYTE_X86
+
+FindBytesFunction ChooseFindBytes() {
+#ifdef UTIL_FIND_BYTE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return FindBytesAVX2;
+  return FindBytesSSE2;
+#else
+  return FindBytesScalar;
+#endif
+}
+
+} // namespace
+
+std::size_t FindBytes(const char *begin, const char *end, char byte, const char **to, std::size_t max) {
+  static const FindBytesFunction chosen = ChooseFindBytes();
+  return chosen(begin, end, byte, to, max);
+}
+
+} // namespace util
@@ -0,0 +1,23 @@
+#ifndef UTIL_FIND_BYTE_H
+#define UTIL_FIND_BYTE_H
+
+#include <cstddef>
+
+namespace util {
+
+/* Searches for a byte, as used to split lines.  On x86-64, FindBytes compares
+ * 32 bytes at a time with AVX2 if the CPU has it and 16 with SSE2 otherwise,
+ * chosen on the first call.
+ */
+
+// First occurrence of byte in [begin, end), or end if there is none.
+const char *FindByte(const char *begin, const char *end, char byte);
+
+// Store pointers to the first occurrences of byte in [begin, end) in to, up to
+// max of them and in order.  Returns how many were stored.  Finding many at
+// once saves a call per line when lines are short.
+std::size_t FindBytes(const char *begin, const char *end, char byte, const char **to, std::size_t max);
+
+} // namespace util
+
+#endif // UTIL_FIND_BYTE_H
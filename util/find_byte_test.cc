@@ -0,0 +1,56 @@
+#include "util/find_byte.hh"
+
+#define BOOST_TEST_MODULE FindByteTest
+#include <boost/test/unit_test.hpp>
+
+#include <random>
+#include <string>
+#include <vector>
+
+namespace util {
+namespace {
+
+BOOST_AUTO_TEST_CASE(Empty) {
+  const char *to[1];
+  const char text[] = "";
+  BOOST_CHECK_EQUAL(text, FindByte(text, text, '\n'));
+  BOOST_CHECK_EQUAL(0, FindBytes(text, text, '\n', to, 1));
+}
+
+// Compare with a simple loop over every alignment, length, and limit.
+BOOST_AUTO_TEST_CASE(Random) {
+  std::mt19937 gen(42);
+  std::uniform_int_distribution<int> byte(0, 3);
+  std::string text(300, 0);
+  for (char &c : text) c = "\n\ra\xff"[byte(gen)];
+  std::vector<const char*> to(text.size());
+  for (std::size_t begin = 0; begin < 40; ++begin) {
+    for (std::size_t end = begin; end <= text.size(); end += 7) {
+      std::vector<const char*> expected;
+      for (std::size_t i = begin; i < end; ++i) {
+        if (text[i] == '\r') expected.push_back(&text[i]);
+      }
+      const char *b = text.data() + begin, *e = text.data() + end;
+      BOOST_CHECK_EQUAL(expected.empty() ? e : expected.front(), FindByte(b, e, '\r'));
+      for (std::size_t max : {std::size_t(0), std::size_t(1), std::size_t(5), to.size()}) {
+        std::size_t found = FindBytes(b, e, '\r', to.data(), max);
+        BOOST_REQUIRE_EQUAL(std::min(max, expected.size()), found);
+        for (std::size_t i = 0; i < found; ++i) {
+          BOOST_CHECK_EQUAL(expected[i], to[i]);
+        }
+      }
+    }
+  }
+}
+
+// Bytes with the top bit set compare as negative; make sure that works.
+BOOST_AUTO_TEST_CASE(HighByte) {
+  std::string text(100, 'a');
+  text[70] = '\xff';
+  const char *to[2];
+  BOOST_REQUIRE_EQUAL(1, FindBytes(text.data(), text.data() + text.size(), '\xff', to, 2));
+  BOOST_CHECK_EQUAL(text.data() + 70, to[0]);
+}
+
+} // namespace
+} // namespace util
@@ -0,0 +1,81 @@
+#include "util/read_ahead.hh"
+
+#include "util/compress.hh"
+
+#include <algorithm>
+#include <cstring>
+
+namespace util {
+
+ReadAhead::ReadAhead(ReadCompressed &from, std::size_t block_size)
+  : from_(from), block_size_(block_size), stop_(false), current_(0), offset_(0), raw_amount_(from.RawAmount()) {
+  for (Block &block : blocks_) {
+    block.data.call_realloc(block_size_);
+    block.size = 0;
+    block.raw_amount = 0;
+    block.full = false;
+  }
+  thread_ = std::thread(&ReadAhead::Run, this);
+}
+
+ReadAhead::~ReadAhead() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_all();
+  thread_.join();
+}
+
+std::size_t ReadAhead::Read(void *to, std::size_t amount) {
+  Block &block = blocks_[current_];
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [&block] { return block.full; });
+  }
+  if (block.error) std::rethrow_exception(block.error);
+  // End of file.  The thread has stopped and the block stays full.
+  if (!block.size) return 0;
+  std::size_t ret = std::min(amount, block.size - offset_);
+  std::memcpy(to, static_cast<const char*>(block.data.get()) + offset_, ret);
+  offset_ += ret;
+  if (offset_ == block.size) {
+    raw_amount_ = block.raw_amount;
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      block.full = false;
+    }
+    cond_.notify_all();
+    current_ ^= 1;
+    offset_ = 0;
+  }
+  return ret;
+}
+
+void ReadAhead::Run() {
+  for (std::size_t i = 0; ; i ^= 1) {
+    Block &block = blocks_[i];
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this, &block] { return stop_ || !block.full; });
+      if (stop_) return;
+    }
+    bool done;
+    try {
+      block.size = from_.Read(block.data.get(), block_size_);
+      block.raw_amount = from_.RawAmount();
+      done = !block.size;
+    } catch (...) {
+      block.error = std::current_exception();
+      done = true;
+    }
+    {
+      std::lock_guard<std::mutex> guard(mutex_);
+      block.full = true;
+    }
+    cond_.notify_all();
+    if (done) return;
+  }
+}
+
+} // namespace util
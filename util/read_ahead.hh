@@ -0,0 +1,73 @@
+#ifndef UTIL_READ_AHEAD_H
+#define UTIL_READ_AHEAD_H
+
+#include "util/scoped.hh"
+
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include <stdint.h>
+
+namespace util {
+
+class ReadCompressed;
+
+/* Reads from a ReadCompressed on a background thread, including any
+ * decompression, so the caller can parse one block while the next is read.
+ * There are two blocks: the thread fills one while Read copies out of the
+ * other.
+ *
+ * The destructor waits for a read in progress, so only use this on input
+ * that will be read to the end or whose writer will close it.
+ */
+class ReadAhead {
+  public:
+    // Does not take ownership of from, which must outlive this.  Each block is
+    // block_size bytes.
+    ReadAhead(ReadCompressed &from, std::size_t block_size);
+
+    ~ReadAhead();
+
+    // Like ReadCompressed::Read: returns up to amount bytes, blocking until
+    // some are available, or 0 at the end of the file.  Exceptions thrown
+    // while reading are rethrown here.
+    std::size_t Read(void *to, std::size_t amount);
+
+    // ReadCompressed::RawAmount as of the end of the data returned so far.
+    uint64_t RawAmount() const { return raw_amount_; }
+
+  private:
+    void Run();
+
+    struct Block {
+      scoped_malloc data;
+      std::size_t size;
+      uint64_t raw_amount;
+      std::exception_ptr error;
+      // Filled by the thread and not yet consumed by Read.  Guarded by mutex_.
+      bool full;
+    };
+
+    ReadCompressed &from_;
+    const std::size_t block_size_;
+
+    Block blocks_[2];
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool stop_;
+
+    // Only the calling thread touches these.
+    std::size_t current_, offset_;
+    uint64_t raw_amount_;
+
+    // Last so it starts after everything else is initialized.
+    std::thread thread_;
+};
+
+} // namespace util
+
+#endif // UTIL_READ_AHEAD_H
@@ -0,0 +1,310 @@
+#include "util/uring_read.hh"
+
+#include "util/exception.hh"
+#include "util/scoped.hh"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#if defined(HAVE_IO_URING)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// Old C libraries have the header but not the syscall numbers.
+#if defined(HAVE_IO_URING) && !defined(__NR_io_uring_setup)
+#undef HAVE_IO_URING
+#endif
+
+namespace util {
+
+#ifdef HAVE_IO_URING
+
+namespace {
+
+// Each ring keeps kDepth reads of kBlock bytes in flight.
+const unsigned kDepth = 4;
+const std::size_t kBlock = 1 << 20;
+
+// Mapping of one of the ring's regions.
+class Mapped {
+  public:
+    Mapped() : base_(MAP_FAILED), size_(0) {}
+
+    ~Mapped() {
+      if (base_ != MAP_FAILED) munmap(base_, size_);
+    }
+
+    // Returns false on failure so the caller can fall back.
+    bool Map(int ring_fd, std::size_t size, off_t offset) {
+      base_ = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+      size_ = size;
+      return base_ != MAP_FAILED;
+    }
+
+    template <class T> T *At(uint32_t offset) const {
+      return reinterpret_cast<T*>(static_cast<char*>(base_) + offset);
+    }
+
+  private:
+    void *base_;
+    std::size_t size_;
+};
+
+} // namespace
+
+/* Talks to the kernel with raw system calls so there is no liburing
+ * dependency.  Reads are issued in file order, one per block, and returned in
+ * the same order.
+ */
+class UringRead::Ring {
+  public:
+    // Check Valid() before use.
+    Ring(int fd, uint64_t offset, uint64_t end)
+      : fd_(fd), issue_(offset), end_(end), current_(0), position_(0), in_flight_(0), valid_(false) {
+      io_uring_params params;
+      std::memset(&params, 0, sizeof(params));
+      ring_.reset(syscall(__NR_io_uring_setup, kDepth, &params));
+      if (ring_.get() < 0) return;
+      std::size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+      std::size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = std::max(sq_size, cq_size);
+        if (!sq_map_.Map(ring_.get(), sq_size, IORING_OFF_SQ_RING)) return;
+      } else if (!sq_map_.Map(ring_.get(), sq_size, IORING_OFF_SQ_RING) || !cq_map_.Map(ring_.get(), cq_size, IORING_OFF_CQ_RING)) {
+        return;
+      }
+      const Mapped &cq = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_map_ : cq_map_;
+      if (!sqe_map_.Map(ring_.get(), params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES)) return;
+      sq_tail_ = sq_map_.At<uint32_t>(params.sq_off.tail);
+      sq_mask_ = *sq_map_.At<uint32_t>(params.sq_off.ring_mask);
+      sq_array_ = sq_map_.At<uint32_t>(params.sq_off.array);
+      sqes_ = sqe_map_.At<io_uring_sqe>(0);
+      cq_head_ = cq.At<uint32_t>(params.cq_off.head);
+      cq_tail_ = cq.At<uint32_t>(params.cq_off.tail);
+      cq_mask_ = *cq.At<uint32_t>(params.cq_off.ring_mask);
+      cqes_ = cq.At<io_uring_cqe>(params.cq_off.cqes);
+
+      for (unsigned i = 0; i < kDepth; ++i) {
+        blocks_[i].data.reset(MallocOrThrow(kBlock));
+        blocks_[i].state = Block::IDLE;
+        if (!Issue(i)) return;
+      }
+      valid_ = true;
+    }
+
+    ~Ring() {
+      // The kernel writes into the blocks until reads complete.
+      try {
+        while (in_flight_) Wait();
+      } catch (const util::Exception &) {}
+    }
+
+    bool Valid() const { return valid_; }
+
+    // Returns 0 once the end seen at construction is reached.
+    std::size_t Read(void *to, std::size_t amount) {
+      Block &block = blocks_[current_];
+      if (block.state == Block::IDLE) return 0;
+      while (block.state == Block::IN_FLIGHT) Wait();
+      if (block.result < 0) {
+        errno = -block.result;
+        UTIL_THROW_ARG(FDException, (fd_), "while reading " << block.length << " bytes at offset " << block.offset << " with io_uring");
+      }
+      if (static_cast<std::size_t>(block.result) < block.length) FinishShort(block);
+      std::size_t ret = std::min<std::size_t>(amount, block.result - position_);
+      std::memcpy(to, static_cast<const char*>(block.data.get()) + position_, ret);
+      position_ += ret;
+      if (position_ == static_cast<std::size_t>(block.result)) {
+        block.state = Block::IDLE;
+        UTIL_THROW_IF(!Issue(current_), ErrnoException, "io_uring_enter failed to submit a read");
+        current_ = (current_ + 1) % kDepth;
+        position_ = 0;
+      }
+      return ret;
+    }
+
+    // Offset of the next byte Read would return.
+    uint64_t Offset() const {
+      const Block &block = blocks_[current_];
+      return block.state == Block::IDLE ? issue_ : block.offset + position_;
+    }
+
+  private:
+    struct Block {
+      scoped_malloc data;
+      iovec vec;
+      uint64_t offset;
+      std::size_t length;
+      int64_t result;
+      enum { IDLE, IN_FLIGHT, DONE } state;
+    };
+
+    // Issue a read into block i if there is more to read.
+    bool Issue(unsigned i) {
+      if (issue_ >= end_) return true;
+      Block &block = blocks_[i];
+      block.offset = issue_;
+      block.length = std::min<uint64_t>(kBlock, end_ - issue_);
+      block.vec.iov_base = block.data.get();
+      block.vec.iov_len = block.length;
+      // READV rather than READ works on every kernel with io_uring.
+      uint32_t tail = *sq_tail_;
+      uint32_t index = tail & sq_mask_;
+      io_uring_sqe &sqe = sqes_[index];
+      std::memset(&sqe, 0, sizeof(sqe));
+      sqe.opcode = IORING_OP_READV;
+      sqe.fd = fd_;
+      sqe.addr = reinterpret_cast<uint64_t>(&block.vec);
+      sqe.len = 1;
+      sqe.off = block.offset;
+      sqe.user_data = i;
+      sq_array_[index] = index;
+      __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+      if (Enter(1, 0, 0) != 1) {
+        // Take back the entry the kernel did not consume.
+        __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+        return false;
+      }
+      block.state = Block::IN_FLIGHT;
+      ++in_flight_;
+      issue_ += block.length;
+      return true;
+    }
+
+    // Block for at least one completion and record every one available.
+    void Wait() {
+      UTIL_THROW_IF(Enter(0, 1, IORING_ENTER_GETEVENTS) < 0, ErrnoException, "io_uring_enter failed waiting for reads");
+      uint32_t head = *cq_head_;
+      uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      for (; head != tail; ++head) {
+        const io_uring_cqe &cqe = cqes_[head & cq_mask_];
+        Block &block = blocks_[cqe.user_data];
+        block.result = cqe.res;
+        block.state = Block::DONE;
+        --in_flight_;
+      }
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+
+    int Enter(unsigned to_submit, unsigned min_complete, unsigned flags) {
+      long ret;
+      do {
+        ret = syscall(__NR_io_uring_enter, ring_.get(), to_submit, min_complete, flags, NULL, 0);
+      } while (ret < 0 && errno == EINTR);
+      return ret;
+    }
+
+    // Reads may stop short, like read().  Fill in the rest of the block
+    // synchronously.  If the file shrank, end there.
+    void FinishShort(Block &block) {
+      while (static_cast<std::size_t>(block.result) < block.length) {
+        ssize_t got;
+        do {
+          got = pread(fd_, static_cast<char*>(block.data.get()) + block.result, block.length - block.result, block.offset + block.result);
+        } while (got < 0 && errno == EINTR);
+        UTIL_THROW_IF_ARG(got < 0, FDException, (fd_), "while reading " << (block.length - block.result) << " bytes at offset " << (block.offset + block.result));
+        if (!got) {
+          // Later blocks are past the end.  Read() will hand them back, so
+          // stop here instead and let the caller fall back to read().
+          end_ = issue_ = block.offset + block.result;
+          for (unsigned i = 0; i < kDepth; ++i) {
+            if (&blocks_[i] == &block) continue;
+            while (blocks_[i].state == Block::IN_FLIGHT) Wait();
+            blocks_[i].state = Block::IDLE;
+          }
+          block.length = block.result;
+          return;
+        }
+        block.result += got;
+      }
+    }
+
+    const int fd_;
+    // Offset of the next read to issue and where to stop.
+    uint64_t issue_, end_;
+
+    scoped_fd ring_;
+    Mapped sq_map_, cq_map_, sqe_map_;
+
+    uint32_t *sq_tail_, *sq_array_, sq_mask_;
+    io_uring_sqe *sqes_;
+    uint32_t *cq_head_, *cq_tail_, cq_mask_;
+    io_uring_cqe *cqes_;
+
+    Block blocks_[kDepth];
+    // Block being returned and how much of it has been returned.
+    unsigned current_;
+    std::size_t position_;
+
+    unsigned in_flight_;
+    bool valid_;
+};
+
+#else // HAVE_IO_URING
+
+class UringRead::Ring {
+  public:
+    std::size_t Read(void *, std::size_t) { return 0; }
+    uint64_t Offset() const { return 0; }
+};
+
+#endif // HAVE_IO_URING
+
+UringRead::UringRead(int fd) : fd_(fd), started_(false) {}
+
+UringRead::~UringRead() {}
+
+void UringRead::Start() {
+  started_ = true;
+#ifdef HAVE_IO_URING
+  struct stat info;
+  if (fstat(fd_.get(), &info) || !S_ISREG(info.st_mode)) return;
+  off_t offset = lseek(fd_.get(), 0, SEEK_CUR);
+  // One block at a time is no better than read().
+  if (offset < 0 || static_cast<uint64_t>(info.st_size) < static_cast<uint64_t>(offset) + 2 * kBlock) return;
+  ring_.reset(new Ring(fd_.get(), offset, info.st_size));
+  if (!ring_->Valid()) ring_.reset();
+#endif
+}
+
+void UringRead::Stop() {
+  uint64_t offset = ring_->Offset();
+  ring_.reset();
+  SeekOrThrow(fd_.get(), offset);
+}
+
+std::size_t UringRead::Read(void *to, std::size_t amount) {
+  if (!started_) Start();
+  if (ring_) {
+    if (!amount) return 0;
+    if (std::size_t got = ring_->Read(to, amount)) return got;
+    // The file may have grown since the ring started.
+    Stop();
+  }
+  return PartialRead(fd_.get(), to, amount);
+}
+
+std::size_t UringRead::ReadOrEOF(void *to_void, std::size_t amount) {
+  uint8_t *to = static_cast<uint8_t*>(to_void);
+  std::size_t remaining = amount;
+  while (remaining) {
+    std::size_t ret = Read(to, remaining);
+    if (!ret) return amount - remaining;
+    remaining -= ret;
+    to += ret;
+  }
+  return amount;
+}
+
+int UringRead::release() {
+  if (ring_) Stop();
+  return fd_.release();
+}
+
+} // namespace util
@@ -0,0 +1,56 @@
+#ifndef UTIL_URING_READ_H
+#define UTIL_URING_READ_H
+
+#include "util/file.hh"
+
+#include <cstddef>
+#include <memory>
+
+#include <stdint.h>
+
+namespace util {
+
+/* Reads a file from its current position.  Large regular files are read
+ * through io_uring with several large reads in flight so the disk sees more
+ * than one request at a time.  Pipes, small files, builds without
+ * HAVE_IO_URING, and kernels that refuse io_uring fall back to read().
+ */
+class UringRead {
+  public:
+    // Takes ownership of fd.
+    explicit UringRead(int fd);
+
+    ~UringRead();
+
+    int get() const { return fd_.get(); }
+
+    // Like PartialRead: returns at least one byte or 0 at the end of the file.
+    std::size_t Read(void *to, std::size_t amount);
+
+    // Like util::ReadOrEOF: fills to unless the file ends.
+    std::size_t ReadOrEOF(void *to, std::size_t amount);
+
+    // Waits for reads in flight, seeks fd to just after the bytes returned so
+    // far, and gives up ownership.
+    int release();
+
+  private:
+    class Ring;
+
+    // Set up the ring on the first read, if it would help.
+    void Start();
+
+    // Stop using the ring and seek to where it left off.
+    void Stop();
+
+    scoped_fd fd_;
+
+    bool started_;
+
+    // Declared after fd_ so it is destroyed first.
+    std::unique_ptr<Ring> ring_;
+};
+
+} // namespace util
+
+#endif // UTIL_URING_READ_H
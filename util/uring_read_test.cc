@@ -0,0 +1,77 @@
+#include "util/uring_read.hh"
+
+#include "util/file.hh"
+
+#define BOOST_TEST_MODULE UringReadTest
+#include <boost/test/unit_test.hpp>
+
+#include <random>
+#include <string>
+
+namespace util {
+namespace {
+
+// Large enough for several blocks, and not a multiple of the block size.
+std::string MakeText() {
+  std::string text((5 << 20) + 12345, 0);
+  std::mt19937 gen(7);
+  for (char &c : text) c = static_cast<char>(gen());
+  return text;
+}
+
+int WriteText(const std::string &text) {
+  scoped_fd file(MakeTemp(DefaultTempDirectory() + "uring_read_test"));
+  WriteOrThrow(file.get(), text.data(), text.size());
+  SeekOrThrow(file.get(), 0);
+  return file.release();
+}
+
+BOOST_AUTO_TEST_CASE(Whole) {
+  const std::string text(MakeText());
+  UringRead reader(WriteText(text));
+  std::string got(text.size() + 10, 0);
+  // Odd sizes so reads straddle blocks.
+  std::size_t done = 0;
+  for (std::size_t size = 1; done < got.size(); size = size * 3 + 1) {
+    std::size_t ret = reader.Read(&got[done], std::min(size, got.size() - done));
+    if (!ret) break;
+    done += ret;
+  }
+  BOOST_REQUIRE_EQUAL(text.size(), done);
+  got.resize(done);
+  BOOST_CHECK(text == got);
+  BOOST_CHECK_EQUAL(0, reader.Read(&got[0], 1));
+}
+
+// Start after the beginning, as ReadCompressed does after sniffing the header.
+BOOST_AUTO_TEST_CASE(Offset) {
+  const std::string text(MakeText());
+  UringRead reader(WriteText(text));
+  SeekOrThrow(reader.get(), 100);
+  std::string got(text.size(), 0);
+  BOOST_REQUIRE_EQUAL(text.size() - 100, reader.ReadOrEOF(&got[0], got.size()));
+  BOOST_CHECK(text.substr(100) == got.substr(0, text.size() - 100));
+}
+
+// Whoever takes the file descriptor continues where reading stopped.
+BOOST_AUTO_TEST_CASE(Release) {
+  const std::string text(MakeText());
+  UringRead reader(WriteText(text));
+  std::string got(text.size(), 0);
+  const std::size_t first = 3000001;
+  BOOST_REQUIRE_EQUAL(first, reader.ReadOrEOF(&got[0], first));
+  scoped_fd file(reader.release());
+  BOOST_REQUIRE_EQUAL(text.size() - first, ReadOrEOF(file.get(), &got[first], text.size() - first));
+  BOOST_CHECK(text == got);
+}
+
+BOOST_AUTO_TEST_CASE(Small) {
+  const std::string text("hello");
+  UringRead reader(WriteText(text));
+  char got[10];
+  BOOST_REQUIRE_EQUAL(5, reader.ReadOrEOF(got, sizeof(got)));
+  BOOST_CHECK_EQUAL(text, std::string(got, 5));
+}
+
+} // namespace
+} // namespace util
@@ -0,0 +1,24 @@
+#include "util/usage.hh"
+
+#include "util/exception.hh"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+namespace util {
+
+uint64_t ParseSize(const std::string &arg) {
+  char *end;
+  uint64_t ret = std::strtoull(arg.c_str(), &end, 10);
+  UTIL_THROW_IF2(end == arg.c_str(), "Could not parse size " << arg);
+  const char *suffixes = "KMGT";
+  if (*end) {
+    const char *found = std::strchr(suffixes, std::toupper(*end));
+    UTIL_THROW_IF2(!found || end[1], "Could not parse size " << arg);
+    ret <<= 10 * (found - suffixes + 1);
+  }
+  return ret;
+}
+
+} // namespace util
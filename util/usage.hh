@@ -0,0 +1,13 @@
+#ifndef UTIL_USAGE_H
+#define UTIL_USAGE_H
+#include <string>
+
+#include <stdint.h>
+
+namespace util {
+
+// Parse sizes like 10G with optional K, M, G, or T suffixes in powers of 1024.
+uint64_t ParseSize(const std::string &arg);
+
+} // namespace util
+#endif // UTIL_USAGE_H
@@ -2,16 +2,37 @@
 
 #include "util/string_piece.hh"
 
+#include <cstring>
+
+#include <stdint.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define UTIL_UTF8_X86
+#include <immintrin.h>
+#endif
+
 namespace util {
 
 NotUTF8Exception::NotUTF8Exception(const StringPiece &) throw() {}
 
 NotUTF8Exception::~NotUTF8Exception() throw() {}
 
-bool IsUTF8(const StringPiece &str) {
+namespace {
+
+typedef bool (*IsUTF8Function)(const char *begin, const char *end);
+
+// DecodeUTF8 on whatever is not ASCII, skipping ASCII 8 bytes at a time.
+bool IsUTF8Scalar(const char *begin, const char *end) {
   try {
-    for (char32_t character : DecodeUTF8Range(str)) {
-      (void)character; /*unused variable */
+    while (begin != end) {
+      uint64_t word;
+      if (end - begin >= 8 && (std::memcpy(&word, begin, 8), !(word & 0x8080808080808080ULL))) {
+        begin += 8;
+        continue;
+      }
+      std::size_t length;
+      DecodeUTF8(begin, end, &length);
+      begin += length;
     }
     return true;
   } catch (const NotUTF8Exception &) {
@@ -19,4 +40,191 @@ bool IsUTF8(const StringPiece &str) {
   }
 }
 
+#ifdef UTIL_UTF8_X86
+/* Keiser and Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte"
+ * (2021), as in simdutf.  Each byte is classified by table lookups on the high
+ * and low nibbles of the byte before it and the high nibble of itself.  The
+ * lookups AND to nonzero exactly when the pair is invalid, so this accepts the
+ * same strings as DecodeUTF8: no overlong forms, surrogates, or code points
+ * past U+10FFFF.  Third and fourth bytes are checked against the bytes two
+ * and three before.
+ */
+const uint8_t kTooShort = 1 << 0;
+const uint8_t kTooLong = 1 << 1;
+const uint8_t kOverlong3 = 1 << 2;
+const uint8_t kTooLarge = 1 << 3;
+const uint8_t kSurrogate = 1 << 4;
+const uint8_t kOverlong2 = 1 << 5;
+const uint8_t kTooLarge1000 = 1 << 6;
+const uint8_t kOverlong4 = 1 << 6;
+const uint8_t kTwoConts = 1 << 7;
+const uint8_t kCarry = kTooShort | kTooLong | kTwoConts;
+
+// High nibble of the previous byte.
+#define UTIL_UTF8_BYTE_1_HIGH \
+  kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, kTooLong, \
+  kTwoConts, kTwoConts, kTwoConts, kTwoConts, \
+  kTooShort | kOverlong2, \
+  kTooShort, \
+  kTooShort | kOverlong3 | kSurrogate, \
+  kTooShort | kTooLarge | kTooLarge1000 | kOverlong4
+// Low nibble of the previous byte.
+#define UTIL_UTF8_BYTE_1_LOW \
+  kCarry | kOverlong3 | kOverlong2 | kOverlong4, \
+  kCarry | kOverlong2, \
+  kCarry, \
+  kCarry, \
+  kCarry | kTooLarge, \
+  kCarry | kTooLarge | kTooLarge1000, \
+  kCarry | kTooLarge | kTooLarge1000, \
+  kCarry | kTooLarge | kTooLarge1000, \
+  kCarry | kTooLarge | kTooLarge1000, \
+  kCarry | kTooLarge | kTooLarge1000, \
+  kCarry | kTooLarge | kTooLarge1000, \
+  kCarry | kTooLarge | kTooLarge1000, \
+  kCarry | kTooLarge | kTooLarge1000, \
+  kCarry | kTooLarge | kTooLarge1000 | kSurrogate, \
+  kCarry | kTooLarge | kTooLarge1000, \
+  kCarry | kTooLarge | kTooLarge1000
+// High nibble of this byte.
+#define UTIL_UTF8_BYTE_2_HIGH \
+  kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, kTooShort, \
+  kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge1000 | kOverlong4, \
+  kTooLong | kOverlong2 | kTwoConts | kOverlong3 | kTooLarge, \
+  kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge, \
+  kTooLong | kOverlong2 | kTwoConts | kSurrogate | kTooLarge, \
+  kTooShort, kTooShort, kTooShort, kTooShort
+
+const uint8_t kByte1High[32] = {UTIL_UTF8_BYTE_1_HIGH, UTIL_UTF8_BYTE_1_HIGH};
+const uint8_t kByte1Low[32] = {UTIL_UTF8_BYTE_1_LOW, UTIL_UTF8_BYTE_1_LOW};
+const uint8_t kByte2High[32] = {UTIL_UTF8_BYTE_2_HIGH, UTIL_UTF8_BYTE_2_HIGH};
+
+// Subtracting these with saturation leaves nonzero where the last bytes of a
+// block start a sequence that needs more bytes.
+const uint8_t kIncomplete[32] = {
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255,
+  255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 0xF0 - 1, 0xE0 - 1, 0xC0 - 1};
+
+__attribute__((target("ssse3"))) bool IsUTF8SSSE3(const char *begin, const char *end) {
+  const __m128i byte_1_high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(kByte1High));
+  const __m128i byte_1_low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(kByte1Low));
+  const __m128i byte_2_high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(kByte2High));
+  const __m128i incomplete = _mm_loadu_si128(reinterpret_cast<const __m128i*>(kIncomplete + 16));
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  const __m128i third = _mm_set1_epi8(static_cast<char>(0xE0 - 0x80));
+  const __m128i fourth = _mm_set1_epi8(static_cast<char>(0xF0 - 0x80));
+  const __m128i top = _mm_set1_epi8(static_cast<char>(0x80));
+  __m128i prev = _mm_setzero_si128(), prev_incomplete = _mm_setzero_si128(), error = _mm_setzero_si128();
+  char padded[16];
+  while (begin != end) {
+    __m128i input;
+    if (end - begin >= 16) {
+      input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(begin));
+      begin += 16;
+    } else {
+      // Zeros are ASCII, so they end any sequence left open.
+      std::memset(padded, 0, sizeof(padded));
+      std::memcpy(padded, begin, end - begin);
+      input = _mm_loadu_si128(reinterpret_cast<const __m128i*>(padded));
+      begin = end;
+    }
+    if (!_mm_movemask_epi8(input)) {
+      // ASCII is valid unless the last block left a sequence open.
+      error = _mm_or_si128(error, prev_incomplete);
+      prev_incomplete = _mm_setzero_si128();
+      prev = input;
+      continue;
+    }
+    __m128i prev1 = _mm_alignr_epi8(input, prev, 15);
+    __m128i special = _mm_and_si128(
+        _mm_and_si128(
+          _mm_shuffle_epi8(byte_1_high, _mm_and_si128(_mm_srli_epi16(prev1, 4), nibble)),
+          _mm_shuffle_epi8(byte_1_low, _mm_and_si128(prev1, nibble))),
+        _mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(input, 4), nibble)));
+    __m128i prev2 = _mm_alignr_epi8(input, prev, 14);
+    __m128i prev3 = _mm_alignr_epi8(input, prev, 13);
+    __m128i must23 = _mm_and_si128(_mm_or_si128(_mm_subs_epu8(prev2, third), _mm_subs_epu8(prev3, fourth)), top);
+    error = _mm_or_si128(error, _mm_xor_si128(must23, special));
+    prev_incomplete = _mm_subs_epu8(input, incomplete);
+    prev = input;
+  }
+  error = _mm_or_si128(error, prev_incomplete);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(error, _mm_setzero_si128())) == 0xFFFF;
+}
+
+__attribute__((target("avx2"))) bool IsUTF8AVX2(const char *begin, const char *end) {
+  const __m256i byte_1_high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(kByte1High));
+  const __m256i byte_1_low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(kByte1Low));
+  const __m256i byte_2_high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(kByte2High));
+  const __m256i incomplete = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(kIncomplete));
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  const __m256i third = _mm256_set1_epi8(static_cast<char>(0xE0 - 0x80));
+  const __m256i fourth = _mm256_set1_epi8(static_cast<char>(0xF0 - 0x80));
+  const __m256i top = _mm256_set1_epi8(static_cast<char>(0x80));
+  __m256i prev = _mm256_setzero_si256(), prev_incomplete = _mm256_setzero_si256(), error = _mm256_setzero_si256();
+  char padded[32];
+  while (begin != end) {
+    __m256i input;
+    if (end - begin >= 32) {
+      input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(begin));
+      begin += 32;
+    } else {
+      std::memset(padded, 0, sizeof(padded));
+      std::memcpy(padded, begin, end - begin);
+      input = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(padded));
+      begin = end;
+    }
+    if (!_mm256_movemask_epi8(input)) {
+      error = _mm256_or_si256(error, prev_incomplete);
+      prev_incomplete = _mm256_setzero_si256();
+      prev = input;
+      continue;
+    }
+    // alignr works within 128-bit lanes, so line up the previous bytes first.
+    __m256i shifted = _mm256_permute2x128_si256(prev, input, 0x21);
+    __m256i prev1 = _mm256_alignr_epi8(input, shifted, 15);
+    __m256i special = _mm256_and_si256(
+        _mm256_and_si256(
+          _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+          _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+        _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+    __m256i prev2 = _mm256_alignr_epi8(input, shifted, 14);
+    __m256i prev3 = _mm256_alignr_epi8(input, shifted, 13);
+    __m256i must23 = _mm256_and_si256(_mm256_or_si256(_mm256_subs_epu8(prev2, third), _mm256_subs_epu8(prev3, fourth)), top);
+    error = _mm256_or_si256(error, _mm256_xor_si256(must23, special));
+    prev_incomplete = _mm256_subs_epu8(input, incomplete);
+    prev = input;
+  }
+  error = _mm256_or_si256(error, prev_incomplete);
+  return _mm256_testz_si256(error, error);
+}
+#endif // UTIL_UTF8_X86
+
+IsUTF8Function ChooseIsUTF8() {
+#ifdef UTIL_UTF8_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return IsUTF8AVX2;
+  if (__builtin_cpu_supports("ssse3")) return IsUTF8SSSE3;
+#endif
+  return IsUTF8Scalar;
+}
+
+} // namespace
+
+bool IsUTF8(const StringPiece &str) {
+  static const IsUTF8Function chosen = ChooseIsUTF8();
+  return chosen(str.data(), str.data() + str.size());
+}
+
+std::vector<UTF8Validator> UTF8Validators() {
+  std::vector<UTF8Validator> ret;
+  ret.push_back(UTF8Validator{"scalar", IsUTF8Scalar});
+#ifdef UTIL_UTF8_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("ssse3")) ret.push_back(UTF8Validator{"SSSE3", IsUTF8SSSE3});
+  if (__builtin_cpu_supports("avx2")) ret.push_back(UTF8Validator{"AVX2", IsUTF8AVX2});
+#endif
+  return ret;
+}
+
 } // namespace util
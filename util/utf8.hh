@@ -11,6 +11,7 @@
 
 #include <exception>
 #include <string>
+#include <vector>
 
 namespace util {
 
@@ -150,8 +151,17 @@ class DecodeUTF8Range {
     const DecodeUTF8Iterator begin_, end_;
 };
 
+// Vectorized with the best instructions the CPU has.  Accepts the same
+// strings as decoding with DecodeUTF8Range.
 bool IsUTF8(const StringPiece &text);
 
+// The validators IsUTF8 can choose from on this CPU, for tests and benchmarks.
+struct UTF8Validator {
+  const char *name;
+  bool (*function)(const char *begin, const char *end);
+};
+std::vector<UTF8Validator> UTF8Validators();
+
 } // namespace util
 
 #endif // UTIL_UTF8
@@ -4,6 +4,10 @@
 #define BOOST_TEST_MODULE UTF8Test
 #include <boost/test/unit_test.hpp>
 
+#include <random>
+#include <string>
+#include <vector>
+
 #define CHECK_LOWER(ref, from) { \
   std::string out; \
   ToLower(from, out); \
@@ -88,6 +92,110 @@ BOOST_AUTO_TEST_CASE(IsUTF8Test) {
   BOOST_CHECK(!IsUTF8("…œ\xaaÆ5œÆ5ôÆÐØôæðø"));
 }
 
+// The byte at a time validator IsUTF8 used to be.
+bool ReferenceIsUTF8(const std::string &str) {
+  try {
+    for (char32_t character : DecodeUTF8Range(str)) {
+      (void)character;
+    }
+    return true;
+  } catch (const NotUTF8Exception &) {
+    return false;
+  }
+}
+
+void AppendUTF8(char32_t c, std::string &to) {
+  if (c < 0x80) {
+    to += static_cast<char>(c);
+  } else if (c < 0x800) {
+    to += static_cast<char>(0xC0 | (c >> 6));
+    to += static_cast<char>(0x80 | (c & 0x3F));
+  } else if (c < 0x10000) {
+    to += static_cast<char>(0xE0 | (c >> 12));
+    to += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+    to += static_cast<char>(0x80 | (c & 0x3F));
+  } else {
+    to += static_cast<char>(0xF0 | (c >> 18));
+    to += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+    to += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+    to += static_cast<char>(0x80 | (c & 0x3F));
+  }
+}
+
+void CheckAllValidators(const std::string &str) {
+  bool expected = ReferenceIsUTF8(str);
+  for (const UTF8Validator &validator : UTF8Validators()) {
+    if (validator.function(str.data(), str.data() + str.size()) != expected) {
+      BOOST_ERROR(validator.name << " says " << !expected << " for " << str.size() << " bytes: " << StringPiece(str));
+    }
+  }
+}
+
+// Edge cases of each byte position, alone and after every length of padding.
+BOOST_AUTO_TEST_CASE(IsUTF8Edges) {
+  const char *cases[] = {
+    "", "a", "\xc2\x80", "\xc1\xbf", "\xc0\x80", "\xdf\xbf", "\xe0\xa0\x80", "\xe0\x9f\xbf",
+    "\xed\x9f\xbf", "\xed\xa0\x80", "\xed\xbf\xbf", "\xee\x80\x80", "\xef\xbf\xbf",
+    "\xf0\x90\x80\x80", "\xf0\x8f\xbf\xbf", "\xf4\x8f\xbf\xbf", "\xf4\x90\x80\x80",
+    "\xf5\x80\x80\x80", "\xf8\x88\x80\x80\x80", "\xff", "\x80", "\xbf", "\xc2", "\xe2\x82",
+    "\xf0\x9f\xa4", "\xe2\x82\xac\x80", "\xc2\xc2\x80"};
+  for (const char *c : cases) {
+    for (std::size_t pad = 0; pad < 70; ++pad) {
+      std::string str(pad, 'x');
+      str += c;
+      CheckAllValidators(str);
+      CheckAllValidators(str + "tail");
+    }
+  }
+}
+
+// Random mixes of valid characters and stray bytes, then single byte changes.
+BOOST_AUTO_TEST_CASE(IsUTF8Fuzz) {
+  std::mt19937 gen(12345);
+  std::uniform_int_distribution<int> kind(0, 9), byte(0, 255), length(0, 200);
+  std::uniform_int_distribution<char32_t> two(0x80, 0x7FF), three(0x800, 0xFFFF), four(0x10000, 0x10FFFF);
+  for (unsigned round = 0; round < 20000; ++round) {
+    std::string str;
+    std::size_t target = length(gen);
+    while (str.size() < target) {
+      switch (kind(gen)) {
+        case 0: case 1: case 2: case 3:
+          str += static_cast<char>(byte(gen) & 0x7F);
+          break;
+        case 4:
+          AppendUTF8(two(gen), str);
+          break;
+        case 5: case 6: {
+          char32_t c = three(gen);
+          // Surrogates are only sometimes included, making invalid strings.
+          if (c >= 0xD800 && c < 0xE000 && kind(gen)) c -= 0x800;
+          AppendUTF8(c, str);
+          break;
+        }
+        case 7:
+          AppendUTF8(four(gen), str);
+          break;
+        case 8:
+          if (!kind(gen)) str += static_cast<char>(byte(gen));
+          break;
+        default:
+          // A long ASCII stretch to exercise the fast path.
+          str.append(40, 'a');
+      }
+    }
+    CheckAllValidators(str);
+    if (!str.empty()) {
+      std::uniform_int_distribution<std::size_t> where(0, str.size() - 1);
+      for (unsigned i = 0; i < 3; ++i) {
+        std::string changed(str);
+        changed[where(gen)] = static_cast<char>(byte(gen));
+        CheckAllValidators(changed);
+        CheckAllValidators(changed.substr(0, where(gen)));
+      }
+    }
+  }
+}
+
 BOOST_AUTO_TEST_CASE(Iterator) {
   DecodeUTF8Range range("\ufeffﬁ«🤦a");
   DecodeUTF8Iterator i = range.begin();